@@ -0,0 +1,846 @@
+// Headless benchmark of the Godot-independent speech core.
+// Build with `scons benchmark`, then run bin/<target>/speech_benchmark.
+//
+// Usage: speech_benchmark [--seconds N] [--wav file.wav] [--frame-msec N] [--csv]
+//
+// Without --wav, synthetic speech-like input is generated at 44.1 kHz and
+// 48 kHz. Every stage reports frames per second, nanoseconds per frame and
+// the number of C++ heap allocations made while it ran; allocations made
+// with malloc inside opus or libsamplerate are not counted.
+// The steady-state capture path must not allocate at all, the benchmark
+// fails with exit code 2 if it does.
+//
+// With the builtin opus on x86, `scons benchmark` also builds
+// speech_benchmark_generic, linked against an opus without the SSE4.1
+// kernels. Both keep the baseline SSE and SSE2 paths, so comparing their
+// encode and decode rows shows what the run-time dispatched SSE4.1 paths
+// save, not SIMD against scalar code.
+//
+// The enhance rows time noise suppression, AGC and the limiter on the 48 kHz
+// voice, and the summary below the table gives their cost per frame as a
+// share of real time, to decide per platform whether to enable them.
+// The drift row runs the 48 kHz capture path with the scheduler defaults
+// and an input clock 200 ppm fast; it fails the run if drift correction
+// sends a block through the resampler instead of the fast path.
+// The echo cancel rows play the input as the far end through a synthetic
+// room, 60 ms late, and cancel it from the capture; the summary also gives
+// the delay found and how far the echo was turned down once converged.
+// Before exiting it also checks that the jitter buffer rejects a packet it
+// already played when it arrives again after an underrun.
+
+#include <opus.h>
+
+#include <atomic>
+#include <chrono>
+#include <math.h>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "core/audio_kernels.hpp"
+#include "core/capture_scheduler.hpp"
+#include "core/echo_canceller.hpp"
+#include "core/jitter_buffer.hpp"
+#include "core/opus_speech_encoder.hpp"
+#include "core/packet_ring_buffer.hpp"
+#include "core/scratch_arena.hpp"
+#include "core/speech_capture_pipeline.hpp"
+#include "core/speech_enhancer.hpp"
+
+using namespace godot;
+
+// speech_benchmark_generic links opus with only the baseline SSE and SSE2 paths
+#ifdef SPEECH_BENCHMARK_OPUS_GENERIC
+#define OPUS_BUILD_LABEL " (no SSE4.1)"
+#else
+#define OPUS_BUILD_LABEL ""
+#endif
+
+static std::atomic<uint64_t> allocation_count(0);
+
+void *operator new(size_t p_size) {
+	allocation_count++;
+	void *ptr = malloc(p_size ? p_size : 1);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void *operator new[](size_t p_size) {
+	allocation_count++;
+	void *ptr = malloc(p_size ? p_size : 1);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void operator delete(void *p_ptr) noexcept {
+	free(p_ptr);
+}
+
+void operator delete[](void *p_ptr) noexcept {
+	free(p_ptr);
+}
+
+void operator delete(void *p_ptr, size_t) noexcept {
+	free(p_ptr);
+}
+
+void operator delete[](void *p_ptr, size_t) noexcept {
+	free(p_ptr);
+}
+
+// The builtin opus is compiled with OVERRIDE_celt_fatal, library.cpp provides it for the GDNative build
+extern "C" void celt_fatal(const char *str, const char *file, int line) {
+	fprintf(stderr, "celt_fatal: %s (%s:%d)\n", str, file, line);
+	abort();
+}
+
+static const uint32_t VOICE_SAMPLE_RATE = 48000;
+static const uint32_t CAPTURE_BLOCK_FRAMES = 2048;
+static const uint32_t MAX_FRAME_COUNT = VOICE_SAMPLE_RATE * 120 / 1000;
+static const int MAX_PACKET_SIZE = 4000;
+
+struct StageResult {
+	std::string name;
+	uint64_t frame_count = 0;
+	uint64_t elapsed_nsec = 0;
+	uint64_t allocations = 0;
+};
+
+class StageTimer {
+	std::chrono::steady_clock::time_point start_time;
+	uint64_t start_allocations;
+	uint64_t elapsed_nsec = 0;
+	uint64_t allocations = 0;
+	bool stopped = false;
+
+public:
+	StageTimer() :
+			start_time(std::chrono::steady_clock::now()),
+			start_allocations(allocation_count) {}
+
+	// Ends the measurement. Call it before building the stage name, whose
+	// string may allocate and would otherwise be counted against the stage.
+	void stop() {
+		elapsed_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+		allocations = allocation_count - start_allocations;
+		stopped = true;
+	}
+
+	StageResult finish(const std::string &p_name, uint64_t p_frame_count) {
+		if (!stopped) {
+			stop();
+		}
+		StageResult result;
+		result.name = p_name;
+		result.frame_count = p_frame_count;
+		result.elapsed_nsec = elapsed_nsec;
+		result.allocations = allocations;
+		return result;
+	}
+};
+
+struct StereoInput {
+	std::string name;
+	uint32_t sample_rate = 0;
+	std::vector<float> samples; // Interleaved stereo
+};
+
+// Voiced harmonics with a syllable-rate envelope, pauses and a little noise,
+// so the VAD and the encoder see something closer to speech than a sine
+static StereoInput generate_synthetic_input(uint32_t p_sample_rate, float p_seconds) {
+	StereoInput input;
+	input.name = "synthetic " + std::to_string(p_sample_rate);
+	input.sample_rate = p_sample_rate;
+
+	const uint32_t frame_count = uint32_t(p_seconds * p_sample_rate);
+	input.samples.resize(size_t(frame_count) * 2);
+	uint32_t noise = 22222;
+	for (uint32_t i = 0; i < frame_count; i++) {
+		const float t = float(i) / float(p_sample_rate);
+		const float pitch = 140.0f + 30.0f * sinf(2.0f * float(M_PI) * 0.7f * t);
+		float voiced = 0.0f;
+		for (int harmonic = 1; harmonic <= 8; harmonic++) {
+			voiced += sinf(2.0f * float(M_PI) * pitch * harmonic * t) / harmonic;
+		}
+		const float syllable = 0.5f + 0.5f * sinf(2.0f * float(M_PI) * 4.0f * t);
+		// Talk for 3 seconds, then pause for 1
+		const float talking = fmodf(t, 4.0f) < 3.0f ? 1.0f : 0.0f;
+
+		noise = noise * 1664525u + 1013904223u;
+		const float white = (float(noise >> 8) / float(1 << 24)) * 2.0f - 1.0f;
+
+		const float value = 0.25f * voiced * syllable * talking + 0.002f * white;
+		input.samples[size_t(i) * 2] = value;
+		input.samples[size_t(i) * 2 + 1] = value * 0.9f;
+	}
+	return input;
+}
+
+static uint32_t read_le(const uint8_t *p_data, int p_byte_count) {
+	uint32_t value = 0;
+	for (int i = p_byte_count - 1; i >= 0; i--) {
+		value = (value << 8) | p_data[i];
+	}
+	return value;
+}
+
+// Reads 16-bit PCM or 32-bit float WAV files with one or two channels
+static bool load_wav_input(const char *p_path, StereoInput &r_input) {
+	FILE *file = fopen(p_path, "rb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s\n", p_path);
+		return false;
+	}
+	std::vector<uint8_t> bytes;
+	uint8_t chunk[65536];
+	size_t read_count = 0;
+	while ((read_count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		bytes.insert(bytes.end(), chunk, chunk + read_count);
+	}
+	fclose(file);
+
+	if (bytes.size() < 12 || memcmp(bytes.data(), "RIFF", 4) != 0 || memcmp(bytes.data() + 8, "WAVE", 4) != 0) {
+		fprintf(stderr, "%s is not a WAV file\n", p_path);
+		return false;
+	}
+
+	uint32_t format = 0;
+	uint32_t channel_count = 0;
+	uint32_t sample_rate = 0;
+	uint32_t bits_per_sample = 0;
+	const uint8_t *data = NULL;
+	uint32_t data_size = 0;
+
+	size_t offset = 12;
+	while (offset + 8 <= bytes.size()) {
+		const uint8_t *chunk_ptr = bytes.data() + offset;
+		const uint32_t chunk_size = read_le(chunk_ptr + 4, 4);
+		const uint8_t *chunk_data = chunk_ptr + 8;
+		if (offset + 8 + chunk_size > bytes.size()) {
+			break;
+		}
+		if (memcmp(chunk_ptr, "fmt ", 4) == 0 && chunk_size >= 16) {
+			format = read_le(chunk_data, 2);
+			channel_count = read_le(chunk_data + 2, 2);
+			sample_rate = read_le(chunk_data + 4, 4);
+			bits_per_sample = read_le(chunk_data + 14, 2);
+			// WAVE_FORMAT_EXTENSIBLE keeps the real format in the sub-format GUID
+			if (format == 0xFFFE && chunk_size >= 26) {
+				format = read_le(chunk_data + 24, 2);
+			}
+		} else if (memcmp(chunk_ptr, "data", 4) == 0) {
+			data = chunk_data;
+			data_size = chunk_size;
+		}
+		offset += 8 + chunk_size + (chunk_size & 1);
+	}
+
+	const bool is_pcm16 = format == 1 && bits_per_sample == 16;
+	const bool is_float32 = format == 3 && bits_per_sample == 32;
+	if (!data || (!is_pcm16 && !is_float32) || channel_count < 1 || channel_count > 2 || sample_rate == 0) {
+		fprintf(stderr, "%s: only 16-bit PCM or 32-bit float mono/stereo WAV files are supported\n", p_path);
+		return false;
+	}
+
+	const uint32_t bytes_per_frame = channel_count * bits_per_sample / 8;
+	const uint32_t frame_count = data_size / bytes_per_frame;
+	r_input.name = p_path;
+	r_input.sample_rate = sample_rate;
+	r_input.samples.resize(size_t(frame_count) * 2);
+	for (uint32_t i = 0; i < frame_count; i++) {
+		for (uint32_t channel = 0; channel < 2; channel++) {
+			const uint8_t *sample_ptr = data + size_t(i) * bytes_per_frame + (channel % channel_count) * (bits_per_sample / 8);
+			float value = 0.0f;
+			if (is_pcm16) {
+				value = float(int16_t(read_le(sample_ptr, 2))) / 32768.0f;
+			} else {
+				const uint32_t bits = read_le(sample_ptr, 4);
+				memcpy(&value, &bits, sizeof(value));
+			}
+			r_input.samples[size_t(i) * 2 + channel] = value;
+		}
+	}
+	return true;
+}
+
+static const char *resampler_quality_name(int p_quality) {
+	switch (p_quality) {
+		case SpeechCapturePipeline::RESAMPLER_SINC_BEST:
+			return "sinc best";
+		case SpeechCapturePipeline::RESAMPLER_SINC_MEDIUM:
+			return "sinc medium";
+		case SpeechCapturePipeline::RESAMPLER_SINC_FASTEST:
+			return "sinc fastest";
+		case SpeechCapturePipeline::RESAMPLER_LINEAR:
+			return "linear";
+		case SpeechCapturePipeline::RESAMPLER_POLYPHASE:
+			return "polyphase";
+	}
+	return "unknown";
+}
+
+static void print_error(const std::string &p_message) {
+	fprintf(stderr, "error: %s\n", p_message.c_str());
+}
+
+// Captures the whole input, appending the 48 kHz int16 frames to r_pcm
+static StageResult run_capture(const StereoInput &p_input, int p_quality, uint32_t p_frame_count, std::vector<int16_t> *r_pcm) {
+	SpeechCapturePipeline pipeline;
+	pipeline.set_error_handler(print_error);
+	pipeline.set_frame_count(p_frame_count);
+	pipeline.set_resampler_quality(p_quality);
+	pipeline.configure(p_input.sample_rate, VOICE_SAMPLE_RATE, CAPTURE_BLOCK_FRAMES, MAX_FRAME_COUNT);
+
+	std::vector<int16_t> frame_pcm(MAX_FRAME_COUNT);
+	const uint32_t input_frame_count = uint32_t(p_input.samples.size() / 2);
+	if (r_pcm) {
+		r_pcm->reserve(size_t(input_frame_count) * VOICE_SAMPLE_RATE / p_input.sample_rate + MAX_FRAME_COUNT);
+	}
+
+	// The first block sets up the resampler, keep it out of the measurement
+	uint32_t offset = 0;
+	pipeline.process(p_input.samples.data(), CAPTURE_BLOCK_FRAMES, frame_pcm.data(), [](const SpeechCapturePipeline::Frame &) {});
+	offset += CAPTURE_BLOCK_FRAMES;
+
+	StageTimer timer;
+	for (; offset + CAPTURE_BLOCK_FRAMES <= input_frame_count; offset += CAPTURE_BLOCK_FRAMES) {
+		pipeline.process(p_input.samples.data() + size_t(offset) * 2, CAPTURE_BLOCK_FRAMES, frame_pcm.data(),
+				[&](const SpeechCapturePipeline::Frame &p_frame) {
+					if (r_pcm) {
+						r_pcm->insert(r_pcm->end(), p_frame.pcm, p_frame.pcm + p_frame.frame_count);
+					}
+				});
+	}
+	timer.stop();
+	const uint32_t measured_frames = offset - CAPTURE_BLOCK_FRAMES;
+
+	std::string name = "capture " + p_input.name;
+	if (p_input.sample_rate != VOICE_SAMPLE_RATE) {
+		name += std::string(" (") + resampler_quality_name(p_quality) + ")";
+	}
+	return timer.finish(name, measured_frames);
+}
+
+// Everything SpeechProcessor and GodotSpeech do per captured block, from
+// the scheduler queue to the outgoing packet ring, with the same scratch
+// arena layout, optionally with echo cancellation against the input itself
+// and every enhancer stage enabled. The first quarter of the input is not
+// measured, so the resampler and the drift estimate are set up before
+// allocations are counted.
+static StageResult run_capture_path(const StereoInput &p_input, uint32_t p_frame_count, bool p_enhance) {
+	CaptureScheduler scheduler;
+	scheduler.configure(p_input.sample_rate, CAPTURE_BLOCK_FRAMES);
+
+	SpeechCapturePipeline pipeline;
+	pipeline.set_error_handler(print_error);
+	pipeline.set_frame_count(p_frame_count);
+	pipeline.configure(p_input.sample_rate, VOICE_SAMPLE_RATE, CAPTURE_BLOCK_FRAMES, MAX_FRAME_COUNT);
+	pipeline.get_echo_canceller().set_enabled(p_enhance);
+	SpeechEnhancer &enhancer = pipeline.get_speech_enhancer();
+	enhancer.set_noise_suppression_enabled(p_enhance);
+	enhancer.set_agc_enabled(p_enhance);
+	enhancer.set_limiter_enabled(p_enhance);
+
+	OpusSpeechEncoder encoder;
+	encoder.set_error_handler(print_error);
+	encoder.init(VOICE_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP);
+
+	PacketRingBuffer ring;
+	ring.resize(10, MAX_PACKET_SIZE);
+
+	ScratchArena arena;
+	arena.configure(ScratchArena::get_size<int16_t>(MAX_FRAME_COUNT) + ScratchArena::get_size<uint8_t>(MAX_PACKET_SIZE));
+	int16_t *pcm = arena.allocate<int16_t>(MAX_FRAME_COUNT);
+	uint8_t *packet = arena.allocate<uint8_t>(MAX_PACKET_SIZE);
+
+	const uint32_t input_frame_count = uint32_t(p_input.samples.size() / 2);
+	const uint32_t block_count = input_frame_count / CAPTURE_BLOCK_FRAMES;
+	const uint32_t warmup_block_count = block_count / 4;
+	uint32_t sequence = 0;
+	uint64_t measured_frames = 0;
+
+	StageTimer timer;
+	for (uint32_t block = 0; block < block_count; block++) {
+		if (block == warmup_block_count) {
+			timer = StageTimer();
+			measured_frames = 0;
+		}
+
+		const uint64_t now_usec = uint64_t(block) * CAPTURE_BLOCK_FRAMES * 1000000 / p_input.sample_rate;
+		const float *block_samples = p_input.samples.data() + size_t(block) * CAPTURE_BLOCK_FRAMES * 2;
+		scheduler.push_block(block_samples, CAPTURE_BLOCK_FRAMES, now_usec);
+		if (p_enhance) {
+			pipeline.push_echo_reference(block_samples, CAPTURE_BLOCK_FRAMES);
+		}
+		scheduler.begin_tick();
+
+		uint32_t frame_count = 0;
+		const float *stereo = scheduler.front(&frame_count);
+		while (stereo) {
+			pipeline.set_ratio_scale(scheduler.get_ratio_scale());
+			pipeline.set_stream_position(int64_t(scheduler.get_front_position()));
+			pipeline.process(stereo, frame_count, pcm, [&](const SpeechCapturePipeline::Frame &p_frame) {
+				PacketRingBuffer::PacketInfo packet_info;
+				packet_info.size = encoder.encode(p_frame.pcm, p_frame.frame_count, packet, MAX_PACKET_SIZE);
+				packet_info.loudness = p_frame.loudness;
+				packet_info.sequence = sequence++;
+				ring.push(packet, packet_info);
+			});
+			measured_frames += frame_count;
+			scheduler.pop(pipeline.is_ratio_scale_applied());
+			stereo = scheduler.front(&frame_count);
+		}
+	}
+
+	timer.stop();
+	return timer.finish("capture path " + p_input.name + (p_enhance ? " (enhanced)" : " (steady state)"), measured_frames);
+}
+
+struct DriftResult {
+	StageResult stage;
+	float measured_drift_ppm = 0.0f;
+	// Blocks that went through the resampler while measured
+	uint64_t resampled_block_count = 0;
+};
+
+// The scheduler and pipeline at their defaults, drift correction on, with
+// an input clock p_drift_ppm fast. The input is looped until the drift
+// estimate has warmed up and measured for a while longer, then at equal
+// rates every block should still take the fast path.
+static DriftResult run_capture_path_drift(const StereoInput &p_input, uint32_t p_frame_count, float p_drift_ppm) {
+	CaptureScheduler scheduler;
+	scheduler.configure(p_input.sample_rate, CAPTURE_BLOCK_FRAMES);
+
+	SpeechStats stats;
+	SpeechCapturePipeline pipeline;
+	pipeline.set_error_handler(print_error);
+	pipeline.set_frame_count(p_frame_count);
+	pipeline.configure(p_input.sample_rate, VOICE_SAMPLE_RATE, CAPTURE_BLOCK_FRAMES, MAX_FRAME_COUNT);
+	pipeline.set_stats(&stats);
+	std::vector<int16_t> frame_pcm(MAX_FRAME_COUNT);
+
+	const uint32_t input_block_count = uint32_t(p_input.samples.size() / 2) / CAPTURE_BLOCK_FRAMES;
+	const double block_usec = double(CAPTURE_BLOCK_FRAMES) * 1000000.0 / (double(p_input.sample_rate) * (1.0 + double(p_drift_ppm) / 1000000.0));
+	const uint32_t warmup_block_count = uint32_t(double(CaptureScheduler::DRIFT_WARMUP_USEC + 5000000) / block_usec);
+	const uint32_t block_count = warmup_block_count + uint32_t(10000000.0 / block_usec);
+	uint64_t resample_count_at_start = 0;
+	uint64_t measured_frames = 0;
+
+	StageTimer timer;
+	for (uint32_t block = 0; block < block_count; block++) {
+		if (block == warmup_block_count) {
+			resample_count_at_start = stats.snapshot().stages[SpeechStats::STAGE_RESAMPLE].count;
+			timer = StageTimer();
+			measured_frames = 0;
+		}
+
+		const uint64_t now_usec = uint64_t(double(block + 1) * block_usec);
+		scheduler.push_block(p_input.samples.data() + size_t(block % input_block_count) * CAPTURE_BLOCK_FRAMES * 2, CAPTURE_BLOCK_FRAMES, now_usec);
+		scheduler.begin_tick();
+
+		uint32_t frame_count = 0;
+		const float *stereo = scheduler.front(&frame_count);
+		while (stereo) {
+			pipeline.set_ratio_scale(scheduler.get_ratio_scale());
+			pipeline.process(stereo, frame_count, frame_pcm.data(), [](const SpeechCapturePipeline::Frame &) {});
+			measured_frames += frame_count;
+			scheduler.pop(pipeline.is_ratio_scale_applied());
+			stereo = scheduler.front(&frame_count);
+		}
+	}
+	timer.stop();
+
+	DriftResult result;
+	char name[64];
+	snprintf(name, sizeof(name), " (%.0f ppm drift)", p_drift_ppm);
+	result.stage = timer.finish("capture path " + p_input.name + name, measured_frames);
+	result.measured_drift_ppm = scheduler.get_drift_ppm();
+	result.resampled_block_count = stats.snapshot().stages[SpeechStats::STAGE_RESAMPLE].count - resample_count_at_start;
+	return result;
+}
+
+// Runs the enhancer over the captured voice frame by frame, like the pipeline does
+static StageResult run_enhance(const std::vector<int16_t> &p_pcm, uint32_t p_frame_count, bool p_noise_suppression, bool p_agc_limiter, const std::string &p_name) {
+	SpeechEnhancer enhancer;
+	enhancer.configure(VOICE_SAMPLE_RATE);
+	enhancer.set_noise_suppression_enabled(p_noise_suppression);
+	enhancer.set_agc_enabled(p_agc_limiter);
+	enhancer.set_limiter_enabled(p_agc_limiter);
+
+	std::vector<float> samples(p_pcm.size());
+	for (size_t i = 0; i < p_pcm.size(); i++) {
+		samples[i] = float(p_pcm[i]) / 32768.0f;
+	}
+
+	const size_t frame_total = p_pcm.size() / p_frame_count;
+	StageTimer timer;
+	for (size_t i = 0; i < frame_total; i++) {
+		enhancer.process(samples.data() + i * p_frame_count, p_frame_count, 1);
+	}
+	timer.stop();
+	return timer.finish("enhance (" + p_name + ")", uint64_t(frame_total) * p_frame_count);
+}
+
+struct EchoCancelResult {
+	StageResult stage;
+	float true_delay_msec = 0.0f;
+	float delay_msec = 0.0f;
+	// Echo energy over what is left of it, over the second half of the input
+	float erle_db = 0.0f;
+};
+
+// Plays the input as the far end into a room of a direct path and a few
+// decaying reflections, 60 ms late, and cancels it from the mono capture
+// block by block, like the pipeline does
+static EchoCancelResult run_echo_cancel(const StereoInput &p_input) {
+	const uint32_t frame_total = uint32_t(p_input.samples.size() / 2);
+	const uint32_t delay = p_input.sample_rate * 60 / 1000;
+	const uint32_t tap_count = 12;
+	uint32_t tap_offsets[tap_count];
+	float tap_gains[tap_count];
+	uint32_t random = 12345;
+	for (uint32_t i = 0; i < tap_count; i++) {
+		random = random * 1664525u + 1013904223u;
+		tap_offsets[i] = i == 0 ? 0 : (random >> 8) % (p_input.sample_rate * 50 / 1000);
+		tap_gains[i] = (i == 0 ? 0.5f : 0.25f) * expf(-float(tap_offsets[i]) / float(p_input.sample_rate / 100)) * (random & 1 ? 1.0f : -1.0f);
+	}
+
+	std::vector<float> echo(frame_total, 0.0f);
+	for (uint32_t i = 0; i < frame_total; i++) {
+		const float far = 0.5f * (p_input.samples[size_t(i) * 2] + p_input.samples[size_t(i) * 2 + 1]);
+		for (uint32_t tap = 0; tap < tap_count; tap++) {
+			const uint32_t index = i + delay + tap_offsets[tap];
+			if (index < frame_total) {
+				echo[index] += far * tap_gains[tap];
+			}
+		}
+	}
+	std::vector<float> capture(echo);
+
+	EchoCanceller echo_canceller;
+	echo_canceller.configure(p_input.sample_rate);
+	echo_canceller.set_enabled(true);
+
+	uint32_t offset = 0;
+	StageTimer timer;
+	for (; offset + CAPTURE_BLOCK_FRAMES <= frame_total; offset += CAPTURE_BLOCK_FRAMES) {
+		echo_canceller.push_reference(p_input.samples.data() + size_t(offset) * 2, CAPTURE_BLOCK_FRAMES);
+		echo_canceller.process(capture.data() + offset, CAPTURE_BLOCK_FRAMES, offset);
+	}
+	timer.stop();
+
+	EchoCancelResult result;
+	result.stage = timer.finish("echo cancel " + p_input.name, offset);
+	result.true_delay_msec = float(delay) * 1000.0f / float(p_input.sample_rate);
+	result.delay_msec = echo_canceller.get_delay_msec();
+
+	// The output runs BLOCK_SIZE samples behind the capture
+	double echo_energy = 0.0;
+	double residual_energy = 0.0;
+	for (uint32_t i = offset / 2; i + EchoCanceller::BLOCK_SIZE < offset; i++) {
+		const float residual = capture[i + EchoCanceller::BLOCK_SIZE];
+		echo_energy += double(echo[i]) * echo[i];
+		residual_energy += double(residual) * residual;
+	}
+	result.erle_db = float(10.0 * log10((echo_energy + 1e-12) / (residual_energy + 1e-12)));
+	return result;
+}
+
+struct EncodedPackets {
+	std::vector<uint8_t> bytes;
+	std::vector<int> sizes;
+};
+
+static StageResult run_encode(const std::vector<int16_t> &p_pcm, uint32_t p_frame_count, int p_complexity, EncodedPackets *r_packets) {
+	OpusSpeechEncoder encoder;
+	encoder.set_error_handler(print_error);
+	OpusSpeechEncoder::Settings settings;
+	settings.complexity = p_complexity;
+	encoder.set_settings(settings);
+	encoder.init(VOICE_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP);
+
+	const size_t packet_count = p_pcm.size() / p_frame_count;
+	r_packets->bytes.resize(packet_count * MAX_PACKET_SIZE);
+	r_packets->sizes.resize(packet_count);
+
+	StageTimer timer;
+	for (size_t i = 0; i < packet_count; i++) {
+		r_packets->sizes[i] = encoder.encode(p_pcm.data() + i * p_frame_count, p_frame_count, r_packets->bytes.data() + i * MAX_PACKET_SIZE, MAX_PACKET_SIZE);
+	}
+	timer.stop();
+	return timer.finish("encode (complexity " + std::to_string(p_complexity) + ")", uint64_t(packet_count) * p_frame_count);
+}
+
+// Decodes to float and widens to stereo in place, like SpeechProcessor does
+static StageResult run_decode(const EncodedPackets &p_packets) {
+	int error = OPUS_OK;
+	OpusDecoder *decoder = opus_decoder_create(VOICE_SAMPLE_RATE, 1, &error);
+	std::vector<float> stereo(MAX_FRAME_COUNT * 2);
+	const AudioKernels &audio_kernels = get_audio_kernels();
+
+	uint64_t decoded_frames = 0;
+	StageTimer timer;
+	for (size_t i = 0; i < p_packets.sizes.size(); i++) {
+		const int size = p_packets.sizes[i];
+		const int result = opus_decode_float(decoder, size > 0 ? p_packets.bytes.data() + i * MAX_PACKET_SIZE : NULL, size > 0 ? size : 0, stereo.data(), MAX_FRAME_COUNT, 0);
+		if (result > 0) {
+			audio_kernels.mono_to_stereo_float(stereo.data(), stereo.data(), result);
+			decoded_frames += result;
+		}
+	}
+	StageResult result = timer.finish("decode", decoded_frames);
+	opus_decoder_destroy(decoder);
+	return result;
+}
+
+// Runs each conversion kernel over the input in capture-sized blocks
+static void run_kernels(const AudioKernels &p_kernels, const StereoInput &p_input, std::vector<StageResult> &r_results) {
+	const uint32_t input_frame_count = uint32_t(p_input.samples.size() / 2);
+	const uint32_t block_count = input_frame_count / CAPTURE_BLOCK_FRAMES;
+	std::vector<float> mono(CAPTURE_BLOCK_FRAMES);
+	std::vector<int16_t> pcm(CAPTURE_BLOCK_FRAMES);
+	std::vector<float> stereo(CAPTURE_BLOCK_FRAMES * 2);
+	const std::string suffix = std::string(" (") + p_kernels.name + ")";
+
+	{
+		StageTimer timer;
+		for (uint32_t block = 0; block < block_count; block++) {
+			p_kernels.downmix_stereo_to_mono(p_input.samples.data() + size_t(block) * CAPTURE_BLOCK_FRAMES * 2, mono.data(), CAPTURE_BLOCK_FRAMES);
+		}
+		timer.stop();
+		r_results.push_back(timer.finish("downmix" + suffix, uint64_t(block_count) * CAPTURE_BLOCK_FRAMES));
+	}
+
+	volatile float loudness = 0.0f;
+	{
+		StageTimer timer;
+		for (uint32_t block = 0; block < block_count; block++) {
+			loudness = loudness + p_kernels.float_to_int16(p_input.samples.data() + size_t(block) * CAPTURE_BLOCK_FRAMES, pcm.data(), CAPTURE_BLOCK_FRAMES);
+		}
+		timer.stop();
+		r_results.push_back(timer.finish("float to int16" + suffix, uint64_t(block_count) * CAPTURE_BLOCK_FRAMES));
+	}
+
+	{
+		StageTimer timer;
+		for (uint32_t block = 0; block < block_count; block++) {
+			p_kernels.int16_to_stereo_float(pcm.data(), stereo.data(), CAPTURE_BLOCK_FRAMES);
+		}
+		timer.stop();
+		r_results.push_back(timer.finish("int16 to stereo" + suffix, uint64_t(block_count) * CAPTURE_BLOCK_FRAMES));
+	}
+}
+
+// Plays packets 0 to 3, underruns, then receives packet 2 again followed by
+// 4 to 7. Each packet must be played exactly once, in order, with the
+// repeat counted as late and no FEC or PLC for a gap that never existed.
+static bool check_jitter_buffer_rebuffer() {
+	JitterBuffer jitter_buffer;
+	jitter_buffer.resize(16, MAX_PACKET_SIZE, 480, VOICE_SAMPLE_RATE);
+
+	std::vector<uint8_t> played;
+	int concealed_count = 0;
+	const uint8_t *data = NULL;
+	int size = 0;
+	const auto pop = [&]() {
+		switch (jitter_buffer.pop(&data, &size)) {
+		case JitterBuffer::PLAYOUT_PACKET:
+			played.push_back(data[0]);
+			break;
+		case JitterBuffer::PLAYOUT_FEC:
+		case JitterBuffer::PLAYOUT_PLC:
+			concealed_count++;
+			break;
+		default:
+			break;
+		}
+	};
+
+	for (uint8_t sequence = 0; sequence < 4; sequence++) {
+		jitter_buffer.push(sequence, sequence * 480, &sequence, 1);
+		pop();
+	}
+	// Underrun, the buffer goes back to prebuffering
+	for (int i = 0; i < 3; i++) {
+		pop();
+	}
+
+	uint8_t stale_sequence = 2;
+	const bool stale_accepted = jitter_buffer.push(stale_sequence, stale_sequence * 480, &stale_sequence, 1);
+	for (uint8_t sequence = 4; sequence < 8; sequence++) {
+		jitter_buffer.push(sequence, sequence * 480, &sequence, 1);
+		pop();
+	}
+	for (int i = 0; i < 4; i++) {
+		pop();
+	}
+
+	bool in_order = played.size() == 8;
+	for (size_t i = 0; in_order && i < played.size(); i++) {
+		in_order = played[i] == i;
+	}
+	return in_order && !stale_accepted && concealed_count == 0 && jitter_buffer.get_late_packets() == 1;
+}
+
+static void print_results(const std::vector<StageResult> &p_results, bool p_csv) {
+	if (p_csv) {
+		printf("stage,frames,frames_per_sec,nsec_per_frame,allocations\n");
+	} else {
+		printf("%-48s %12s %14s %12s %8s\n", "stage", "frames", "frames/s", "ns/frame", "allocs");
+	}
+	for (size_t i = 0; i < p_results.size(); i++) {
+		const StageResult &result = p_results[i];
+		const double seconds = double(result.elapsed_nsec) / 1e9;
+		const double frames_per_second = seconds > 0.0 ? double(result.frame_count) / seconds : 0.0;
+		const double nsec_per_frame = result.frame_count ? double(result.elapsed_nsec) / double(result.frame_count) : 0.0;
+		if (p_csv) {
+			printf("\"%s\",%llu,%.0f,%.3f,%llu\n", result.name.c_str(), (unsigned long long)result.frame_count, frames_per_second, nsec_per_frame, (unsigned long long)result.allocations);
+		} else {
+			printf("%-48s %12llu %14.0f %12.3f %8llu\n", result.name.c_str(), (unsigned long long)result.frame_count, frames_per_second, nsec_per_frame, (unsigned long long)result.allocations);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	float seconds = 20.0f;
+	float frame_msec = 10.0f;
+	const char *wav_path = NULL;
+	bool csv = false;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg == "--seconds" && i + 1 < argc) {
+			seconds = float(atof(argv[++i]));
+		} else if (arg == "--wav" && i + 1 < argc) {
+			wav_path = argv[++i];
+		} else if (arg == "--frame-msec" && i + 1 < argc) {
+			frame_msec = float(atof(argv[++i]));
+		} else if (arg == "--csv") {
+			csv = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--seconds N] [--wav file.wav] [--frame-msec N] [--csv]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	const uint32_t frame_count = uint32_t(frame_msec * (VOICE_SAMPLE_RATE / 1000) + 0.5f);
+	if (!OpusSpeechEncoder::is_valid_frame_count(VOICE_SAMPLE_RATE, frame_count)) {
+		fprintf(stderr, "Frame duration must be 2.5, 5, 10, 20, 40 or 60 ms\n");
+		return 1;
+	}
+
+	std::vector<StereoInput> inputs;
+	if (wav_path) {
+		StereoInput input;
+		if (!load_wav_input(wav_path, input)) {
+			return 1;
+		}
+		inputs.push_back(input);
+	} else {
+		inputs.push_back(generate_synthetic_input(44100, seconds));
+		inputs.push_back(generate_synthetic_input(VOICE_SAMPLE_RATE, seconds));
+	}
+
+	if (!csv) {
+		printf("kernels: %s, frame: %.1f ms, opus: %s%s\n\n", get_audio_kernels().name, frame_msec, opus_get_version_string(), OPUS_BUILD_LABEL);
+	}
+
+	std::vector<StageResult> results;
+	std::vector<int16_t> voice_pcm;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		const StereoInput &input = inputs[i];
+		if (input.sample_rate == VOICE_SAMPLE_RATE) {
+			results.push_back(run_capture(input, SpeechCapturePipeline::RESAMPLER_SINC_FASTEST, frame_count, voice_pcm.empty() ? &voice_pcm : NULL));
+			continue;
+		}
+		for (int quality = SpeechCapturePipeline::RESAMPLER_SINC_BEST; quality <= SpeechCapturePipeline::RESAMPLER_POLYPHASE; quality++) {
+			results.push_back(run_capture(input, quality, frame_count, voice_pcm.empty() ? &voice_pcm : NULL));
+		}
+	}
+
+	bool capture_path_allocated = false;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		results.push_back(run_capture_path(inputs[i], frame_count, false));
+		capture_path_allocated = capture_path_allocated || results.back().allocations > 0;
+		results.push_back(run_capture_path(inputs[i], frame_count, true));
+		capture_path_allocated = capture_path_allocated || results.back().allocations > 0;
+	}
+
+	std::vector<DriftResult> drift_results;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		if (inputs[i].sample_rate == VOICE_SAMPLE_RATE) {
+			drift_results.push_back(run_capture_path_drift(inputs[i], frame_count, 200.0f));
+			results.push_back(drift_results.back().stage);
+			capture_path_allocated = capture_path_allocated || results.back().allocations > 0;
+		}
+	}
+
+	std::vector<StageResult> enhance_results;
+	enhance_results.push_back(run_enhance(voice_pcm, frame_count, true, false, "noise suppression"));
+	enhance_results.push_back(run_enhance(voice_pcm, frame_count, false, true, "agc + limiter"));
+	enhance_results.push_back(run_enhance(voice_pcm, frame_count, true, true, "all"));
+	results.insert(results.end(), enhance_results.begin(), enhance_results.end());
+
+	std::vector<EchoCancelResult> echo_cancel_results;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		echo_cancel_results.push_back(run_echo_cancel(inputs[i]));
+		results.push_back(echo_cancel_results.back().stage);
+	}
+
+	EncodedPackets packets;
+	results.push_back(run_encode(voice_pcm, frame_count, 5, &packets));
+	results.push_back(run_encode(voice_pcm, frame_count, OpusSpeechEncoder::DEFAULT_COMPLEXITY, &packets));
+	results.push_back(run_decode(packets));
+
+	run_kernels(get_scalar_audio_kernels(), inputs[0], results);
+	if (&get_audio_kernels() != &get_scalar_audio_kernels()) {
+		run_kernels(get_audio_kernels(), inputs[0], results);
+	}
+
+	print_results(results, csv);
+
+	if (!csv) {
+		printf("\n");
+		for (size_t i = 0; i < enhance_results.size(); i++) {
+			const StageResult &result = enhance_results[i];
+			const double nsec_per_sample = result.frame_count ? double(result.elapsed_nsec) / double(result.frame_count) : 0.0;
+			const double usec_per_frame = nsec_per_sample * frame_count / 1000.0;
+			printf("%-48s %8.2f usec per %.1f ms frame, %.3f%% of real time\n", result.name.c_str(), usec_per_frame, frame_msec, usec_per_frame / (frame_msec * 10.0));
+		}
+		for (size_t i = 0; i < drift_results.size(); i++) {
+			const DriftResult &result = drift_results[i];
+			printf("%-48s drift measured %.0f ppm, %llu blocks resampled\n", result.stage.name.c_str(),
+					result.measured_drift_ppm, (unsigned long long)result.resampled_block_count);
+		}
+		for (size_t i = 0; i < echo_cancel_results.size(); i++) {
+			const EchoCancelResult &result = echo_cancel_results[i];
+			const double seconds = double(result.stage.frame_count) / double(inputs[i].sample_rate);
+			printf("%-48s %.3f%% of real time, delay %.1f ms (true %.1f ms), ERLE %.1f dB\n", result.stage.name.c_str(),
+					double(result.stage.elapsed_nsec) / (seconds * 1e7), result.delay_msec, result.true_delay_msec, result.erle_db);
+		}
+	}
+
+	if (capture_path_allocated) {
+		fprintf(stderr, "error: the steady-state capture path allocated\n");
+		return 2;
+	}
+	for (size_t i = 0; i < drift_results.size(); i++) {
+		if (drift_results[i].resampled_block_count > 0) {
+			fprintf(stderr, "error: drift correction at equal rates went through the resampler\n");
+			return 2;
+		}
+	}
+	if (!check_jitter_buffer_rebuffer()) {
+		fprintf(stderr, "error: the jitter buffer accepted a packet it already played after rebuffering\n");
+		return 2;
+	}
+	return 0;
+}
@@ -136,11 +136,19 @@
 /* Run bit-exactness checks between optimized and c implementations */
 /* #undef OPUS_CHECK_ASM */
 
+/* OPUS_X86_RTCD is defined by SCsub for x86 targets, which also build the
+   SSE4.1 objects with their own ISA flags. Without it only the SSE and SSE2
+   paths every x86-64 CPU has are compiled in. */
+#ifdef OPUS_X86_RTCD
 /* Use run-time CPU capabilities detection */
-/* #define OPUS_HAVE_RTCD 1 */
+#define OPUS_HAVE_RTCD 1
 
 /* Compiler supports X86 AVX Intrinsics */
-/* #define OPUS_X86_MAY_HAVE_AVX 1 */
+#define OPUS_X86_MAY_HAVE_AVX 1
+
+/* Compiler supports X86 SSE4.1 Intrinsics */
+#define OPUS_X86_MAY_HAVE_SSE4_1 1
+#endif
 
 /* Compiler supports X86 SSE Intrinsics */
 #define OPUS_X86_MAY_HAVE_SSE 1
@@ -148,9 +156,6 @@
 /* Compiler supports X86 SSE2 Intrinsics */
 #define OPUS_X86_MAY_HAVE_SSE2 1
 
-/* Compiler supports X86 SSE4.1 Intrinsics */
-/* #define OPUS_X86_MAY_HAVE_SSE4_1 1 */
-
 /* Define if binary requires AVX intrinsics support */
 /* #undef OPUS_X86_PRESUME_AVX */
 
@@ -0,0 +1,426 @@
+#include "audio_kernels.hpp"
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AUDIO_KERNELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define AUDIO_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+// Lets single functions use instructions the rest of the build is not compiled for.
+// MSVC accepts the intrinsics without it.
+#if defined(AUDIO_KERNELS_X86) && (defined(__GNUC__) || defined(__clang__))
+#define AUDIO_KERNELS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define AUDIO_KERNELS_TARGET(isa)
+#endif
+
+using namespace godot;
+
+#define INT16_SCALE 32768.0f
+
+// Scalar reference
+
+static void downmix_stereo_to_mono_scalar(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		p_dst[i] = (p_src[i * 2] + p_src[i * 2 + 1]) * 0.5f;
+	}
+}
+
+static inline int16_t float_to_int16_sample(float p_value) {
+	const float clamped = p_value < -1.0f ? -1.0f : (p_value > 1.0f ? 1.0f : p_value);
+	const int32_t value = int32_t(clamped * INT16_SCALE);
+	return int16_t(value > 32767 ? 32767 : value);
+}
+
+static float float_to_int16_scalar(const float *p_src, int16_t *p_dst, uint32_t p_count) {
+	float sum = 0.0f;
+	for (uint32_t i = 0; i < p_count; i++) {
+		sum += fabsf(p_src[i]);
+		p_dst[i] = float_to_int16_sample(p_src[i]);
+	}
+	return sum;
+}
+
+static void int16_to_stereo_float_scalar(const int16_t *p_src, float *p_dst, uint32_t p_frame_count) {
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		const float value = float(p_src[i]) / INT16_SCALE;
+		p_dst[i * 2] = value;
+		p_dst[i * 2 + 1] = value;
+	}
+}
+
+static void mono_to_stereo_float_scalar(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	for (uint32_t i = p_frame_count; i-- > 0;) {
+		const float value = p_src[i];
+		p_dst[i * 2] = value;
+		p_dst[i * 2 + 1] = value;
+	}
+}
+
+#ifdef AUDIO_KERNELS_X86
+
+// SSE2
+
+AUDIO_KERNELS_TARGET("sse2")
+static void downmix_stereo_to_mono_sse2(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	uint32_t i = 0;
+	for (; i + 4 <= p_frame_count; i += 4) {
+		const __m128 a = _mm_loadu_ps(p_src + i * 2);
+		const __m128 b = _mm_loadu_ps(p_src + i * 2 + 4);
+		const __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(p_dst + i, _mm_mul_ps(_mm_add_ps(left, right), half));
+	}
+	downmix_stereo_to_mono_scalar(p_src + i * 2, p_dst + i, p_frame_count - i);
+}
+
+AUDIO_KERNELS_TARGET("sse2")
+static float float_to_int16_sse2(const float *p_src, int16_t *p_dst, uint32_t p_count) {
+	const __m128 minimum = _mm_set1_ps(-1.0f);
+	const __m128 maximum = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(INT16_SCALE);
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 sum = _mm_setzero_ps();
+
+	uint32_t i = 0;
+	for (; i + 8 <= p_count; i += 8) {
+		const __m128 a = _mm_loadu_ps(p_src + i);
+		const __m128 b = _mm_loadu_ps(p_src + i + 4);
+		sum = _mm_add_ps(sum, _mm_add_ps(_mm_and_ps(a, abs_mask), _mm_and_ps(b, abs_mask)));
+
+		// Clamp before converting, out of range floats convert to INT32_MIN
+		const __m128i a_int = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(a, minimum), maximum), scale));
+		const __m128i b_int = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(b, minimum), maximum), scale));
+		// packs saturates 32768 down to 32767
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(p_dst + i), _mm_packs_epi32(a_int, b_int));
+	}
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + float_to_int16_scalar(p_src + i, p_dst + i, p_count - i);
+}
+
+AUDIO_KERNELS_TARGET("sse2")
+static void int16_to_stereo_float_sse2(const int16_t *p_src, float *p_dst, uint32_t p_frame_count) {
+	const __m128 scale = _mm_set1_ps(1.0f / INT16_SCALE);
+	uint32_t i = 0;
+	for (; i + 8 <= p_frame_count; i += 8) {
+		const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_src + i));
+		// Sign extend by placing each sample in the upper half and shifting back down
+		const __m128 low = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16)), scale);
+		const __m128 high = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16)), scale);
+		float *dst = p_dst + i * 2;
+		_mm_storeu_ps(dst, _mm_unpacklo_ps(low, low));
+		_mm_storeu_ps(dst + 4, _mm_unpackhi_ps(low, low));
+		_mm_storeu_ps(dst + 8, _mm_unpacklo_ps(high, high));
+		_mm_storeu_ps(dst + 12, _mm_unpackhi_ps(high, high));
+	}
+	int16_to_stereo_float_scalar(p_src + i, p_dst + i * 2, p_frame_count - i);
+}
+
+// Blocks run from the end, each one is loaded before its stores can reach unread samples
+AUDIO_KERNELS_TARGET("sse2")
+static void mono_to_stereo_float_sse2(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	const uint32_t block_end = p_frame_count & ~3u;
+	mono_to_stereo_float_scalar(p_src + block_end, p_dst + block_end * 2, p_frame_count - block_end);
+	for (uint32_t i = block_end; i > 0;) {
+		i -= 4;
+		const __m128 values = _mm_loadu_ps(p_src + i);
+		_mm_storeu_ps(p_dst + i * 2, _mm_unpacklo_ps(values, values));
+		_mm_storeu_ps(p_dst + i * 2 + 4, _mm_unpackhi_ps(values, values));
+	}
+}
+
+// AVX2
+
+AUDIO_KERNELS_TARGET("avx2")
+static void downmix_stereo_to_mono_avx2(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	uint32_t i = 0;
+	for (; i + 8 <= p_frame_count; i += 8) {
+		const __m256 a = _mm256_loadu_ps(p_src + i * 2);
+		const __m256 b = _mm256_loadu_ps(p_src + i * 2 + 8);
+		// Shuffles stay within 128-bit lanes, the permute puts the frames back in order
+		const __m256 left = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m256 right = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		const __m256 mono = _mm256_mul_ps(_mm256_add_ps(left, right), half);
+		_mm256_storeu_ps(p_dst + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(mono), _MM_SHUFFLE(3, 1, 2, 0))));
+	}
+	downmix_stereo_to_mono_sse2(p_src + i * 2, p_dst + i, p_frame_count - i);
+}
+
+AUDIO_KERNELS_TARGET("avx2")
+static float float_to_int16_avx2(const float *p_src, int16_t *p_dst, uint32_t p_count) {
+	const __m256 minimum = _mm256_set1_ps(-1.0f);
+	const __m256 maximum = _mm256_set1_ps(1.0f);
+	const __m256 scale = _mm256_set1_ps(INT16_SCALE);
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 sum = _mm256_setzero_ps();
+
+	uint32_t i = 0;
+	for (; i + 16 <= p_count; i += 16) {
+		const __m256 a = _mm256_loadu_ps(p_src + i);
+		const __m256 b = _mm256_loadu_ps(p_src + i + 8);
+		sum = _mm256_add_ps(sum, _mm256_add_ps(_mm256_and_ps(a, abs_mask), _mm256_and_ps(b, abs_mask)));
+
+		const __m256i a_int = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(a, minimum), maximum), scale));
+		const __m256i b_int = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(b, minimum), maximum), scale));
+		const __m256i packed = _mm256_packs_epi32(a_int, b_int);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(p_dst + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	float lanes[8];
+	_mm256_storeu_ps(lanes, sum);
+	float total = 0.0f;
+	for (int lane = 0; lane < 8; lane++) {
+		total += lanes[lane];
+	}
+	return total + float_to_int16_sse2(p_src + i, p_dst + i, p_count - i);
+}
+
+AUDIO_KERNELS_TARGET("avx2")
+static void int16_to_stereo_float_avx2(const int16_t *p_src, float *p_dst, uint32_t p_frame_count) {
+	const __m256 scale = _mm256_set1_ps(1.0f / INT16_SCALE);
+	uint32_t i = 0;
+	for (; i + 8 <= p_frame_count; i += 8) {
+		const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_src + i));
+		const __m256 values = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(samples)), scale);
+		const __m256 low = _mm256_unpacklo_ps(values, values);
+		const __m256 high = _mm256_unpackhi_ps(values, values);
+		float *dst = p_dst + i * 2;
+		_mm256_storeu_ps(dst, _mm256_permute2f128_ps(low, high, 0x20));
+		_mm256_storeu_ps(dst + 8, _mm256_permute2f128_ps(low, high, 0x31));
+	}
+	int16_to_stereo_float_scalar(p_src + i, p_dst + i * 2, p_frame_count - i);
+}
+
+AUDIO_KERNELS_TARGET("avx2")
+static void mono_to_stereo_float_avx2(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	const uint32_t block_end = p_frame_count & ~7u;
+	mono_to_stereo_float_sse2(p_src + block_end, p_dst + block_end * 2, p_frame_count - block_end);
+	for (uint32_t i = block_end; i > 0;) {
+		i -= 8;
+		const __m256 values = _mm256_loadu_ps(p_src + i);
+		const __m256 low = _mm256_unpacklo_ps(values, values);
+		const __m256 high = _mm256_unpackhi_ps(values, values);
+		_mm256_storeu_ps(p_dst + i * 2, _mm256_permute2f128_ps(low, high, 0x20));
+		_mm256_storeu_ps(p_dst + i * 2 + 8, _mm256_permute2f128_ps(low, high, 0x31));
+	}
+}
+
+static bool cpu_has_sse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	// The OS must also save the YMM registers
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // AUDIO_KERNELS_X86
+
+#ifdef AUDIO_KERNELS_NEON
+
+static void downmix_stereo_to_mono_neon(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	uint32_t i = 0;
+	for (; i + 4 <= p_frame_count; i += 4) {
+		const float32x4x2_t stereo = vld2q_f32(p_src + i * 2);
+		vst1q_f32(p_dst + i, vmulq_f32(vaddq_f32(stereo.val[0], stereo.val[1]), half));
+	}
+	downmix_stereo_to_mono_scalar(p_src + i * 2, p_dst + i, p_frame_count - i);
+}
+
+static float float_to_int16_neon(const float *p_src, int16_t *p_dst, uint32_t p_count) {
+	const float32x4_t minimum = vdupq_n_f32(-1.0f);
+	const float32x4_t maximum = vdupq_n_f32(1.0f);
+	const float32x4_t scale = vdupq_n_f32(INT16_SCALE);
+	float32x4_t sum = vdupq_n_f32(0.0f);
+
+	uint32_t i = 0;
+	for (; i + 8 <= p_count; i += 8) {
+		const float32x4_t a = vld1q_f32(p_src + i);
+		const float32x4_t b = vld1q_f32(p_src + i + 4);
+		sum = vaddq_f32(sum, vaddq_f32(vabsq_f32(a), vabsq_f32(b)));
+
+		const int32x4_t a_int = vcvtq_s32_f32(vmulq_f32(vminq_f32(vmaxq_f32(a, minimum), maximum), scale));
+		const int32x4_t b_int = vcvtq_s32_f32(vmulq_f32(vminq_f32(vmaxq_f32(b, minimum), maximum), scale));
+		// vqmovn saturates 32768 down to 32767
+		vst1q_s16(p_dst + i, vcombine_s16(vqmovn_s32(a_int), vqmovn_s32(b_int)));
+	}
+
+	float lanes[4];
+	vst1q_f32(lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + float_to_int16_scalar(p_src + i, p_dst + i, p_count - i);
+}
+
+static void int16_to_stereo_float_neon(const int16_t *p_src, float *p_dst, uint32_t p_frame_count) {
+	const float32x4_t scale = vdupq_n_f32(1.0f / INT16_SCALE);
+	uint32_t i = 0;
+	for (; i + 8 <= p_frame_count; i += 8) {
+		const int16x8_t samples = vld1q_s16(p_src + i);
+		float32x4x2_t low;
+		low.val[0] = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), scale);
+		low.val[1] = low.val[0];
+		float32x4x2_t high;
+		high.val[0] = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))), scale);
+		high.val[1] = high.val[0];
+		// Interleaving a vector with itself duplicates every sample
+		vst2q_f32(p_dst + i * 2, low);
+		vst2q_f32(p_dst + i * 2 + 8, high);
+	}
+	int16_to_stereo_float_scalar(p_src + i, p_dst + i * 2, p_frame_count - i);
+}
+
+static void mono_to_stereo_float_neon(const float *p_src, float *p_dst, uint32_t p_frame_count) {
+	const uint32_t block_end = p_frame_count & ~3u;
+	mono_to_stereo_float_scalar(p_src + block_end, p_dst + block_end * 2, p_frame_count - block_end);
+	for (uint32_t i = block_end; i > 0;) {
+		i -= 4;
+		float32x4x2_t stereo;
+		stereo.val[0] = vld1q_f32(p_src + i);
+		stereo.val[1] = stereo.val[0];
+		vst2q_f32(p_dst + i * 2, stereo);
+	}
+}
+
+#endif // AUDIO_KERNELS_NEON
+
+const AudioKernels &godot::get_scalar_audio_kernels() {
+	static const AudioKernels kernels = {
+		"scalar",
+		downmix_stereo_to_mono_scalar,
+		float_to_int16_scalar,
+		int16_to_stereo_float_scalar,
+		mono_to_stereo_float_scalar,
+	};
+	return kernels;
+}
+
+bool godot::verify_audio_kernels(const AudioKernels &p_kernels) {
+	// Odd length to exercise the scalar tails, with samples well past full scale
+	const uint32_t frame_count = 1031;
+	std::vector<float> stereo(frame_count * 2);
+	std::vector<int16_t> pcm(frame_count);
+	for (uint32_t i = 0; i < frame_count * 2; i++) {
+		stereo[i] = sinf(float(i) * 0.05f) * 1.5f;
+	}
+	for (uint32_t i = 0; i < frame_count; i++) {
+		pcm[i] = int16_t((i * 2654435761u) >> 16);
+	}
+
+	const AudioKernels &reference = get_scalar_audio_kernels();
+
+	std::vector<float> mono(frame_count), mono_reference(frame_count);
+	p_kernels.downmix_stereo_to_mono(stereo.data(), mono.data(), frame_count);
+	reference.downmix_stereo_to_mono(stereo.data(), mono_reference.data(), frame_count);
+	if (memcmp(mono.data(), mono_reference.data(), frame_count * sizeof(float)) != 0) {
+		return false;
+	}
+
+	std::vector<int16_t> converted(frame_count * 2), converted_reference(frame_count * 2);
+	const float sum = p_kernels.float_to_int16(stereo.data(), converted.data(), frame_count * 2);
+	const float sum_reference = reference.float_to_int16(stereo.data(), converted_reference.data(), frame_count * 2);
+	if (memcmp(converted.data(), converted_reference.data(), frame_count * 2 * sizeof(int16_t)) != 0) {
+		return false;
+	}
+	// Summation order differs between kernels
+	if (fabsf(sum - sum_reference) > sum_reference * 1e-4f) {
+		return false;
+	}
+
+	std::vector<float> expanded(frame_count * 2), expanded_reference(frame_count * 2);
+	p_kernels.int16_to_stereo_float(pcm.data(), expanded.data(), frame_count);
+	reference.int16_to_stereo_float(pcm.data(), expanded_reference.data(), frame_count);
+	if (memcmp(expanded.data(), expanded_reference.data(), frame_count * 2 * sizeof(float)) != 0) {
+		return false;
+	}
+
+	// Widened in place, the way the decoders use it
+	std::vector<float> widened(frame_count * 2), widened_reference(frame_count * 2);
+	memcpy(widened.data(), mono_reference.data(), frame_count * sizeof(float));
+	p_kernels.mono_to_stereo_float(widened.data(), widened.data(), frame_count);
+	reference.mono_to_stereo_float(mono_reference.data(), widened_reference.data(), frame_count);
+	if (memcmp(widened.data(), widened_reference.data(), frame_count * 2 * sizeof(float)) != 0) {
+		return false;
+	}
+
+	return true;
+}
+
+static const AudioKernels &select_audio_kernels() {
+#ifdef AUDIO_KERNELS_X86
+	static const AudioKernels avx2_kernels = {
+		"avx2",
+		downmix_stereo_to_mono_avx2,
+		float_to_int16_avx2,
+		int16_to_stereo_float_avx2,
+		mono_to_stereo_float_avx2,
+	};
+	static const AudioKernels sse2_kernels = {
+		"sse2",
+		downmix_stereo_to_mono_sse2,
+		float_to_int16_sse2,
+		int16_to_stereo_float_sse2,
+		mono_to_stereo_float_sse2,
+	};
+	if (cpu_has_avx2() && verify_audio_kernels(avx2_kernels)) {
+		return avx2_kernels;
+	}
+	if (cpu_has_sse2() && verify_audio_kernels(sse2_kernels)) {
+		return sse2_kernels;
+	}
+#endif
+#ifdef AUDIO_KERNELS_NEON
+	static const AudioKernels neon_kernels = {
+		"neon",
+		downmix_stereo_to_mono_neon,
+		float_to_int16_neon,
+		int16_to_stereo_float_neon,
+		mono_to_stereo_float_neon,
+	};
+	if (verify_audio_kernels(neon_kernels)) {
+		return neon_kernels;
+	}
+#endif
+	return get_scalar_audio_kernels();
+}
+
+const AudioKernels &godot::get_audio_kernels() {
+	static const AudioKernels &kernels = select_audio_kernels();
+	return kernels;
+}
@@ -0,0 +1,43 @@
+#ifndef AUDIO_KERNELS_HPP
+#define AUDIO_KERNELS_HPP
+
+#include <stdint.h>
+
+namespace godot {
+
+// Per-sample conversions used on the capture and playback paths.
+// Every kernel has a scalar reference; SSE2, AVX2 and NEON versions are
+// picked once at runtime from what the CPU supports. Conversions to
+// int16 saturate instead of wrapping on clipped input.
+struct AudioKernels {
+	const char *name;
+
+	// Averages interleaved stereo into mono
+	void (*downmix_stereo_to_mono)(const float *p_src, float *p_dst, uint32_t p_frame_count);
+
+	// Converts -1..1 floats to int16 and returns the sum of the absolute
+	// input values, for the loudness of the frame
+	float (*float_to_int16)(const float *p_src, int16_t *p_dst, uint32_t p_count);
+
+	// Converts int16 to floats written twice, once per stereo channel
+	void (*int16_to_stereo_float)(const int16_t *p_src, float *p_dst, uint32_t p_frame_count);
+
+	// Writes every float twice, once per stereo channel. Works back to
+	// front, so p_dst may be the same buffer as p_src to widen in place.
+	void (*mono_to_stereo_float)(const float *p_src, float *p_dst, uint32_t p_frame_count);
+};
+
+// The portable reference implementation
+const AudioKernels &get_scalar_audio_kernels();
+
+// The fastest kernels this CPU supports that also agree with the scalar
+// reference, checked the first time this is called
+const AudioKernels &get_audio_kernels();
+
+// Runs p_kernels and the scalar reference over the same input, including
+// out of range samples, and returns whether the outputs match
+bool verify_audio_kernels(const AudioKernels &p_kernels);
+
+}; // namespace godot
+
+#endif // AUDIO_KERNELS_HPP
@@ -0,0 +1,354 @@
+#ifndef CAPTURE_SCHEDULER_HPP
+#define CAPTURE_SCHEDULER_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace godot {
+
+// Paces capture blocks between the audio input and the capture pipeline.
+// Every block waiting in the input is queued here each tick, so the queue
+// depth is the capture latency, but only max_blocks_per_tick are handed on
+// per tick. Beyond the latency target the excess is time-compressed by
+// shrinking the resample ratio, and beyond max_latency the oldest blocks
+// are dropped outright. Separately, the real input rate is measured against
+// the steady clock and the ratio corrected, so a microphone whose clock
+// runs fast or slow still yields exactly the codec rate.
+// The settings may be changed from any thread, everything else must be
+// called from the thread draining the input.
+class CaptureScheduler {
+public:
+	static constexpr float DEFAULT_LATENCY_TARGET_MSEC = 100.0f;
+	static constexpr float DEFAULT_MAX_LATENCY_MSEC = 300.0f;
+	static const int DEFAULT_MAX_BLOCKS_PER_TICK = 4;
+	// Most audio removed while catching up, 5% is hard to hear on voice
+	static constexpr float DEFAULT_MAX_TIME_COMPRESSION = 0.05f;
+	// Consumer sound cards are usually within a few hundred ppm
+	static constexpr float MAX_DRIFT_PPM = 2000.0f;
+	// Queue storage is sized for this, max_latency is clamped to it
+	static constexpr float MAX_LATENCY_LIMIT_MSEC = 1000.0f;
+	// Input measured before the drift estimate is trusted
+	static const uint64_t DRIFT_WARMUP_USEC = 20000000;
+	// A gap this long between blocks is treated as a stall
+	static const uint64_t DRIFT_STALL_USEC = 250000;
+
+private:
+	std::atomic<float> latency_target_msec;
+	std::atomic<float> max_latency_msec;
+	std::atomic<int> max_blocks_per_tick;
+	std::atomic<float> max_time_compression;
+	std::atomic<bool> drift_correction;
+	std::atomic<bool> reset_pending;
+
+	// Reported to other threads
+	std::atomic<float> drift_ppm;
+	std::atomic<uint32_t> backlog_frame_count;
+
+	uint32_t sample_rate = 0;
+	uint32_t block_frame_count = 0;
+	uint32_t block_capacity = 0;
+
+	// Ring of interleaved stereo blocks
+	std::vector<float> block_samples;
+	std::vector<uint32_t> block_frame_counts;
+	uint32_t block_head = 0;
+	uint32_t block_count = 0;
+	uint32_t queued_frame_count = 0;
+	// Every frame pushed since the reset, dropped ones included
+	uint64_t received_frame_count = 0;
+	int tick_budget = 0;
+
+	// Frames queued beyond the target that have yet to be compressed away
+	double latency_debt = 0.0;
+
+	// Drift is the slope of a least-squares line through the input received
+	// beyond the nominal rate over time, one point per tick. Blocks arrive in
+	// bursts, so any single point is off by up to a block, but the fit
+	// settles as points accumulate. Input may be lost during a stall, so
+	// afterwards the count is shifted back onto the line.
+	bool drift_started = false;
+	bool drift_stalled = false;
+	bool drift_point_pending = false;
+	uint64_t drift_start_usec = 0;
+	uint64_t drift_last_usec = 0;
+	double drift_frame_count = 0.0;
+	double fit_count = 0.0;
+	double fit_sum_t = 0.0;
+	double fit_sum_tt = 0.0;
+	double fit_sum_e = 0.0;
+	double fit_sum_te = 0.0;
+
+	uint32_t msec_to_frames(float p_msec) const {
+		return uint32_t(double(p_msec) * sample_rate / 1000.0);
+	}
+
+	void drop_oldest() {
+		queued_frame_count -= block_frame_counts[block_head];
+		latency_debt -= block_frame_counts[block_head];
+		if (latency_debt < 0.0) {
+			latency_debt = 0.0;
+		}
+		block_head = (block_head + 1) % block_capacity;
+		block_count--;
+	}
+
+	void apply_reset() {
+		block_head = 0;
+		block_count = 0;
+		queued_frame_count = 0;
+		received_frame_count = 0;
+		tick_budget = 0;
+		latency_debt = 0.0;
+		drift_started = false;
+		drift_stalled = false;
+		drift_point_pending = false;
+		drift_frame_count = 0.0;
+		fit_count = 0.0;
+		fit_sum_t = 0.0;
+		fit_sum_tt = 0.0;
+		fit_sum_e = 0.0;
+		fit_sum_te = 0.0;
+		drift_ppm = 0.0f;
+		backlog_frame_count = 0;
+	}
+
+	void check_reset() {
+		if (reset_pending.exchange(false)) {
+			apply_reset();
+		}
+	}
+
+	void count_drift_frames(uint32_t p_frame_count, uint64_t p_now_usec) {
+		if (!drift_started) {
+			drift_started = true;
+			drift_start_usec = p_now_usec;
+		} else if (p_now_usec - drift_last_usec > DRIFT_STALL_USEC) {
+			drift_stalled = true;
+		}
+		drift_last_usec = p_now_usec;
+		drift_frame_count += p_frame_count;
+		drift_point_pending = true;
+	}
+
+	void add_drift_point() {
+		if (!drift_point_pending) {
+			return;
+		}
+		drift_point_pending = false;
+
+		const double t = double(drift_last_usec - drift_start_usec) / 1000000.0;
+		double excess = drift_frame_count - t * sample_rate;
+		const double denominator = fit_count * fit_sum_tt - fit_sum_t * fit_sum_t;
+		if (drift_stalled && fit_count >= 2.0 && denominator > 0.0) {
+			const double slope = (fit_count * fit_sum_te - fit_sum_t * fit_sum_e) / denominator;
+			const double intercept = (fit_sum_e - slope * fit_sum_t) / fit_count;
+			drift_frame_count += intercept + slope * t - excess;
+			excess = intercept + slope * t;
+		}
+		drift_stalled = false;
+
+		fit_count += 1.0;
+		fit_sum_t += t;
+		fit_sum_tt += t * t;
+		fit_sum_e += excess;
+		fit_sum_te += t * excess;
+
+		const double new_denominator = fit_count * fit_sum_tt - fit_sum_t * fit_sum_t;
+		if (!drift_correction || t < double(DRIFT_WARMUP_USEC) / 1000000.0 || new_denominator <= 0.0) {
+			return;
+		}
+		const double slope = (fit_count * fit_sum_te - fit_sum_t * fit_sum_e) / new_denominator;
+		float ppm = float(slope / sample_rate * 1000000.0);
+		ppm = ppm > MAX_DRIFT_PPM ? MAX_DRIFT_PPM : (ppm < -MAX_DRIFT_PPM ? -MAX_DRIFT_PPM : ppm);
+		drift_ppm = ppm;
+	}
+
+	float get_time_compression() const {
+		if (latency_debt <= 0.0) {
+			return 0.0f;
+		}
+		// Eases off over the last block of debt instead of stopping abruptly
+		const float compression = max_time_compression;
+		const double amount = latency_debt / double(block_frame_count);
+		return amount < 1.0 ? float(amount * compression) : compression;
+	}
+
+public:
+	// Allocates the queue for MAX_LATENCY_LIMIT_MSEC of p_block_frame_count blocks
+	void configure(uint32_t p_sample_rate, uint32_t p_block_frame_count) {
+		sample_rate = p_sample_rate;
+		block_frame_count = p_block_frame_count;
+		block_capacity = msec_to_frames(MAX_LATENCY_LIMIT_MSEC) / block_frame_count + 2;
+		block_samples.resize(size_t(block_capacity) * block_frame_count * 2);
+		block_frame_counts.resize(block_capacity);
+		reset_pending = false;
+		apply_reset();
+	}
+
+	// Drops the queue and the drift estimate before the next block
+	void request_reset() {
+		reset_pending = true;
+	}
+
+	// Queues one block of interleaved stereo input received at p_now_usec,
+	// dropping the oldest blocks if the queue would exceed max_latency.
+	// Returns the number of blocks dropped.
+	int push_block(const float *p_stereo_input, uint32_t p_frame_count, uint64_t p_now_usec) {
+		check_reset();
+		if (block_capacity == 0) {
+			return 0;
+		}
+		if (p_frame_count > block_frame_count) {
+			p_frame_count = block_frame_count;
+		}
+
+		count_drift_frames(p_frame_count, p_now_usec);
+
+		int dropped_count = 0;
+		float max_latency = max_latency_msec;
+		if (max_latency > MAX_LATENCY_LIMIT_MSEC) {
+			max_latency = MAX_LATENCY_LIMIT_MSEC;
+		}
+		const uint32_t max_frame_count = msec_to_frames(max_latency);
+		while (block_count > 0 && (block_count == block_capacity || queued_frame_count + p_frame_count > max_frame_count)) {
+			drop_oldest();
+			dropped_count++;
+		}
+
+		const uint32_t index = (block_head + block_count) % block_capacity;
+		memcpy(&block_samples[size_t(index) * block_frame_count * 2], p_stereo_input, sizeof(float) * p_frame_count * 2);
+		block_frame_counts[index] = p_frame_count;
+		block_count++;
+		queued_frame_count += p_frame_count;
+		received_frame_count += p_frame_count;
+		backlog_frame_count = queued_frame_count;
+
+		return dropped_count;
+	}
+
+	// Starts handing out this tick's blocks, call after pushing everything received
+	void begin_tick() {
+		check_reset();
+		add_drift_point();
+		tick_budget = max_blocks_per_tick;
+
+		const double excess = double(queued_frame_count) - double(msec_to_frames(latency_target_msec));
+		if (excess > latency_debt) {
+			latency_debt = excess;
+		}
+	}
+
+	// The next block to process and its frame count, or NULL once the
+	// queue is empty or this tick's budget is spent
+	const float *front(uint32_t *r_frame_count) const {
+		if (block_count == 0 || (max_blocks_per_tick > 0 && tick_budget <= 0)) {
+			return NULL;
+		}
+		*r_frame_count = block_frame_counts[block_head];
+		return &block_samples[size_t(block_head) * block_frame_count * 2];
+	}
+
+	// Factor for the resample ratio of the front block, below 1 to catch
+	// up on backlog and off 1 by the measured drift
+	double get_ratio_scale() const {
+		const double drift_scale = drift_correction ? 1.0 / (1.0 + double(drift_ppm) / 1000000.0) : 1.0;
+		return drift_scale * (1.0 - get_time_compression());
+	}
+
+	// Releases the front block once it has been processed. Backlog only
+	// counts as caught up if the block was compressed by get_ratio_scale,
+	// p_ratio_scale_applied false says it was not.
+	void pop(bool p_ratio_scale_applied) {
+		if (block_count == 0) {
+			return;
+		}
+		const uint32_t frame_count = block_frame_counts[block_head];
+		if (p_ratio_scale_applied) {
+			latency_debt -= frame_count * get_time_compression();
+			if (latency_debt < 0.0) {
+				latency_debt = 0.0;
+			}
+		}
+		queued_frame_count -= frame_count;
+		block_head = (block_head + 1) % block_capacity;
+		block_count--;
+		tick_budget--;
+		backlog_frame_count = queued_frame_count;
+	}
+
+	// Position of the front block's first frame among every frame pushed
+	// since the reset, so blocks keep their place in time across drops
+	uint64_t get_front_position() const {
+		return received_frame_count - queued_frame_count;
+	}
+
+	uint32_t get_block_count() const {
+		return block_count;
+	}
+
+	// Queued capture audio in milliseconds, safe from any thread
+	float get_backlog_msec() const {
+		return sample_rate ? float(backlog_frame_count) * 1000.0f / sample_rate : 0.0f;
+	}
+
+	// How far the input clock runs from its nominal rate, safe from any thread
+	float get_drift_ppm() const {
+		return drift_ppm;
+	}
+
+	// Queue depth above which backlog is time-compressed
+	void set_latency_target_msec(float p_msec) {
+		latency_target_msec = p_msec < 0.0f ? 0.0f : p_msec;
+	}
+	float get_latency_target_msec() const {
+		return latency_target_msec;
+	}
+
+	// Queue depth above which the oldest blocks are dropped
+	void set_max_latency_msec(float p_msec) {
+		max_latency_msec = p_msec < 0.0f ? 0.0f : (p_msec > MAX_LATENCY_LIMIT_MSEC ? MAX_LATENCY_LIMIT_MSEC : p_msec);
+	}
+	float get_max_latency_msec() const {
+		return max_latency_msec;
+	}
+
+	// Blocks processed per tick at most, 0 for no limit
+	void set_max_blocks_per_tick(int p_count) {
+		max_blocks_per_tick = p_count < 0 ? 0 : p_count;
+	}
+	int get_max_blocks_per_tick() const {
+		return max_blocks_per_tick;
+	}
+
+	// Fraction of audio removed while over the target, 0 disables time compression
+	void set_max_time_compression(float p_fraction) {
+		max_time_compression = p_fraction < 0.0f ? 0.0f : (p_fraction > 0.25f ? 0.25f : p_fraction);
+	}
+	float get_max_time_compression() const {
+		return max_time_compression;
+	}
+
+	void set_drift_correction(bool p_enabled) {
+		drift_correction = p_enabled;
+	}
+	bool is_drift_correction_enabled() const {
+		return drift_correction;
+	}
+
+	CaptureScheduler() :
+			latency_target_msec(DEFAULT_LATENCY_TARGET_MSEC),
+			max_latency_msec(DEFAULT_MAX_LATENCY_MSEC),
+			max_blocks_per_tick(DEFAULT_MAX_BLOCKS_PER_TICK),
+			max_time_compression(DEFAULT_MAX_TIME_COMPRESSION),
+			drift_correction(true),
+			reset_pending(false),
+			drift_ppm(0.0f),
+			backlog_frame_count(0) {
+	}
+};
+
+}; // namespace godot
+
+#endif // CAPTURE_SCHEDULER_HPP
@@ -0,0 +1,425 @@
+#include "echo_canceller.hpp"
+
+#include <math.h>
+#include <string.h>
+
+using namespace godot;
+
+// Step size of the background filter, normalised by the reference power of every partition
+#define ADAPTATION_STEP 0.5f
+// Keeps the normalisation finite for bins the reference barely reaches, about -60 dBFS
+#define REGULARIZATION (float(EchoCanceller::FFT_SIZE) * 1e-6f)
+// Weight of the previous reference power spectrum
+#define POWER_SMOOTHING 0.8f
+// Weight of the previous block in the energies comparing the two filters
+#define ENERGY_SMOOTHING 0.5f
+// The background filter replaces the foreground once its output is this much quieter
+#define FOREGROUND_COPY_RATIO 0.7f
+// The background filter starts over from the foreground once it is this much louder than the capture
+#define BACKGROUND_RESET_RATIO 4.0f
+// Reference peak below which the far end counts as silent, about -60 dBFS
+#define FAR_END_PEAK 1e-3f
+// Mean square below which a block counts as silent for the delay search, about -70 dBFS
+#define ACTIVE_ENERGY 1e-7f
+// Lowest bin of the binary spectra, skipping DC and rumble
+#define FEATURE_FIRST_BIN 2
+#define FEATURE_MEAN_RATE 0.02f
+#define DELAY_COST_RATE 0.05f
+// The best delay must beat the average candidate by this factor
+#define DELAY_CONFIDENCE 0.75f
+// and stay the best for this many blocks before it is used
+#define DELAY_CONFIRM_BLOCKS 16
+#define ERLE_SMOOTHING 0.98f
+// Blocks the filter starts before the estimated delay, a long echo tail pulls the estimate late
+#define DELAY_MARGIN_BLOCKS 2
+// Echo removed at which the delay in use is trusted over a new estimate
+#define DELAY_KEEP_ERLE_DB 10.0f
+
+static inline uint32_t count_bits(uint32_t p_value) {
+	p_value = p_value - ((p_value >> 1) & 0x55555555u);
+	p_value = (p_value & 0x33333333u) + ((p_value >> 2) & 0x33333333u);
+	return (((p_value + (p_value >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+}
+
+void EchoCanceller::configure(uint32_t p_sample_rate) {
+	sample_rate = p_sample_rate > 0 ? p_sample_rate : 48000;
+
+	fft.configure(FFT_SIZE);
+	feature_fft.configure(BLOCK_SIZE);
+
+	// Capture lag and delay search, plus the blocks the filter reaches back
+	const uint64_t reference_frames = uint64_t(double(MAX_REFERENCE_LAG_MSEC + MAX_DELAY_MSEC) * sample_rate / 1000.0) + (PARTITION_COUNT + 2) * BLOCK_SIZE;
+	uint32_t reference_capacity = BLOCK_SIZE;
+	while (reference_capacity < reference_frames) {
+		reference_capacity <<= 1;
+	}
+	reference_ring.resize(reference_capacity);
+	reference_mask = reference_capacity - 1;
+
+	input_block.resize(BLOCK_SIZE);
+	output_block.resize(BLOCK_SIZE);
+
+	time_buffer.resize(FFT_SIZE);
+	reference_spectra.resize(PARTITION_COUNT * BIN_COUNT * 2);
+	background_weights.resize(PARTITION_COUNT * BIN_COUNT * 2);
+	foreground_weights.resize(PARTITION_COUNT * BIN_COUNT * 2);
+	reference_power.resize(BIN_COUNT);
+	echo_spectrum.resize(BIN_COUNT * 2);
+	error_spectrum.resize(BIN_COUNT * 2);
+	background_error.resize(BLOCK_SIZE);
+	foreground_error.resize(BLOCK_SIZE);
+	reference_peaks.resize(PARTITION_COUNT + 1);
+
+	feature_input.resize(BLOCK_SIZE);
+	feature_spectrum.resize(feature_fft.get_bin_count() * 2);
+	delay_block_count = uint32_t(double(MAX_DELAY_MSEC) * sample_rate / 1000.0 / BLOCK_SIZE) + 1;
+	reference_features.resize(delay_block_count);
+	reference_feature_active.resize(delay_block_count);
+	delay_costs.resize(delay_block_count);
+
+	reset_pending = false;
+	reset_state();
+}
+
+void EchoCanceller::check_reset() {
+	if (reset_pending.exchange(false)) {
+		reset_state();
+	}
+}
+
+void EchoCanceller::reset_filter() {
+	memset(reference_spectra.data(), 0, reference_spectra.size() * sizeof(float));
+	memset(background_weights.data(), 0, background_weights.size() * sizeof(float));
+	memset(foreground_weights.data(), 0, foreground_weights.size() * sizeof(float));
+	memset(reference_power.data(), 0, reference_power.size() * sizeof(float));
+	memset(reference_peaks.data(), 0, reference_peaks.size() * sizeof(float));
+	partition_head = 0;
+	constraint_partition = 0;
+	reference_peak_head = 0;
+	capture_energy = 0.0f;
+	background_energy = 0.0f;
+	foreground_energy = 0.0f;
+}
+
+void EchoCanceller::reset_state() {
+	memset(reference_ring.data(), 0, reference_ring.size() * sizeof(float));
+	reference_frame_count = 0;
+	memset(input_block.data(), 0, input_block.size() * sizeof(float));
+	memset(output_block.data(), 0, output_block.size() * sizeof(float));
+	block_fill = 0;
+	block_position = 0;
+	active = false;
+	reset_filter();
+
+	for (uint32_t band = 0; band < FEATURE_BAND_COUNT; band++) {
+		capture_band_mean[band] = 0.0f;
+		reference_band_mean[band] = 0.0f;
+	}
+	memset(reference_features.data(), 0, reference_features.size() * sizeof(uint32_t));
+	memset(reference_feature_active.data(), 0, reference_feature_active.size());
+	for (uint32_t i = 0; i < delay_costs.size(); i++) {
+		// What unrelated spectra score
+		delay_costs[i] = float(FEATURE_BAND_COUNT) / 2.0f;
+	}
+	feature_head = 0;
+	delay_candidate = 0;
+	delay_candidate_block_count = 0;
+	delay_found = false;
+	delay_blocks = 0;
+	delay_msec = -1.0f;
+
+	erle_capture_energy = 0.0f;
+	erle_output_energy = 0.0f;
+	erle_db = 0.0f;
+}
+
+void EchoCanceller::read_reference(int64_t p_position, uint32_t p_count, float *r_output) const {
+	const int64_t end = int64_t(reference_frame_count);
+	const int64_t start = end - int64_t(reference_ring.size());
+	for (uint32_t i = 0; i < p_count; i++) {
+		const int64_t position = p_position + i;
+		r_output[i] = position >= 0 && position >= start && position < end ? reference_ring[uint64_t(position) & reference_mask] : 0.0f;
+	}
+}
+
+uint32_t EchoCanceller::compute_features(const float *p_block, float *p_band_mean, float *r_energy) {
+	float energy = 0.0f;
+	for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+		energy += p_block[i] * p_block[i];
+	}
+	*r_energy = energy / float(BLOCK_SIZE);
+	if (*r_energy <= ACTIVE_ENERGY) {
+		return 0;
+	}
+
+	feature_fft.forward(p_block, feature_spectrum.data());
+	uint32_t features = 0;
+	for (uint32_t band = 0; band < FEATURE_BAND_COUNT; band++) {
+		const uint32_t bin = FEATURE_FIRST_BIN + band;
+		const float re = feature_spectrum[bin * 2];
+		const float im = feature_spectrum[bin * 2 + 1];
+		const float power = re * re + im * im;
+		if (power > p_band_mean[band]) {
+			features |= 1u << band;
+		}
+		p_band_mean[band] += FEATURE_MEAN_RATE * (power - p_band_mean[band]);
+	}
+	return features;
+}
+
+void EchoCanceller::estimate_delay() {
+	float reference_energy = 0.0f;
+	read_reference(block_position, BLOCK_SIZE, feature_input.data());
+	feature_head = (feature_head + 1) % delay_block_count;
+	reference_features[feature_head] = compute_features(feature_input.data(), reference_band_mean, &reference_energy);
+	reference_feature_active[feature_head] = reference_energy > ACTIVE_ENERGY;
+
+	float capture_block_energy = 0.0f;
+	const uint32_t capture_features = compute_features(input_block.data(), capture_band_mean, &capture_block_energy);
+	if (capture_block_energy <= ACTIVE_ENERGY) {
+		return;
+	}
+
+	// Only delays at which the reference played say anything about the match
+	uint32_t best = 0;
+	float cost_sum = 0.0f;
+	for (uint32_t delay = 0; delay < delay_block_count; delay++) {
+		const uint32_t slot = (feature_head + delay_block_count - delay) % delay_block_count;
+		if (reference_feature_active[slot]) {
+			const float distance = float(count_bits(capture_features ^ reference_features[slot]));
+			delay_costs[delay] += DELAY_COST_RATE * (distance - delay_costs[delay]);
+		}
+		cost_sum += delay_costs[delay];
+		if (delay_costs[delay] < delay_costs[best]) {
+			best = delay;
+		}
+	}
+
+	if (best == delay_candidate) {
+		delay_candidate_block_count++;
+	} else {
+		delay_candidate = best;
+		delay_candidate_block_count = 1;
+	}
+	if (delay_candidate_block_count < DELAY_CONFIRM_BLOCKS || delay_costs[best] > DELAY_CONFIDENCE * cost_sum / float(delay_block_count)) {
+		return;
+	}
+
+	// The filter starts early, so a neighbouring block is still covered, and
+	// periodic far-end audio can fake a match, so a delay the filter already
+	// cancels echo at is kept
+	if (delay_found && ((best + 1 >= delay_blocks && best <= delay_blocks + 1) || erle_db >= DELAY_KEEP_ERLE_DB)) {
+		return;
+	}
+	const uint32_t previous_start = get_filter_start_blocks();
+	delay_found = true;
+	delay_blocks = best;
+	delay_msec = float(delay_blocks * BLOCK_SIZE) * 1000.0f / float(sample_rate);
+	shift_filter(int(get_filter_start_blocks()) - int(previous_start));
+}
+
+uint32_t EchoCanceller::get_filter_start_blocks() const {
+	return delay_found && delay_blocks > DELAY_MARGIN_BLOCKS ? delay_blocks - DELAY_MARGIN_BLOCKS : 0;
+}
+
+void EchoCanceller::shift_filter(int p_blocks) {
+	if (p_blocks == 0) {
+		return;
+	}
+	if (p_blocks >= int(PARTITION_COUNT) || -p_blocks >= int(PARTITION_COUNT)) {
+		reset_filter();
+		return;
+	}
+
+	// Partition p becomes p - p_blocks, taps shifted out of the span are lost
+	const uint32_t partition_size = BIN_COUNT * 2;
+	const uint32_t shift = uint32_t(p_blocks > 0 ? p_blocks : -p_blocks);
+	const uint32_t kept_size = (PARTITION_COUNT - shift) * partition_size;
+	float *weight_sets[2] = { background_weights.data(), foreground_weights.data() };
+	for (int i = 0; i < 2; i++) {
+		float *weights = weight_sets[i];
+		if (p_blocks > 0) {
+			memmove(weights, weights + shift * partition_size, kept_size * sizeof(float));
+			memset(weights + kept_size, 0, shift * partition_size * sizeof(float));
+		} else {
+			memmove(weights + shift * partition_size, weights, kept_size * sizeof(float));
+			memset(weights, 0, shift * partition_size * sizeof(float));
+		}
+	}
+
+	// The reference history only needs its head moved, the slots that wrap
+	// around would hold blocks from the other end and are cleared
+	partition_head = uint32_t(int(partition_head + PARTITION_COUNT) + p_blocks) % PARTITION_COUNT;
+	for (uint32_t i = 0; i < shift; i++) {
+		const uint32_t partition = p_blocks > 0 ? PARTITION_COUNT - 1 - i : i;
+		memset(&reference_spectra[((partition_head + partition) % PARTITION_COUNT) * partition_size], 0, partition_size * sizeof(float));
+	}
+}
+
+void EchoCanceller::filter_block(const float *p_weights, float *r_error) {
+	memset(echo_spectrum.data(), 0, echo_spectrum.size() * sizeof(float));
+	for (uint32_t partition = 0; partition < PARTITION_COUNT; partition++) {
+		const float *reference = &reference_spectra[((partition_head + partition) % PARTITION_COUNT) * BIN_COUNT * 2];
+		const float *weights = p_weights + partition * BIN_COUNT * 2;
+		for (uint32_t k = 0; k < BIN_COUNT; k++) {
+			const float x_re = reference[k * 2];
+			const float x_im = reference[k * 2 + 1];
+			const float w_re = weights[k * 2];
+			const float w_im = weights[k * 2 + 1];
+			echo_spectrum[k * 2] += x_re * w_re - x_im * w_im;
+			echo_spectrum[k * 2 + 1] += x_re * w_im + x_im * w_re;
+		}
+	}
+
+	// Overlap-save, only the second half of the circular convolution is valid
+	fft.inverse(echo_spectrum.data(), time_buffer.data());
+	for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+		r_error[i] = input_block[i] - time_buffer[BLOCK_SIZE + i];
+	}
+}
+
+void EchoCanceller::adapt_background() {
+	memset(time_buffer.data(), 0, BLOCK_SIZE * sizeof(float));
+	memcpy(time_buffer.data() + BLOCK_SIZE, background_error.data(), BLOCK_SIZE * sizeof(float));
+	fft.forward(time_buffer.data(), error_spectrum.data());
+
+	for (uint32_t k = 0; k < BIN_COUNT; k++) {
+		const float step = ADAPTATION_STEP / (float(PARTITION_COUNT) * reference_power[k] + REGULARIZATION);
+		error_spectrum[k * 2] *= step;
+		error_spectrum[k * 2 + 1] *= step;
+	}
+
+	// Correlate the error with each partition's reference, conj(X) * E
+	for (uint32_t partition = 0; partition < PARTITION_COUNT; partition++) {
+		const float *reference = &reference_spectra[((partition_head + partition) % PARTITION_COUNT) * BIN_COUNT * 2];
+		float *weights = &background_weights[partition * BIN_COUNT * 2];
+		for (uint32_t k = 0; k < BIN_COUNT; k++) {
+			const float x_re = reference[k * 2];
+			const float x_im = reference[k * 2 + 1];
+			const float e_re = error_spectrum[k * 2];
+			const float e_im = error_spectrum[k * 2 + 1];
+			weights[k * 2] += x_re * e_re + x_im * e_im;
+			weights[k * 2 + 1] += x_re * e_im - x_im * e_re;
+		}
+	}
+
+	// The updates above are unconstrained, one partition per block is cut
+	// back to BLOCK_SIZE taps so the circular wrap cannot build up
+	float *weights = &background_weights[constraint_partition * BIN_COUNT * 2];
+	fft.inverse(weights, time_buffer.data());
+	memset(time_buffer.data() + BLOCK_SIZE, 0, BLOCK_SIZE * sizeof(float));
+	fft.forward(time_buffer.data(), weights);
+	constraint_partition = (constraint_partition + 1) % PARTITION_COUNT;
+}
+
+void EchoCanceller::process_block() {
+	estimate_delay();
+
+	// The reference block lined up with the capture, after the block before it
+	const int64_t filter_delay = int64_t(get_filter_start_blocks()) * BLOCK_SIZE;
+	read_reference(block_position - filter_delay - BLOCK_SIZE, FFT_SIZE, time_buffer.data());
+
+	float peak = 0.0f;
+	for (uint32_t i = BLOCK_SIZE; i < FFT_SIZE; i++) {
+		const float value = fabsf(time_buffer[i]);
+		peak = value > peak ? value : peak;
+	}
+	reference_peaks[reference_peak_head] = peak;
+	reference_peak_head = (reference_peak_head + 1) % (PARTITION_COUNT + 1);
+	bool far_end_active = false;
+	for (uint32_t i = 0; i <= PARTITION_COUNT; i++) {
+		far_end_active = far_end_active || reference_peaks[i] > FAR_END_PEAK;
+	}
+
+	partition_head = (partition_head + PARTITION_COUNT - 1) % PARTITION_COUNT;
+	float *reference = &reference_spectra[partition_head * BIN_COUNT * 2];
+	fft.forward(time_buffer.data(), reference);
+	for (uint32_t k = 0; k < BIN_COUNT; k++) {
+		const float power = reference[k * 2] * reference[k * 2] + reference[k * 2 + 1] * reference[k * 2 + 1];
+		reference_power[k] = POWER_SMOOTHING * reference_power[k] + (1.0f - POWER_SMOOTHING) * power;
+	}
+
+	filter_block(background_weights.data(), background_error.data());
+	filter_block(foreground_weights.data(), foreground_error.data());
+
+	float capture_block_energy = 0.0f;
+	float background_block_energy = 0.0f;
+	float foreground_block_energy = 0.0f;
+	for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+		capture_block_energy += input_block[i] * input_block[i];
+		background_block_energy += background_error[i] * background_error[i];
+		foreground_block_energy += foreground_error[i] * foreground_error[i];
+	}
+	capture_energy = ENERGY_SMOOTHING * capture_energy + (1.0f - ENERGY_SMOOTHING) * capture_block_energy;
+	background_energy = ENERGY_SMOOTHING * background_energy + (1.0f - ENERGY_SMOOTHING) * background_block_energy;
+	foreground_energy = ENERGY_SMOOTHING * foreground_energy + (1.0f - ENERGY_SMOOTHING) * foreground_block_energy;
+
+	if (far_end_active) {
+		adapt_background();
+
+		const size_t weights_size = background_weights.size() * sizeof(float);
+		if (background_energy < FOREGROUND_COPY_RATIO * foreground_energy && background_energy < capture_energy) {
+			memcpy(foreground_weights.data(), background_weights.data(), weights_size);
+			foreground_energy = background_energy;
+		} else if (background_energy > BACKGROUND_RESET_RATIO * capture_energy && foreground_energy < capture_energy) {
+			memcpy(background_weights.data(), foreground_weights.data(), weights_size);
+			background_energy = foreground_energy;
+		}
+	}
+
+	// Never hand on more than was captured
+	const bool cancel = foreground_block_energy < capture_block_energy;
+	memcpy(output_block.data(), cancel ? foreground_error.data() : input_block.data(), BLOCK_SIZE * sizeof(float));
+
+	if (far_end_active && delay_found) {
+		erle_capture_energy = ERLE_SMOOTHING * erle_capture_energy + (1.0f - ERLE_SMOOTHING) * capture_block_energy;
+		erle_output_energy = ERLE_SMOOTHING * erle_output_energy + (1.0f - ERLE_SMOOTHING) * (cancel ? foreground_block_energy : capture_block_energy);
+		erle_db = 10.0f * log10f((erle_capture_energy + 1e-12f) / (erle_output_energy + 1e-12f));
+	}
+}
+
+void EchoCanceller::push_reference(const float *p_stereo_input, uint32_t p_frame_count) {
+	check_reset();
+	if (reference_ring.empty()) {
+		return;
+	}
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		reference_ring[(reference_frame_count + i) & reference_mask] = 0.5f * (p_stereo_input[i * 2] + p_stereo_input[i * 2 + 1]);
+	}
+	reference_frame_count += p_frame_count;
+}
+
+void EchoCanceller::process(float *p_samples, uint32_t p_frame_count, int64_t p_position) {
+	check_reset();
+	if (!enabled) {
+		active = false;
+		return;
+	}
+	if (!active) {
+		reset_filter();
+		memset(output_block.data(), 0, output_block.size() * sizeof(float));
+		block_fill = 0;
+		active = true;
+	}
+
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		if (block_fill == 0) {
+			block_position = p_position + i;
+		}
+		input_block[block_fill] = p_samples[i];
+		p_samples[i] = output_block[block_fill];
+		block_fill++;
+		if (block_fill == BLOCK_SIZE) {
+			process_block();
+			block_fill = 0;
+		}
+	}
+}
+
+EchoCanceller::EchoCanceller() :
+		enabled(false),
+		reset_pending(false),
+		delay_msec(-1.0f),
+		erle_db(0.0f) {
+	configure(sample_rate);
+}
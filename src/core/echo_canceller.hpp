@@ -0,0 +1,176 @@
+#ifndef ECHO_CANCELLER_HPP
+#define ECHO_CANCELLER_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "real_fft.hpp"
+
+namespace godot {
+
+// Acoustic echo cancellation against a far-end reference, normally what the
+// game plays on its output bus. Mono capture samples go in at the input
+// rate together with their position in the capture stream; the reference
+// is pushed as it is received and kept in a ring indexed the same way, so
+// sample n of the capture lines up with sample n of the reference minus the
+// estimated delay.
+//
+// The delay between the two is found by matching binary spectra: each
+// block of either signal becomes one bit per band, set where the band is
+// above its long-term mean, and the reference delay whose bits disagree
+// least with the capture, smoothed over time, wins once it clearly beats
+// the rest. The echo path is then modelled by a partitioned block
+// frequency-domain adaptive filter of PARTITION_COUNT blocks of BLOCK_SIZE
+// samples starting a little before that delay, normalised per bin. A
+// background filter adapts all the time and is copied to the foreground
+// filter, which produces the output, only while it removes more echo, so
+// near-end speech during far-end playback cannot wreck the output. A
+// block is passed through unchanged if cancelling would make it louder.
+//
+// Only the linear part of the echo is removed; the residual is left to the
+// noise suppressor. Capture is delayed by BLOCK_SIZE samples, about 5 ms at
+// 48 kHz, and the work per block is fixed, a handful of FFTs.
+// configure sizes everything, process and push_reference never allocate.
+// The settings may be changed from any thread, everything else must be
+// called from the thread processing the audio.
+class EchoCanceller {
+public:
+	static const uint32_t BLOCK_SIZE = 256;
+	static const uint32_t FFT_SIZE = BLOCK_SIZE * 2;
+	static const uint32_t BIN_COUNT = FFT_SIZE / 2 + 1;
+	// Echo tail the filter covers, about 85 ms at 48 kHz
+	static const uint32_t PARTITION_COUNT = 16;
+	// Bands of the binary spectra, one bit each
+	static const uint32_t FEATURE_BAND_COUNT = 32;
+
+	// Longest delay between reference and capture that is searched
+	static constexpr float MAX_DELAY_MSEC = 500.0f;
+	// How far behind the newest reference the capture may run, the
+	// capture scheduler holds at most a second
+	static constexpr float MAX_REFERENCE_LAG_MSEC = 1000.0f;
+
+private:
+	std::atomic<bool> enabled;
+	std::atomic<bool> reset_pending;
+
+	// Reported to other threads
+	std::atomic<float> delay_msec;
+	std::atomic<float> erle_db;
+
+	uint32_t sample_rate = 48000;
+
+	// Mono reference, reference_frame_count frames pushed since the reset
+	std::vector<float> reference_ring;
+	uint32_t reference_mask = 0;
+	uint64_t reference_frame_count = 0;
+
+	// Capture block being filled and the output block handed out meanwhile
+	std::vector<float> input_block;
+	std::vector<float> output_block;
+	uint32_t block_fill = 0;
+	int64_t block_position = 0;
+	// Whether the canceller ran on the previous call, it starts clean when turned on
+	bool active = false;
+
+	// Adaptive filter, spectra are BIN_COUNT interleaved complex bins
+	RealFft fft;
+	std::vector<float> time_buffer;
+	// Reference spectra of the last PARTITION_COUNT blocks, newest at partition_head
+	std::vector<float> reference_spectra;
+	uint32_t partition_head = 0;
+	std::vector<float> background_weights;
+	std::vector<float> foreground_weights;
+	std::vector<float> reference_power;
+	std::vector<float> echo_spectrum;
+	std::vector<float> error_spectrum;
+	std::vector<float> background_error;
+	std::vector<float> foreground_error;
+	// Partition whose weights are constrained to BLOCK_SIZE taps next
+	uint32_t constraint_partition = 0;
+	// Peak of each reference block the filter spans, to tell whether the far end is active
+	std::vector<float> reference_peaks;
+	uint32_t reference_peak_head = 0;
+	float capture_energy = 0.0f;
+	float background_energy = 0.0f;
+	float foreground_energy = 0.0f;
+	float erle_capture_energy = 0.0f;
+	float erle_output_energy = 0.0f;
+
+	// Delay estimation
+	RealFft feature_fft;
+	std::vector<float> feature_input;
+	std::vector<float> feature_spectrum;
+	float capture_band_mean[FEATURE_BAND_COUNT];
+	float reference_band_mean[FEATURE_BAND_COUNT];
+	// Binary spectra of the last delay_block_count reference blocks, newest at feature_head
+	std::vector<uint32_t> reference_features;
+	std::vector<uint8_t> reference_feature_active;
+	uint32_t feature_head = 0;
+	uint32_t delay_block_count = 0;
+	// Smoothed count of disagreeing bits per candidate delay in blocks
+	std::vector<float> delay_costs;
+	uint32_t delay_candidate = 0;
+	uint32_t delay_candidate_block_count = 0;
+	bool delay_found = false;
+	uint32_t delay_blocks = 0;
+
+	void check_reset();
+	void reset_filter();
+	void reset_state();
+
+	// Reference from p_position on, zeros where it has not arrived or was overwritten
+	void read_reference(int64_t p_position, uint32_t p_count, float *r_output) const;
+
+	// Bits for the bands above their mean, r_energy gets the mean square of the block
+	uint32_t compute_features(const float *p_block, float *p_band_mean, float *r_energy);
+	void estimate_delay();
+	// Blocks between the capture and the reference the filter starts at
+	uint32_t get_filter_start_blocks() const;
+	// Moves the filter and its reference history when the delay changes by p_blocks
+	void shift_filter(int p_blocks);
+	void filter_block(const float *p_weights, float *r_error);
+	void adapt_background();
+	void process_block();
+
+public:
+	// Sizes the buffers for audio at p_sample_rate and resets the state
+	void configure(uint32_t p_sample_rate);
+
+	void set_enabled(bool p_enabled) {
+		enabled = p_enabled;
+	}
+	bool is_enabled() const {
+		return enabled;
+	}
+
+	// Forgets the reference and the echo path before the next call, for
+	// when both streams start over from position 0
+	void request_reset() {
+		reset_pending = true;
+	}
+
+	// Appends p_frame_count frames of interleaved stereo reference
+	void push_reference(const float *p_stereo_input, uint32_t p_frame_count);
+
+	// Cancels echo from p_frame_count mono samples in place, the first of
+	// which is at p_position in the capture stream. Does nothing while disabled.
+	void process(float *p_samples, uint32_t p_frame_count, int64_t p_position);
+
+	// Estimated delay of the echo behind the reference, -1 until found. Safe from any thread.
+	float get_delay_msec() const {
+		return delay_msec;
+	}
+
+	// Echo return loss enhancement, how much quieter the output is than the
+	// capture while the far end plays. Safe from any thread.
+	float get_erle_db() const {
+		return erle_db;
+	}
+
+	EchoCanceller();
+};
+
+}; // namespace godot
+
+#endif // ECHO_CANCELLER_HPP
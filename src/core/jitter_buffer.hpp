@@ -0,0 +1,292 @@
+#ifndef JITTER_BUFFER_HPP
+#define JITTER_BUFFER_HPP
+
+#include <chrono>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+namespace godot {
+
+// Reorders incoming packets by sequence number and decides, once per frame,
+// whether the decoder should decode a packet, recover a lost one from the
+// next packet's in-band FEC, or conceal it with PLC.
+// The playout delay adapts to the measured interarrival jitter.
+// Not thread-safe.
+class JitterBuffer {
+public:
+	enum PlayoutAction {
+		PLAYOUT_NONE, // Nothing to play, output silence
+		PLAYOUT_PACKET, // Decode the returned packet normally
+		PLAYOUT_FEC, // The packet was lost, decode the returned next packet with decode_fec = 1
+		PLAYOUT_PLC, // The packet was lost, decode with a NULL payload
+	};
+
+	static const int MIN_TARGET_DELAY = 1;
+
+private:
+	struct Slot {
+		bool valid = false;
+		uint32_t sequence = 0;
+		int size = 0;
+	};
+
+	std::vector<uint8_t> packet_bytes;
+	std::vector<Slot> slots;
+	uint32_t slot_mask = 0;
+	uint32_t max_packet_size = 0;
+	uint32_t frames_per_packet = 0;
+	uint32_t sample_rate = 0;
+
+	bool playing = false;
+	// Whether next_sequence holds the playout position, which survives
+	// rebuffering so packets already played stay late
+	bool has_played = false;
+	uint32_t next_sequence = 0;
+	uint32_t lowest_sequence = 0;
+	int buffered_count = 0;
+
+	// RFC 3550 style interarrival jitter, in frames
+	bool has_transit = false;
+	int64_t last_transit = 0;
+	double jitter = 0.0;
+	int target_delay = MIN_TARGET_DELAY;
+	int max_target_delay = MIN_TARGET_DELAY;
+
+	int late_packets = 0;
+	int lost_packets = 0;
+	int concealed_packets = 0;
+	int recovered_packets = 0;
+	int dropped_packets = 0;
+
+	static int32_t sequence_diff(uint32_t p_a, uint32_t p_b) {
+		return static_cast<int32_t>(p_a - p_b);
+	}
+
+	Slot &slot_for(uint32_t p_sequence) {
+		return slots[p_sequence & slot_mask];
+	}
+
+	uint8_t *slot_data(uint32_t p_sequence) {
+		return &packet_bytes[static_cast<size_t>(p_sequence & slot_mask) * max_packet_size];
+	}
+
+	bool has_packet(uint32_t p_sequence) {
+		const Slot &slot = slot_for(p_sequence);
+		return slot.valid && slot.sequence == p_sequence;
+	}
+
+	void release(uint32_t p_sequence) {
+		Slot &slot = slot_for(p_sequence);
+		if (slot.valid && slot.sequence == p_sequence) {
+			slot.valid = false;
+			buffered_count--;
+		}
+	}
+
+	void update_jitter(uint32_t p_timestamp) {
+		const int64_t arrival_usec = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now().time_since_epoch())
+											 .count();
+		const int64_t arrival_frames = arrival_usec * sample_rate / 1000000;
+		const int64_t transit = arrival_frames - static_cast<int64_t>(p_timestamp);
+		if (has_transit) {
+			int64_t delta = transit - last_transit;
+			if (delta < 0) {
+				delta = -delta;
+			}
+			jitter += (static_cast<double>(delta) - jitter) / 16.0;
+		}
+		last_transit = transit;
+		has_transit = true;
+
+		// Cover roughly two standard deviations of jitter, plus the packet being decoded
+		const int delay = MIN_TARGET_DELAY + static_cast<int>((2.0 * jitter) / frames_per_packet + 0.5);
+		target_delay = delay > max_target_delay ? max_target_delay : delay;
+	}
+
+public:
+	void resize(int p_capacity, uint32_t p_max_packet_size, uint32_t p_frames_per_packet, uint32_t p_sample_rate) {
+		uint32_t slot_count = 2;
+		while (slot_count < static_cast<uint32_t>(p_capacity)) {
+			slot_count <<= 1;
+		}
+		slot_mask = slot_count - 1;
+		max_packet_size = p_max_packet_size;
+		frames_per_packet = p_frames_per_packet;
+		sample_rate = p_sample_rate;
+		max_target_delay = slot_count / 2;
+
+		packet_bytes.resize(static_cast<size_t>(slot_count) * max_packet_size);
+		slots.resize(slot_count);
+
+		clear();
+	}
+
+	// Packet duration used to turn the measured jitter into a delay in packets
+	void set_frames_per_packet(uint32_t p_frames_per_packet) {
+		if (p_frames_per_packet > 0) {
+			frames_per_packet = p_frames_per_packet;
+		}
+	}
+
+	// Drops every buffered packet and waits to prebuffer again.
+	// Packets at or before the last one played are still rejected.
+	void flush() {
+		for (size_t i = 0; i < slots.size(); i++) {
+			slots[i].valid = false;
+		}
+		playing = false;
+		buffered_count = 0;
+	}
+
+	// Also forgets the playout position, for when the sender starts over
+	void clear() {
+		flush();
+		has_played = false;
+		has_transit = false;
+		jitter = 0.0;
+		target_delay = MIN_TARGET_DELAY;
+	}
+
+	// Returns false if the packet arrived too late to be played
+	bool push(uint32_t p_sequence, uint32_t p_timestamp, const uint8_t *p_data, int p_size) {
+		if (slots.empty() || p_size < 0 || p_size > static_cast<int>(max_packet_size)) {
+			return false;
+		}
+
+		if (has_played && sequence_diff(p_sequence, next_sequence) < 0) {
+			late_packets++;
+			return false;
+		}
+
+		update_jitter(p_timestamp);
+
+		// Too far ahead of playout to fit, restart from this packet
+		const uint32_t window_start = playing ? next_sequence : lowest_sequence;
+		if (buffered_count > 0 && sequence_diff(p_sequence, window_start) > static_cast<int32_t>(slot_mask)) {
+			dropped_packets += buffered_count;
+			flush();
+		}
+
+		if (!playing && (buffered_count == 0 || sequence_diff(p_sequence, lowest_sequence) < 0)) {
+			lowest_sequence = p_sequence;
+		}
+
+		Slot &slot = slot_for(p_sequence);
+		if (slot.valid) {
+			if (slot.sequence == p_sequence) {
+				// Duplicate
+				return true;
+			}
+			buffered_count--;
+			dropped_packets++;
+		}
+
+		memcpy(slot_data(p_sequence), p_data, p_size);
+		slot.valid = true;
+		slot.sequence = p_sequence;
+		slot.size = p_size;
+		buffered_count++;
+
+		return true;
+	}
+
+	// Called once per decoded frame. For PLAYOUT_PACKET and PLAYOUT_FEC,
+	// r_data and r_size point at the packet to decode, which stays valid
+	// until the next call to push.
+	PlayoutAction pop(const uint8_t **r_data, int *r_size) {
+		*r_data = NULL;
+		*r_size = 0;
+
+		if (!playing) {
+			// Prebuffer up to the target delay before starting playout
+			if (buffered_count == 0 || buffered_count < target_delay) {
+				return PLAYOUT_NONE;
+			}
+			playing = true;
+			has_played = true;
+			next_sequence = lowest_sequence;
+		}
+
+		if (buffered_count == 0) {
+			// Talker stopped or stalled, rebuffer before resuming
+			playing = false;
+			return PLAYOUT_NONE;
+		}
+
+		// Playout has drifted well behind the target delay, shed one packet
+		if (buffered_count > target_delay * 2 + 2 && has_packet(next_sequence)) {
+			release(next_sequence);
+			next_sequence++;
+			dropped_packets++;
+		}
+
+		const uint32_t sequence = next_sequence;
+		next_sequence++;
+
+		if (has_packet(sequence)) {
+			*r_data = slot_data(sequence);
+			*r_size = slot_for(sequence).size;
+			release(sequence);
+			return PLAYOUT_PACKET;
+		}
+
+		lost_packets++;
+
+		// The next packet may carry this one's in-band FEC
+		if (has_packet(next_sequence)) {
+			*r_data = slot_data(next_sequence);
+			*r_size = slot_for(next_sequence).size;
+			recovered_packets++;
+			return PLAYOUT_FEC;
+		}
+
+		concealed_packets++;
+		return PLAYOUT_PLC;
+	}
+
+	int get_buffered_count() const {
+		return buffered_count;
+	}
+
+	int get_target_delay() const {
+		return target_delay;
+	}
+
+	float get_jitter_msec() const {
+		return sample_rate ? static_cast<float>(jitter * 1000.0 / sample_rate) : 0.0f;
+	}
+
+	int get_late_packets() const {
+		return late_packets;
+	}
+
+	int get_lost_packets() const {
+		return lost_packets;
+	}
+
+	int get_concealed_packets() const {
+		return concealed_packets;
+	}
+
+	int get_recovered_packets() const {
+		return recovered_packets;
+	}
+
+	int get_dropped_packets() const {
+		return dropped_packets;
+	}
+
+	void reset_counters() {
+		late_packets = 0;
+		lost_packets = 0;
+		concealed_packets = 0;
+		recovered_packets = 0;
+		dropped_packets = 0;
+	}
+};
+
+}; // namespace godot
+
+#endif // JITTER_BUFFER_HPP
@@ -0,0 +1,145 @@
+#ifndef OPUS_DECODER_POOL_HPP
+#define OPUS_DECODER_POOL_HPP
+
+#include <opus.h>
+
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace godot {
+
+// Fixed set of Opus decoder states carved out of one contiguous arena.
+// States are initialised once with opus_decoder_init and reset with
+// OPUS_RESET_STATE when they are returned, so peers joining and leaving
+// do not allocate. When every state is taken, acquire falls back to
+// opus_decoder_create and counts an overflow; release handles both.
+// Decoders for another rate or channel count are always created.
+// Only states from the pool count towards in_use and high_water, the
+// created ones are counted as unpooled.
+// Safe to use from any thread.
+class OpusDecoderPool {
+public:
+	struct Stats {
+		int capacity = 0;
+		// Pool states currently handed out and the most ever at once
+		int in_use = 0;
+		int high_water = 0;
+		// Decoders that had to be allocated because the pool was empty
+		int overflow = 0;
+		// Created decoders currently handed out, overflow or another rate or channel count
+		int unpooled = 0;
+	};
+
+private:
+	// Cache line aligned, so decoders used by different threads do not share lines
+	static const size_t STATE_ALIGNMENT = 64;
+
+	std::mutex mutex;
+	std::vector<uint8_t> arena;
+	uint8_t *states = NULL;
+	size_t state_stride = 0;
+	std::vector<int> free_indices;
+	int32_t sample_rate = 0;
+	int channel_count = 0;
+	Stats stats;
+
+	bool owns(const OpusDecoder *p_decoder) const {
+		const uint8_t *ptr = reinterpret_cast<const uint8_t *>(p_decoder);
+		return states && ptr >= states && ptr < states + state_stride * stats.capacity;
+	}
+
+public:
+	// Returns OPUS_OK or the Opus error code of the first state that failed
+	int configure(int p_capacity, int32_t p_sample_rate, int p_channel_count) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		const int state_size = opus_decoder_get_size(p_channel_count);
+		if (state_size <= 0 || p_capacity < 0) {
+			return OPUS_BAD_ARG;
+		}
+		state_stride = (size_t(state_size) + STATE_ALIGNMENT - 1) & ~(STATE_ALIGNMENT - 1);
+
+		arena.resize(state_stride * p_capacity + STATE_ALIGNMENT);
+		const uintptr_t arena_address = reinterpret_cast<uintptr_t>(arena.data());
+		states = arena.data() + ((STATE_ALIGNMENT - arena_address % STATE_ALIGNMENT) % STATE_ALIGNMENT);
+
+		sample_rate = p_sample_rate;
+		channel_count = p_channel_count;
+		stats = Stats();
+		stats.capacity = p_capacity;
+		free_indices.clear();
+		free_indices.reserve(p_capacity);
+		// Handed out from the front of the arena first
+		for (int i = p_capacity - 1; i >= 0; i--) {
+			const int error = opus_decoder_init(reinterpret_cast<OpusDecoder *>(states + state_stride * i), p_sample_rate, p_channel_count);
+			if (error != OPUS_OK) {
+				stats.capacity = 0;
+				free_indices.clear();
+				return error;
+			}
+			free_indices.push_back(i);
+		}
+
+		return OPUS_OK;
+	}
+
+	OpusDecoder *acquire(int32_t p_sample_rate, int p_channel_count) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		const bool pooled = p_sample_rate == sample_rate && p_channel_count == channel_count;
+		OpusDecoder *decoder = NULL;
+		if (pooled && !free_indices.empty()) {
+			decoder = reinterpret_cast<OpusDecoder *>(states + state_stride * free_indices.back());
+			free_indices.pop_back();
+			stats.in_use++;
+			if (stats.in_use > stats.high_water) {
+				stats.high_water = stats.in_use;
+			}
+		} else {
+			int error = OPUS_OK;
+			decoder = opus_decoder_create(p_sample_rate, p_channel_count, &error);
+			if (error != OPUS_OK) {
+				return NULL;
+			}
+			if (pooled) {
+				stats.overflow++;
+			}
+			stats.unpooled++;
+		}
+
+		return decoder;
+	}
+
+	void release(OpusDecoder *p_decoder) {
+		if (!p_decoder) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (owns(p_decoder)) {
+			// The next user starts from a clean decoder
+			opus_decoder_ctl(p_decoder, OPUS_RESET_STATE);
+			free_indices.push_back(int((reinterpret_cast<uint8_t *>(p_decoder) - states) / state_stride));
+			stats.in_use--;
+		} else {
+			opus_decoder_destroy(p_decoder);
+			stats.unpooled--;
+		}
+	}
+
+	// Channels of the pooled decoders
+	int get_channel_count() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return channel_count;
+	}
+
+	Stats get_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+};
+
+}; // namespace godot
+
+#endif // OPUS_DECODER_POOL_HPP
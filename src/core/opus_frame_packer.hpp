@@ -0,0 +1,78 @@
+#ifndef OPUS_FRAME_PACKER_HPP
+#define OPUS_FRAME_PACKER_HPP
+
+#include <opus.h>
+#include <string.h>
+
+namespace godot {
+
+// Joins consecutive encoded frames into a single multi-frame Opus packet.
+// The repacketizer keeps pointers to the frames it is given, so they are
+// copied into a staging buffer that lives until the packet is flushed.
+class OpusFramePacker {
+public:
+	static const int MAX_PACKET_SIZE = 4000;
+
+private:
+	OpusRepacketizer *repacketizer = NULL;
+	unsigned char staging_buffer[MAX_PACKET_SIZE];
+	int staging_size = 0;
+	int frame_count = 0;
+
+public:
+	// Returns false if the frame does not fit or cannot be joined with the
+	// frames already added (e.g. the encoder switched mode), in which case
+	// the caller should flush and add it again.
+	bool add_frame(const unsigned char *p_frame, int p_frame_size) {
+		if (!repacketizer || p_frame_size <= 0) {
+			return false;
+		}
+		// Leave room for the multi-frame TOC and length bytes
+		if (staging_size + p_frame_size + 2 * (frame_count + 1) + 2 > MAX_PACKET_SIZE) {
+			return false;
+		}
+
+		unsigned char *frame_ptr = staging_buffer + staging_size;
+		memcpy(frame_ptr, p_frame, p_frame_size);
+		if (opus_repacketizer_cat(repacketizer, frame_ptr, p_frame_size) != OPUS_OK) {
+			return false;
+		}
+
+		staging_size += p_frame_size;
+		frame_count++;
+		return true;
+	}
+
+	// Writes the joined packet and starts a new one.
+	// Returns the packet size, 0 if no frames were added, or -1 on error.
+	int flush(unsigned char *p_output, int p_output_size) {
+		int packet_size = 0;
+		if (frame_count > 0) {
+			packet_size = opus_repacketizer_out(repacketizer, p_output, p_output_size);
+			if (packet_size < 0) {
+				packet_size = -1;
+			}
+		}
+
+		opus_repacketizer_init(repacketizer);
+		staging_size = 0;
+		frame_count = 0;
+		return packet_size;
+	}
+
+	int get_frame_count() const {
+		return frame_count;
+	}
+
+	OpusFramePacker() {
+		repacketizer = opus_repacketizer_create();
+	}
+
+	~OpusFramePacker() {
+		opus_repacketizer_destroy(repacketizer);
+	}
+};
+
+}; // namespace godot
+
+#endif // OPUS_FRAME_PACKER_HPP
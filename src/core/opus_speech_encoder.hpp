@@ -0,0 +1,263 @@
+#ifndef OPUS_SPEECH_ENCODER_HPP
+#define OPUS_SPEECH_ENCODER_HPP
+
+#include <opus.h>
+#include <opus_multistream.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+namespace godot {
+
+// Opus encoder with settings that can be changed from any thread.
+// Changes are only applied right before the next encode, on the
+// thread that is encoding.
+// Mono uses a plain encoder; more channels use the multistream encoder,
+// whose single coupled stream for stereo is an ordinary Opus packet that
+// any decoder can play.
+class OpusSpeechEncoder {
+public:
+	// Fixed-point builds target mobile, so start from a cheaper encoder there
+#ifdef FIXED_POINT
+	static const int DEFAULT_COMPLEXITY = 5;
+#else
+	static const int DEFAULT_COMPLEXITY = 9;
+#endif
+
+	struct Settings {
+		int bitrate = OPUS_AUTO;
+		bool vbr = true;
+		bool vbr_constraint = true;
+		int complexity = DEFAULT_COMPLEXITY;
+		bool dtx = false;
+		bool inband_fec = false;
+		int packet_loss_percentage = 0;
+		int signal = OPUS_AUTO;
+		int max_bandwidth = OPUS_BANDWIDTH_FULLBAND;
+	};
+
+	// Vorbis channel order, the most mapping family 1 supports
+	static const int MAX_CHANNEL_COUNT = 8;
+
+private:
+	OpusEncoder *encoder = NULL;
+	OpusMSEncoder *multistream_encoder = NULL;
+	uint32_t sample_rate = 0;
+	int channel_count = 0;
+
+	std::mutex settings_mutex;
+	Settings settings;
+	std::atomic<bool> settings_dirty;
+
+	std::atomic<uint32_t> final_range;
+	std::atomic<int> lookahead;
+	std::atomic<bool> in_dtx;
+	std::atomic<bool> inband_fec_active;
+
+	std::function<void(const std::string &)> error_handler;
+
+	void report_error(const std::string &p_message, int p_error_code) {
+		if (error_handler) {
+			error_handler(p_message + ": " + opus_strerror(p_error_code));
+		}
+	}
+
+	void apply_setting(int p_error_code, const char *p_name) {
+		if (p_error_code != OPUS_OK) {
+			report_error(std::string("could not set ") + p_name, p_error_code);
+		}
+	}
+
+	// Forwards a request to whichever encoder is in use
+	template <class... Args>
+	int encoder_ctl(int p_request, Args... p_args) {
+		if (multistream_encoder) {
+			return opus_multistream_encoder_ctl(multistream_encoder, p_request, p_args...);
+		}
+		return opus_encoder_ctl(encoder, p_request, p_args...);
+	}
+
+	void destroy() {
+		if (encoder) {
+			opus_encoder_destroy(encoder);
+			encoder = NULL;
+		}
+		if (multistream_encoder) {
+			opus_multistream_encoder_destroy(multistream_encoder);
+			multistream_encoder = NULL;
+		}
+		channel_count = 0;
+	}
+
+	void apply_settings() {
+		Settings current_settings;
+		{
+			std::lock_guard<std::mutex> lock(settings_mutex);
+			current_settings = settings;
+			settings_dirty = false;
+		}
+
+		apply_setting(encoder_ctl(OPUS_SET_BITRATE(current_settings.bitrate)), "bitrate");
+		apply_setting(encoder_ctl(OPUS_SET_VBR(current_settings.vbr ? 1 : 0)), "VBR");
+		apply_setting(encoder_ctl(OPUS_SET_VBR_CONSTRAINT(current_settings.vbr_constraint ? 1 : 0)), "VBR constraint");
+		apply_setting(encoder_ctl(OPUS_SET_COMPLEXITY(current_settings.complexity)), "complexity");
+		apply_setting(encoder_ctl(OPUS_SET_DTX(current_settings.dtx ? 1 : 0)), "DTX");
+		apply_setting(encoder_ctl(OPUS_SET_INBAND_FEC(current_settings.inband_fec ? 1 : 0)), "inband FEC");
+		inband_fec_active = current_settings.inband_fec;
+		apply_setting(encoder_ctl(OPUS_SET_PACKET_LOSS_PERC(current_settings.packet_loss_percentage)), "packet loss percentage");
+		apply_setting(encoder_ctl(OPUS_SET_SIGNAL(current_settings.signal)), "signal");
+		apply_setting(encoder_ctl(OPUS_SET_MAX_BANDWIDTH(current_settings.max_bandwidth)), "max bandwidth");
+
+		opus_int32 encoder_lookahead = 0;
+		if (encoder_ctl(OPUS_GET_LOOKAHEAD(&encoder_lookahead)) == OPUS_OK) {
+			lookahead = encoder_lookahead;
+		}
+	}
+
+public:
+	// Opus only accepts frames of 2.5, 5, 10, 20, 40 or 60 ms
+	static bool is_valid_frame_count(uint32_t p_sample_rate, int p_frame_count) {
+		const int frame_count_2_5_msec = p_sample_rate / 400;
+		return p_frame_count == frame_count_2_5_msec ||
+				p_frame_count == frame_count_2_5_msec * 2 ||
+				p_frame_count == frame_count_2_5_msec * 4 ||
+				p_frame_count == frame_count_2_5_msec * 8 ||
+				p_frame_count == frame_count_2_5_msec * 16 ||
+				p_frame_count == frame_count_2_5_msec * 24;
+	}
+
+	// OPUS_GET_IN_DTX only exists in newer Opus releases
+	static bool can_report_dtx() {
+#ifdef OPUS_GET_IN_DTX
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Receives messages for failures that cannot be returned, such as settings the encoder rejected
+	void set_error_handler(const std::function<void(const std::string &)> &p_error_handler) {
+		error_handler = p_error_handler;
+	}
+
+	// Returns OPUS_OK or the Opus error code.
+	// p_channel_count is 1 to MAX_CHANNEL_COUNT, interleaved in Vorbis order.
+	int init(uint32_t p_sample_rate, int p_channel_count, int p_application) {
+		destroy();
+		if (p_channel_count < 1 || p_channel_count > MAX_CHANNEL_COUNT) {
+			return OPUS_BAD_ARG;
+		}
+
+		int error = OPUS_OK;
+		if (p_channel_count == 1) {
+			encoder = opus_encoder_create(p_sample_rate, p_channel_count, p_application, &error);
+		} else {
+			// Family 0 is stereo in one coupled stream, family 1 the surround layouts
+			int stream_count = 0;
+			int coupled_stream_count = 0;
+			unsigned char mapping[MAX_CHANNEL_COUNT];
+			multistream_encoder = opus_multistream_surround_encoder_create(
+					p_sample_rate, p_channel_count, p_channel_count <= 2 ? 0 : 1,
+					&stream_count, &coupled_stream_count, mapping, p_application, &error);
+		}
+		if (error != OPUS_OK) {
+			destroy();
+			return error;
+		}
+		sample_rate = p_sample_rate;
+		channel_count = p_channel_count;
+
+		// Nothing else touches the encoder yet
+		apply_settings();
+		return OPUS_OK;
+	}
+
+	bool is_initialized() const {
+		return encoder || multistream_encoder;
+	}
+
+	// Interleaved channels encode expects, 0 before init
+	int get_channel_count() const {
+		return channel_count;
+	}
+
+	void set_settings(const Settings &p_settings) {
+		std::lock_guard<std::mutex> lock(settings_mutex);
+		settings = p_settings;
+		settings_dirty = true;
+	}
+
+	Settings get_settings() {
+		std::lock_guard<std::mutex> lock(settings_mutex);
+		return settings;
+	}
+
+	// Range coder state after the last encode, for comparing against the decoder
+	uint32_t get_final_range() const {
+		return final_range;
+	}
+
+	// Encoder delay in samples at the encoder's sample rate
+	int get_lookahead() const {
+		return lookahead;
+	}
+
+	// Whether the encoder considered the last frame silence, needs DTX enabled
+	bool is_in_dtx() const {
+		return in_dtx;
+	}
+
+	// Whether the frames encoded now carry inband FEC, as opposed to the
+	// setting, which only takes effect at the next encode
+	bool is_inband_fec_active() const {
+		return inband_fec_active;
+	}
+
+	// Encodes a single frame of p_frame_count samples per channel.
+	// Returns the packet size, or a negative Opus error code.
+	int encode(const int16_t *p_pcm, int p_frame_count, uint8_t *p_output, int p_output_size) {
+		if (!is_initialized()) {
+			return OPUS_INVALID_STATE;
+		}
+
+		if (settings_dirty) {
+			apply_settings();
+		}
+
+		const opus_int32 packet_size = multistream_encoder ?
+				opus_multistream_encode(multistream_encoder, p_pcm, p_frame_count, p_output, p_output_size) :
+				opus_encode(encoder, p_pcm, p_frame_count, p_output, p_output_size);
+		if (packet_size >= 0) {
+			opus_uint32 encoder_final_range = 0;
+			encoder_ctl(OPUS_GET_FINAL_RANGE(&encoder_final_range));
+			final_range = encoder_final_range;
+
+#ifdef OPUS_GET_IN_DTX
+			opus_int32 encoder_in_dtx = 0;
+			if (encoder_ctl(OPUS_GET_IN_DTX(&encoder_in_dtx)) == OPUS_OK) {
+				in_dtx = encoder_in_dtx != 0;
+			}
+#endif
+		}
+
+		return packet_size;
+	}
+
+	OpusSpeechEncoder() :
+			settings_dirty(false),
+			final_range(0),
+			lookahead(0),
+			in_dtx(false),
+			inband_fec_active(false) {}
+
+	~OpusSpeechEncoder() {
+		destroy();
+	}
+};
+
+}; // namespace godot
+
+#endif // OPUS_SPEECH_ENCODER_HPP
@@ -0,0 +1,141 @@
+#ifndef PACKET_RING_BUFFER_HPP
+#define PACKET_RING_BUFFER_HPP
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+namespace godot {
+
+// Lock-free single-producer/single-consumer ring of compressed packets.
+// When full, push drops the oldest packet in O(1) rather than the newest.
+// Every slot reserves max_packet_size bytes, but only the real packet
+// length is ever copied in or out.
+class PacketRingBuffer {
+public:
+	struct PacketInfo {
+		int size = 0;
+		float loudness = 0.0;
+		uint32_t sequence = 0;
+		uint32_t timestamp = 0;
+		// VoicePacket flags
+		uint8_t flags = 0;
+	};
+
+private:
+	std::vector<uint8_t> packet_bytes;
+	std::vector<PacketInfo> packet_infos;
+
+	// Packets held before the oldest is dropped, at most slot_count - 1
+	uint32_t packet_capacity = 0;
+	uint32_t slot_count = 0;
+	uint32_t mask = 0;
+	uint32_t max_packet_size = 0;
+
+	// Both counters only ever increase, the slot index is taken from the low bits.
+	// The producer may advance head itself to drop the oldest packet, so the
+	// consumer claims packets with a compare-exchange.
+	std::atomic<uint32_t> head;
+	uint8_t head_padding[64 - sizeof(std::atomic<uint32_t>)];
+	std::atomic<uint32_t> tail;
+
+	uint32_t pending_head = 0;
+
+	static uint32_t next_power_of_two(uint32_t p_value) {
+		uint32_t result = 1;
+		while (result < p_value) {
+			result <<= 1;
+		}
+		return result;
+	}
+
+public:
+	// Reallocates the ring to hold p_capacity packets and discards its
+	// contents. Not thread-safe, neither side may be running.
+	void resize(uint32_t p_capacity, uint32_t p_max_packet_size) {
+		// Slots are rounded up to a power of two for indexing, with at least
+		// one always free so the producer never writes the slot the consumer
+		// is currently reading.
+		packet_capacity = p_capacity;
+		slot_count = p_capacity ? next_power_of_two(p_capacity + 1) : 0;
+		mask = slot_count - 1;
+		max_packet_size = p_max_packet_size;
+
+		packet_bytes.resize(static_cast<size_t>(slot_count) * max_packet_size);
+		packet_infos.resize(slot_count);
+
+		clear();
+	}
+
+	void clear() {
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+		pending_head = 0;
+	}
+
+	// Producer side. Returns false if the oldest packet had to be dropped to make room.
+	bool push(const uint8_t *p_data, const PacketInfo &p_info) {
+		if (packet_capacity == 0) {
+			return false;
+		}
+
+		bool dropped = false;
+		const uint32_t current_tail = tail.load(std::memory_order_relaxed);
+		uint32_t current_head = head.load(std::memory_order_acquire);
+		if (current_tail - current_head >= packet_capacity) {
+			// A failed exchange means the consumer just freed a slot
+			dropped = head.compare_exchange_strong(current_head, current_head + 1, std::memory_order_acq_rel);
+		}
+
+		const uint32_t slot = current_tail & mask;
+		PacketInfo &info = packet_infos[slot];
+		info = p_info;
+		info.size = p_info.size < 0 ? 0 : (p_info.size > int(max_packet_size) ? int(max_packet_size) : p_info.size);
+		memcpy(&packet_bytes[static_cast<size_t>(slot) * max_packet_size], p_data, info.size);
+
+		tail.store(current_tail + 1, std::memory_order_release);
+		return !dropped;
+	}
+
+	// Consumer side. Returns the oldest packet, or NULL if the ring is empty.
+	// The data must be copied out before calling commit_pop.
+	const uint8_t *front(PacketInfo *r_info) {
+		pending_head = head.load(std::memory_order_acquire);
+		if (pending_head == tail.load(std::memory_order_acquire)) {
+			return NULL;
+		}
+
+		const uint32_t slot = pending_head & mask;
+		*r_info = packet_infos[slot];
+		// A packet overwritten mid-read is discarded by commit_pop, but keep the copy in bounds
+		if (r_info->size < 0 || r_info->size > int(max_packet_size)) {
+			r_info->size = 0;
+		}
+		return &packet_bytes[static_cast<size_t>(slot) * max_packet_size];
+	}
+
+	// Returns false if the producer dropped the packet while it was being
+	// copied, in which case the copy must be discarded.
+	bool commit_pop() {
+		uint32_t expected_head = pending_head;
+		return head.compare_exchange_strong(expected_head, pending_head + 1, std::memory_order_acq_rel);
+	}
+
+	uint32_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	uint32_t capacity() const {
+		return packet_capacity;
+	}
+
+	PacketRingBuffer() :
+			head(0),
+			tail(0) {
+	}
+};
+
+}; // namespace godot
+
+#endif // PACKET_RING_BUFFER_HPP
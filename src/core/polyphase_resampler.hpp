@@ -0,0 +1,139 @@
+#ifndef POLYPHASE_RESAMPLER_HPP
+#define POLYPHASE_RESAMPLER_HPP
+
+#include <vector>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace godot {
+
+// Mono rational-ratio resampler for fixed rate pairs such as 44.1k->48k
+// (160/147). The ratio is reduced to up/down factors and a windowed-sinc
+// lowpass is split into one short filter per output phase, so each output
+// sample costs TAPS_PER_PHASE multiply-adds and no state beyond the last
+// few input samples. Much cheaper than libsamplerate's sinc converters,
+// at a quality that is plenty for 16-bit voice.
+// Not thread-safe.
+class PolyphaseResampler {
+public:
+	static const uint32_t TAPS_PER_PHASE = 16;
+	// Keeps the coefficient table small, ratios needing more phases are not supported
+	static const uint32_t MAX_PHASES = 512;
+
+private:
+	uint32_t up_factor = 0;
+	uint32_t down_factor = 0;
+
+	// coefficients[phase * TAPS_PER_PHASE + tap]
+	std::vector<float> coefficients;
+	// TAPS_PER_PHASE - 1 samples of history followed by the current input
+	std::vector<float> work_buffer;
+	uint32_t max_input_frame_count = 0;
+
+	uint32_t input_index = TAPS_PER_PHASE - 1;
+	uint32_t phase = 0;
+
+	static uint32_t greatest_common_divisor(uint32_t p_a, uint32_t p_b) {
+		while (p_b != 0) {
+			const uint32_t remainder = p_a % p_b;
+			p_a = p_b;
+			p_b = remainder;
+		}
+		return p_a;
+	}
+
+	void build_coefficients() {
+		const uint32_t tap_count = up_factor * TAPS_PER_PHASE;
+		// Cutoff relative to the upsampled rate, just below the lower of the two Nyquist limits
+		const double cutoff = 0.5 * 0.9 / double(up_factor > down_factor ? up_factor : down_factor);
+		const double center = double(tap_count - 1) / 2.0;
+
+		coefficients.resize(tap_count);
+		for (uint32_t n = 0; n < tap_count; n++) {
+			const double x = double(n) - center;
+			const double sinc = x == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+			// Blackman window
+			const double window = 0.42 - 0.5 * cos(2.0 * M_PI * n / (tap_count - 1)) + 0.08 * cos(4.0 * M_PI * n / (tap_count - 1));
+			const double value = sinc * window * up_factor;
+
+			// Regroup so each phase's taps are contiguous
+			const uint32_t filter_phase = n % up_factor;
+			const uint32_t filter_tap = n / up_factor;
+			coefficients[filter_phase * TAPS_PER_PHASE + filter_tap] = float(value);
+		}
+	}
+
+public:
+	static bool supports(uint32_t p_src_rate, uint32_t p_dst_rate) {
+		if (p_src_rate == 0 || p_dst_rate == 0) {
+			return false;
+		}
+		const uint32_t divisor = greatest_common_divisor(p_src_rate, p_dst_rate);
+		return p_dst_rate / divisor <= MAX_PHASES;
+	}
+
+	// Returns false if the ratio needs too many phases
+	bool configure(uint32_t p_src_rate, uint32_t p_dst_rate, uint32_t p_max_input_frame_count) {
+		if (!supports(p_src_rate, p_dst_rate)) {
+			return false;
+		}
+		const uint32_t divisor = greatest_common_divisor(p_src_rate, p_dst_rate);
+		up_factor = p_dst_rate / divisor;
+		down_factor = p_src_rate / divisor;
+		max_input_frame_count = p_max_input_frame_count;
+
+		build_coefficients();
+		work_buffer.resize(TAPS_PER_PHASE - 1 + max_input_frame_count);
+		reset();
+		return true;
+	}
+
+	void reset() {
+		memset(work_buffer.data(), 0, work_buffer.size() * sizeof(float));
+		input_index = TAPS_PER_PHASE - 1;
+		phase = 0;
+	}
+
+	// Largest number of frames process can write for p_input_frame_count input frames
+	uint32_t get_max_output_frame_count(uint32_t p_input_frame_count) const {
+		return uint32_t((uint64_t(p_input_frame_count) * up_factor) / down_factor) + 1;
+	}
+
+	// Returns the number of frames written to p_dst, which must hold get_max_output_frame_count frames
+	uint32_t process(const float *p_src, uint32_t p_src_frame_count, float *p_dst) {
+		if (p_src_frame_count > max_input_frame_count) {
+			p_src_frame_count = max_input_frame_count;
+		}
+
+		const uint32_t history_count = TAPS_PER_PHASE - 1;
+		float *work = work_buffer.data();
+		memcpy(work + history_count, p_src, p_src_frame_count * sizeof(float));
+		const uint32_t work_count = history_count + p_src_frame_count;
+
+		uint32_t output_count = 0;
+		while (input_index < work_count) {
+			const float *filter = &coefficients[phase * TAPS_PER_PHASE];
+			const float *sample = work + input_index;
+			float sum = 0.0f;
+			for (uint32_t k = 0; k < TAPS_PER_PHASE; k++) {
+				sum += sample[-int32_t(k)] * filter[k];
+			}
+			p_dst[output_count++] = sum;
+
+			phase += down_factor;
+			input_index += phase / up_factor;
+			phase %= up_factor;
+		}
+
+		// Keep the tail as history for the next block
+		memmove(work, work + work_count - history_count, history_count * sizeof(float));
+		input_index = input_index - work_count + history_count;
+
+		return output_count;
+	}
+};
+
+}; // namespace godot
+
+#endif // POLYPHASE_RESAMPLER_HPP
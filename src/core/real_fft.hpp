@@ -0,0 +1,173 @@
+#ifndef REAL_FFT_HPP
+#define REAL_FFT_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+namespace godot {
+
+// FFT of real signals of a fixed power of two size. The input is packed
+// into a complex signal of half the size, transformed with an iterative
+// radix-2 FFT and unpacked, so a transform costs about half of a complex
+// one. Tables are built by configure, forward and inverse never allocate.
+// Spectra are get_bin_count() bins of interleaved real and imaginary parts.
+// Not thread-safe.
+class RealFft {
+	uint32_t size = 0;
+	uint32_t half_size = 0;
+
+	std::vector<uint32_t> bit_reverse;
+	// exp(-2 pi i k / half_size) for k < half_size / 2, interleaved
+	std::vector<float> twiddles;
+	// exp(-2 pi i k / size) for k <= half_size, interleaved
+	std::vector<float> unpack_twiddles;
+	// half_size complex values
+	std::vector<float> work;
+
+	void transform(float *p_data, bool p_inverse) const {
+		for (uint32_t i = 0; i < half_size; i++) {
+			const uint32_t j = bit_reverse[i];
+			if (i < j) {
+				float temp = p_data[i * 2];
+				p_data[i * 2] = p_data[j * 2];
+				p_data[j * 2] = temp;
+				temp = p_data[i * 2 + 1];
+				p_data[i * 2 + 1] = p_data[j * 2 + 1];
+				p_data[j * 2 + 1] = temp;
+			}
+		}
+
+		const float sign = p_inverse ? -1.0f : 1.0f;
+		for (uint32_t length = 2; length <= half_size; length <<= 1) {
+			const uint32_t half_length = length >> 1;
+			const uint32_t step = half_size / length;
+			for (uint32_t start = 0; start < half_size; start += length) {
+				for (uint32_t k = 0; k < half_length; k++) {
+					const float w_re = twiddles[k * step * 2];
+					const float w_im = sign * twiddles[k * step * 2 + 1];
+					float *a = p_data + (start + k) * 2;
+					float *b = p_data + (start + k + half_length) * 2;
+					const float b_re = b[0] * w_re - b[1] * w_im;
+					const float b_im = b[0] * w_im + b[1] * w_re;
+					b[0] = a[0] - b_re;
+					b[1] = a[1] - b_im;
+					a[0] += b_re;
+					a[1] += b_im;
+				}
+			}
+		}
+	}
+
+public:
+	// p_size must be a power of two of at least 4
+	bool configure(uint32_t p_size) {
+		if (p_size < 4 || (p_size & (p_size - 1)) != 0) {
+			return false;
+		}
+		size = p_size;
+		half_size = p_size / 2;
+
+		uint32_t bit_count = 0;
+		while ((1u << bit_count) < half_size) {
+			bit_count++;
+		}
+		bit_reverse.resize(half_size);
+		for (uint32_t i = 0; i < half_size; i++) {
+			uint32_t reversed = 0;
+			for (uint32_t bit = 0; bit < bit_count; bit++) {
+				if (i & (1u << bit)) {
+					reversed |= 1u << (bit_count - 1 - bit);
+				}
+			}
+			bit_reverse[i] = reversed;
+		}
+
+		twiddles.resize(half_size);
+		for (uint32_t k = 0; k < half_size / 2; k++) {
+			const double angle = -2.0 * M_PI * double(k) / double(half_size);
+			twiddles[k * 2] = float(cos(angle));
+			twiddles[k * 2 + 1] = float(sin(angle));
+		}
+		unpack_twiddles.resize((half_size + 1) * 2);
+		for (uint32_t k = 0; k <= half_size; k++) {
+			const double angle = -2.0 * M_PI * double(k) / double(size);
+			unpack_twiddles[k * 2] = float(cos(angle));
+			unpack_twiddles[k * 2 + 1] = float(sin(angle));
+		}
+		work.resize(half_size * 2);
+		return true;
+	}
+
+	uint32_t get_size() const {
+		return size;
+	}
+
+	uint32_t get_bin_count() const {
+		return half_size + 1;
+	}
+
+	// Unscaled transform of get_size() samples into get_bin_count() bins
+	void forward(const float *p_input, float *r_spectrum) {
+		float *z = work.data();
+		for (uint32_t i = 0; i < half_size * 2; i++) {
+			z[i] = p_input[i];
+		}
+		transform(z, false);
+
+		for (uint32_t k = 0; k <= half_size; k++) {
+			const uint32_t k_index = k == half_size ? 0 : k;
+			const uint32_t mirror_index = k == 0 ? 0 : half_size - k;
+			const float z_re = z[k_index * 2];
+			const float z_im = z[k_index * 2 + 1];
+			const float mirror_re = z[mirror_index * 2];
+			const float mirror_im = -z[mirror_index * 2 + 1];
+
+			// Spectra of the even and odd samples
+			const float even_re = 0.5f * (z_re + mirror_re);
+			const float even_im = 0.5f * (z_im + mirror_im);
+			const float odd_re = 0.5f * (z_im - mirror_im);
+			const float odd_im = -0.5f * (z_re - mirror_re);
+
+			const float w_re = unpack_twiddles[k * 2];
+			const float w_im = unpack_twiddles[k * 2 + 1];
+			r_spectrum[k * 2] = even_re + odd_re * w_re - odd_im * w_im;
+			r_spectrum[k * 2 + 1] = even_im + odd_re * w_im + odd_im * w_re;
+		}
+	}
+
+	// Inverse of forward, scaled so that inverse(forward(x)) is x.
+	// p_spectrum is left untouched.
+	void inverse(const float *p_spectrum, float *r_output) {
+		float *z = work.data();
+		for (uint32_t k = 0; k < half_size; k++) {
+			const float x_re = p_spectrum[k * 2];
+			const float x_im = p_spectrum[k * 2 + 1];
+			const float mirror_re = p_spectrum[(half_size - k) * 2];
+			const float mirror_im = -p_spectrum[(half_size - k) * 2 + 1];
+
+			const float even_re = 0.5f * (x_re + mirror_re);
+			const float even_im = 0.5f * (x_im + mirror_im);
+			// Odd spectrum is (x - conj(mirror)) * conj(w) / 2
+			const float diff_re = 0.5f * (x_re - mirror_re);
+			const float diff_im = 0.5f * (x_im - mirror_im);
+			const float w_re = unpack_twiddles[k * 2];
+			const float w_im = -unpack_twiddles[k * 2 + 1];
+			const float odd_re = diff_re * w_re - diff_im * w_im;
+			const float odd_im = diff_re * w_im + diff_im * w_re;
+
+			z[k * 2] = even_re - odd_im;
+			z[k * 2 + 1] = even_im + odd_re;
+		}
+		transform(z, true);
+
+		const float scale = 1.0f / float(half_size);
+		for (uint32_t i = 0; i < half_size * 2; i++) {
+			r_output[i] = z[i] * scale;
+		}
+	}
+};
+
+}; // namespace godot
+
+#endif // REAL_FFT_HPP
@@ -0,0 +1,68 @@
+#ifndef SCRATCH_ARENA_HPP
+#define SCRATCH_ARENA_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace godot {
+
+// One block of memory handed out as cache line aligned buffers.
+// Sized once by configure, after which allocate only moves an offset,
+// so hot paths can take all their scratch space from it without ever
+// touching the heap. Buffers stay valid until the next configure.
+// Not thread-safe.
+class ScratchArena {
+public:
+	static const size_t ALIGNMENT = 64;
+
+private:
+	std::vector<uint8_t> memory;
+	uint8_t *base = NULL;
+	size_t capacity = 0;
+	size_t offset = 0;
+
+	static size_t align(size_t p_size) {
+		return (p_size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	}
+
+public:
+	// Bytes configure needs so that p_count Ts can be allocated
+	template <class T>
+	static size_t get_size(size_t p_count) {
+		return align(sizeof(T) * p_count);
+	}
+
+	// Releases every buffer and reserves p_byte_count bytes
+	void configure(size_t p_byte_count) {
+		memory.resize(p_byte_count + ALIGNMENT);
+		const uintptr_t address = reinterpret_cast<uintptr_t>(memory.data());
+		base = memory.data() + (ALIGNMENT - address % ALIGNMENT) % ALIGNMENT;
+		capacity = p_byte_count;
+		offset = 0;
+	}
+
+	// Returns NULL once the arena is exhausted
+	template <class T>
+	T *allocate(size_t p_count) {
+		const size_t size = get_size<T>(p_count);
+		if (!base || offset + size > capacity) {
+			return NULL;
+		}
+		T *ptr = reinterpret_cast<T *>(base + offset);
+		offset += size;
+		return ptr;
+	}
+
+	size_t get_capacity() const {
+		return capacity;
+	}
+
+	size_t get_used() const {
+		return offset;
+	}
+};
+
+}; // namespace godot
+
+#endif // SCRATCH_ARENA_HPP
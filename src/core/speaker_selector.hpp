@@ -0,0 +1,255 @@
+#ifndef SPEAKER_SELECTOR_HPP
+#define SPEAKER_SELECTOR_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+namespace godot {
+
+// Picks the loudest N speakers from the loudness carried with each packet.
+// Every peer keeps a rolling score that rises quickly while its packets are
+// loud and falls slowly once they stop. A quiet speaker keeps its slot for
+// at least hold_msec, and is only replaced by one whose score beats it by
+// switch_margin, so the active set does not flap between similar speakers.
+// Not thread-safe.
+class SpeakerSelector {
+	struct Speaker {
+		int id = 0;
+		float score = 0.0f;
+		// Loudest packet since the last update, or -1 if there was none
+		float pending_loudness = -1.0f;
+		bool active = false;
+		// Frames since the speaker last became active
+		uint32_t active_frame_count = 0;
+	};
+
+	std::vector<Speaker> speakers;
+
+	int max_active_count = 0;
+	float activity_threshold = 0.005f;
+	float switch_margin = 0.5f;
+	float attack_msec = 20.0f;
+	float release_msec = 500.0f;
+	float hold_msec = 1000.0f;
+	uint32_t sample_rate = 48000;
+
+	int active_count = 0;
+
+	Speaker *find_speaker(int p_id) {
+		for (size_t i = 0; i < speakers.size(); i++) {
+			if (speakers[i].id == p_id) {
+				return &speakers[i];
+			}
+		}
+		return NULL;
+	}
+
+	uint32_t msec_to_frames(float p_msec) const {
+		return uint32_t(p_msec * sample_rate / 1000.0f);
+	}
+
+	// One-pole smoothing coefficient for p_frame_count frames
+	float smoothing(float p_msec, uint32_t p_frame_count) const {
+		if (p_msec <= 0.0f) {
+			return 1.0f;
+		}
+		return 1.0f - expf(-float(p_frame_count) / (p_msec * sample_rate / 1000.0f));
+	}
+
+	int find_loudest_inactive() const {
+		int loudest = -1;
+		for (size_t i = 0; i < speakers.size(); i++) {
+			const Speaker &speaker = speakers[i];
+			if (!speaker.active && speaker.score >= activity_threshold &&
+					(loudest < 0 || speaker.score > speakers[loudest].score)) {
+				loudest = int(i);
+			}
+		}
+		return loudest;
+	}
+
+	// Quietest active speaker that has been held long enough to be replaced
+	int find_replaceable_active(uint32_t p_hold_frame_count) const {
+		int quietest = -1;
+		for (size_t i = 0; i < speakers.size(); i++) {
+			const Speaker &speaker = speakers[i];
+			if (speaker.active && speaker.active_frame_count >= p_hold_frame_count &&
+					(quietest < 0 || speaker.score < speakers[quietest].score)) {
+				quietest = int(i);
+			}
+		}
+		return quietest;
+	}
+
+	void set_active(Speaker &r_speaker, bool p_active) {
+		if (r_speaker.active == p_active) {
+			return;
+		}
+		r_speaker.active = p_active;
+		r_speaker.active_frame_count = 0;
+		active_count += p_active ? 1 : -1;
+	}
+
+public:
+	void add_speaker(int p_id) {
+		if (find_speaker(p_id)) {
+			return;
+		}
+		Speaker speaker;
+		speaker.id = p_id;
+		speakers.push_back(speaker);
+	}
+
+	void remove_speaker(int p_id) {
+		for (size_t i = 0; i < speakers.size(); i++) {
+			if (speakers[i].id == p_id) {
+				if (speakers[i].active) {
+					active_count--;
+				}
+				speakers.erase(speakers.begin() + i);
+				return;
+			}
+		}
+	}
+
+	// Records the loudness of a packet from p_id, applied at the next update
+	void push_loudness(int p_id, float p_loudness) {
+		Speaker *speaker = find_speaker(p_id);
+		if (speaker && p_loudness > speaker->pending_loudness) {
+			speaker->pending_loudness = p_loudness;
+		}
+	}
+
+	// Advances the scores by p_frame_count frames and updates the active set
+	void update(uint32_t p_frame_count) {
+		const float attack = smoothing(attack_msec, p_frame_count);
+		const float release = smoothing(release_msec, p_frame_count);
+		for (size_t i = 0; i < speakers.size(); i++) {
+			Speaker &speaker = speakers[i];
+			// No packets means silence, whether from DTX, the VAD or a dropped peer
+			const float target = speaker.pending_loudness > 0.0f ? speaker.pending_loudness : 0.0f;
+			speaker.score += (target - speaker.score) * (target > speaker.score ? attack : release);
+			speaker.pending_loudness = -1.0f;
+			if (speaker.active) {
+				speaker.active_frame_count += p_frame_count;
+			}
+		}
+
+		if (max_active_count <= 0) {
+			// Unlimited, every speaker above the threshold is active
+			for (size_t i = 0; i < speakers.size(); i++) {
+				Speaker &speaker = speakers[i];
+				if (speaker.score >= activity_threshold) {
+					set_active(speaker, true);
+				} else if (speaker.active_frame_count >= msec_to_frames(hold_msec)) {
+					set_active(speaker, false);
+				}
+			}
+			return;
+		}
+
+		const uint32_t hold_frame_count = msec_to_frames(hold_msec);
+
+		// Release speakers that went quiet once their hold has passed
+		for (size_t i = 0; i < speakers.size(); i++) {
+			Speaker &speaker = speakers[i];
+			if (speaker.active && speaker.score < activity_threshold && speaker.active_frame_count >= hold_frame_count) {
+				set_active(speaker, false);
+			}
+		}
+
+		// Fill free slots, loudest first
+		while (active_count < max_active_count) {
+			const int loudest = find_loudest_inactive();
+			if (loudest < 0) {
+				break;
+			}
+			set_active(speakers[loudest], true);
+		}
+
+		// Swap in louder speakers only when they clearly beat the quietest one
+		while (true) {
+			const int loudest = find_loudest_inactive();
+			const int quietest = find_replaceable_active(hold_frame_count);
+			if (loudest < 0 || quietest < 0 ||
+					speakers[loudest].score <= speakers[quietest].score * (1.0f + switch_margin)) {
+				break;
+			}
+			set_active(speakers[quietest], false);
+			set_active(speakers[loudest], true);
+		}
+	}
+
+	bool is_active(int p_id) {
+		const Speaker *speaker = find_speaker(p_id);
+		return speaker && speaker->active;
+	}
+
+	float get_score(int p_id) {
+		const Speaker *speaker = find_speaker(p_id);
+		return speaker ? speaker->score : 0.0f;
+	}
+
+	int get_active_count() const {
+		return active_count;
+	}
+
+	// Active speakers at most, 0 for no limit
+	void set_max_active_count(int p_count) {
+		max_active_count = p_count > 0 ? p_count : 0;
+		// Trim immediately so the limit holds before the next update
+		while (max_active_count > 0 && active_count > max_active_count) {
+			set_active(speakers[find_replaceable_active(0)], false);
+		}
+	}
+	int get_max_active_count() const {
+		return max_active_count;
+	}
+
+	// Scores below this never become active
+	void set_activity_threshold(float p_threshold) {
+		activity_threshold = p_threshold;
+	}
+	float get_activity_threshold() const {
+		return activity_threshold;
+	}
+
+	// How much louder, as a fraction, a speaker must be to take a full slot
+	void set_switch_margin(float p_margin) {
+		switch_margin = p_margin > 0.0f ? p_margin : 0.0f;
+	}
+	float get_switch_margin() const {
+		return switch_margin;
+	}
+
+	void set_attack_msec(float p_msec) {
+		attack_msec = p_msec;
+	}
+	float get_attack_msec() const {
+		return attack_msec;
+	}
+
+	void set_release_msec(float p_msec) {
+		release_msec = p_msec;
+	}
+	float get_release_msec() const {
+		return release_msec;
+	}
+
+	// Shortest time a speaker stays active once selected
+	void set_hold_msec(float p_msec) {
+		hold_msec = p_msec;
+	}
+	float get_hold_msec() const {
+		return hold_msec;
+	}
+
+	void set_sample_rate(uint32_t p_sample_rate) {
+		sample_rate = p_sample_rate;
+	}
+};
+
+}; // namespace godot
+
+#endif // SPEAKER_SELECTOR_HPP
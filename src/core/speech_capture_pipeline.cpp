@@ -0,0 +1,251 @@
+#include "speech_capture_pipeline.hpp"
+
+#include <math.h>
+#include <string.h>
+
+using namespace godot;
+
+void SpeechCapturePipeline::setup_resampler(int p_quality) {
+	if (libresample_state) {
+		libresample_state = src_delete(libresample_state);
+	}
+	use_polyphase_resampler = false;
+	resampler_quality = p_quality;
+
+	if (p_quality == RESAMPLER_POLYPHASE) {
+		if (channel_count != 1) {
+			report_error("the polyphase resampler is mono only, using sinc fastest");
+		} else if (polyphase_resampler.configure(input_sample_rate, output_sample_rate, max_input_frame_count)) {
+			use_polyphase_resampler = true;
+			return;
+		} else {
+			report_error("input rate not supported by the polyphase resampler, using sinc fastest");
+		}
+	}
+
+	int converter_type = SRC_SINC_FASTEST;
+	switch (p_quality) {
+		case RESAMPLER_SINC_BEST:
+			converter_type = SRC_SINC_BEST_QUALITY;
+			break;
+		case RESAMPLER_SINC_MEDIUM:
+			converter_type = SRC_SINC_MEDIUM_QUALITY;
+			break;
+		case RESAMPLER_LINEAR:
+			converter_type = SRC_LINEAR;
+			break;
+		default:
+			break;
+	}
+	libresample_state = src_new(converter_type, int(channel_count), &libresample_error);
+	if (!libresample_state) {
+		report_error(std::string("could not create resampler: ") + src_strerror(libresample_error));
+	}
+}
+
+void SpeechCapturePipeline::cancel_echo(float *p_mono, uint32_t p_frame_count) {
+	// Also called while disabled, so the canceller starts clean when enabled again
+	SpeechStats::ScopedTimer echo_cancel_timer(echo_canceller.is_enabled() ? stats : NULL, SpeechStats::STAGE_ECHO_CANCEL);
+	echo_canceller.process(p_mono, p_frame_count, stream_position);
+}
+
+uint32_t SpeechCapturePipeline::slip_frames(float *p_frames, uint32_t p_frame_count) {
+	slip_debt += double(p_frame_count) * (ratio_scale - 1.0);
+	while (slip_debt >= 1.0) {
+		// Repeat the last frame
+		memcpy(p_frames + p_frame_count * channel_count, p_frames + (p_frame_count - 1) * channel_count, channel_count * sizeof(float));
+		p_frame_count++;
+		slip_debt -= 1.0;
+	}
+	while (slip_debt <= -1.0 && p_frame_count > 0) {
+		p_frame_count--;
+		slip_debt += 1.0;
+	}
+	return p_frame_count;
+}
+
+void SpeechCapturePipeline::fill_frame_buffer(const float *p_stereo_input, uint32_t p_input_frame_count) {
+	if (p_input_frame_count > max_input_frame_count) {
+		report_error("input block larger than configured");
+		p_input_frame_count = max_input_frame_count;
+	}
+
+	const AudioKernels &audio_kernels = get_audio_kernels();
+	float *write_ptr = frame_buffer.data() + frame_buffer_count * channel_count;
+	const uint32_t capacity = uint32_t(frame_buffer.size()) / channel_count - frame_buffer_count;
+
+	const bool equal_rates = input_sample_rate == output_sample_rate;
+	if (equal_rates && fabs(ratio_scale - 1.0) <= MAX_SAMPLE_SLIP_DEVIATION) {
+		if (resampling_equal_rates) {
+			resampling_equal_rates = false;
+			if (libresample_state) {
+				src_reset(libresample_state);
+			}
+		}
+
+		// Nothing to resample, downmix or copy straight into the frame buffer
+		{
+			SpeechStats::ScopedTimer downmix_timer(stats, SpeechStats::STAGE_DOWNMIX);
+			if (channel_count == 1) {
+				audio_kernels.downmix_stereo_to_mono(p_stereo_input, write_ptr, p_input_frame_count);
+			} else {
+				memcpy(write_ptr, p_stereo_input, p_input_frame_count * MAX_CHANNEL_COUNT * sizeof(float));
+			}
+		}
+		if (channel_count == 1) {
+			cancel_echo(write_ptr, p_input_frame_count);
+		}
+		if (p_input_frame_count > 0) {
+			frame_buffer_count += slip_frames(write_ptr, p_input_frame_count);
+		}
+		ratio_scale_applied = true;
+		return;
+	}
+	if (equal_rates && !resampling_equal_rates) {
+		resampling_equal_rates = true;
+		slip_debt = 0.0;
+		if (libresample_state) {
+			src_reset(libresample_state);
+		}
+	}
+
+	const int quality = pending_resampler_quality;
+	if (quality != resampler_quality) {
+		setup_resampler(quality);
+	}
+
+	// Stereo is resampled straight from the input
+	const float *resample_input = p_stereo_input;
+	if (channel_count == 1) {
+		{
+			SpeechStats::ScopedTimer downmix_timer(stats, SpeechStats::STAGE_DOWNMIX);
+			audio_kernels.downmix_stereo_to_mono(p_stereo_input, mono_buffer.data(), p_input_frame_count);
+		}
+		cancel_echo(mono_buffer.data(), p_input_frame_count);
+		resample_input = mono_buffer.data();
+	}
+
+	SpeechStats::ScopedTimer resample_timer(stats, SpeechStats::STAGE_RESAMPLE);
+	if (use_polyphase_resampler) {
+		if (polyphase_resampler.get_max_output_frame_count(p_input_frame_count) > capacity) {
+			report_error("resample buffer overflow");
+			return;
+		}
+		frame_buffer_count += polyphase_resampler.process(resample_input, p_input_frame_count, write_ptr);
+		return;
+	}
+
+	if (!libresample_state) {
+		return;
+	}
+
+	SRC_DATA src_data;
+	src_data.data_in = resample_input;
+	src_data.data_out = write_ptr;
+	src_data.input_frames = p_input_frame_count;
+	src_data.output_frames = capacity;
+	src_data.src_ratio = double(output_sample_rate) / double(input_sample_rate) * ratio_scale;
+	src_data.end_of_input = 0;
+
+	const int error = src_process(libresample_state, &src_data);
+	if (error != 0) {
+		report_error(std::string("resample error: ") + src_strerror(error));
+		return;
+	}
+	frame_buffer_count += uint32_t(src_data.output_frames_gen);
+	ratio_scale_applied = true;
+}
+
+void SpeechCapturePipeline::keep_remainder(uint32_t p_consumed_count) {
+	const uint32_t remaining_count = frame_buffer_count - p_consumed_count;
+	if (remaining_count > 0 && p_consumed_count > 0) {
+		memmove(frame_buffer.data(), frame_buffer.data() + p_consumed_count * channel_count, remaining_count * channel_count * sizeof(float));
+	}
+	frame_buffer_count = remaining_count;
+}
+
+void SpeechCapturePipeline::update_channel_count() {
+	channel_count = pending_channel_count;
+	frame_buffer_count = 0;
+	// The resampler is built for one channel count
+	resampler_quality = -1;
+}
+
+void SpeechCapturePipeline::configure(uint32_t p_input_sample_rate, uint32_t p_output_sample_rate, uint32_t p_max_input_frame_count, uint32_t p_max_frame_count) {
+	input_sample_rate = p_input_sample_rate;
+	output_sample_rate = p_output_sample_rate;
+	max_input_frame_count = p_max_input_frame_count;
+	max_frame_count = p_max_frame_count;
+	echo_canceller.configure(input_sample_rate);
+	speech_enhancer.configure(output_sample_rate);
+
+	mono_buffer.resize(max_input_frame_count);
+	// A partial frame plus one resampled block, with slack for rounding and the ratio scale
+	const uint64_t max_resampled_frame_count = uint64_t(max_input_frame_count) * output_sample_rate / input_sample_rate;
+	frame_buffer.resize((max_frame_count + size_t(max_resampled_frame_count * MAX_RATIO_SCALE) + 16) * MAX_CHANNEL_COUNT);
+
+	// Rebuild the resampler for the new rates on the next block
+	resampler_quality = -1;
+	reset();
+}
+
+void SpeechCapturePipeline::reset() {
+	frame_buffer_count = 0;
+	ratio_scale = 1.0;
+	resampling_equal_rates = false;
+	slip_debt = 0.0;
+	if (libresample_state) {
+		src_reset(libresample_state);
+	}
+	if (use_polyphase_resampler) {
+		polyphase_resampler.reset();
+	}
+	voice_activity_detector.request_reset();
+	speech_enhancer.request_reset();
+}
+
+void SpeechCapturePipeline::set_ratio_scale(double p_ratio_scale) {
+	if (p_ratio_scale < MIN_RATIO_SCALE) {
+		p_ratio_scale = MIN_RATIO_SCALE;
+	} else if (p_ratio_scale > MAX_RATIO_SCALE) {
+		p_ratio_scale = MAX_RATIO_SCALE;
+	}
+	ratio_scale = p_ratio_scale;
+}
+
+void SpeechCapturePipeline::set_frame_count(uint32_t p_frame_count) {
+	if (p_frame_count == 0 || (max_frame_count && p_frame_count > max_frame_count)) {
+		report_error("invalid frame count");
+		return;
+	}
+	pending_frame_count = p_frame_count;
+}
+
+void SpeechCapturePipeline::set_channel_count(uint32_t p_channel_count) {
+	if (p_channel_count < 1 || p_channel_count > MAX_CHANNEL_COUNT) {
+		report_error("invalid channel count");
+		return;
+	}
+	pending_channel_count = p_channel_count;
+}
+
+void SpeechCapturePipeline::set_resampler_quality(int p_quality) {
+	if (p_quality < RESAMPLER_SINC_BEST || p_quality > RESAMPLER_POLYPHASE) {
+		report_error("invalid resampler quality");
+		return;
+	}
+	pending_resampler_quality = p_quality;
+}
+
+SpeechCapturePipeline::SpeechCapturePipeline() :
+		pending_frame_count(0),
+		pending_channel_count(1),
+		pending_resampler_quality(RESAMPLER_SINC_FASTEST),
+		reset_pending(false) {
+}
+
+SpeechCapturePipeline::~SpeechCapturePipeline() {
+	if (libresample_state) {
+		libresample_state = src_delete(libresample_state);
+	}
+}
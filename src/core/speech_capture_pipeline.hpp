@@ -0,0 +1,279 @@
+#ifndef SPEECH_CAPTURE_PIPELINE_HPP
+#define SPEECH_CAPTURE_PIPELINE_HPP
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "samplerate.h"
+
+#include "audio_kernels.hpp"
+#include "echo_canceller.hpp"
+#include "polyphase_resampler.hpp"
+#include "speech_enhancer.hpp"
+#include "speech_stats.hpp"
+#include "voice_activity_detector.hpp"
+
+namespace godot {
+
+// Turns blocks of interleaved stereo capture audio into fixed-size int16
+// frames at the output rate: downmix when mono, optionally cancel echo,
+// resample, cut into frames, optionally enhance, convert and measure
+// loudness, then run the VAD.
+// Mono frames are downmixed before resampling, stereo frames keep both
+// channels interleaved.
+// Settings may be changed from any thread, configure, reset and process
+// must be called from the capture thread.
+class SpeechCapturePipeline {
+public:
+	enum ResamplerQuality {
+		RESAMPLER_SINC_BEST,
+		RESAMPLER_SINC_MEDIUM,
+		RESAMPLER_SINC_FASTEST,
+		RESAMPLER_LINEAR,
+		RESAMPLER_POLYPHASE,
+	};
+
+	// Limits of set_ratio_scale
+	static constexpr double MIN_RATIO_SCALE = 0.5;
+	static constexpr double MAX_RATIO_SCALE = 1.05;
+	// At equal rates, scales this close to 1 are applied by dropping or
+	// repeating single samples instead of resampling. It covers any clock
+	// drift the capture scheduler corrects.
+	static constexpr double MAX_SAMPLE_SLIP_DEVIATION = 0.0025;
+
+	// Capture blocks are stereo, so frames have at most as many channels
+	static const uint32_t MAX_CHANNEL_COUNT = 2;
+
+	struct Frame {
+		// frame_count frames of channel_count interleaved samples
+		const int16_t *pcm = NULL;
+		uint32_t frame_count = 0;
+		uint32_t channel_count = 1;
+		// Mean absolute sample value over every channel, 0 to 1
+		float loudness = 0.0f;
+		bool voice_active = false;
+	};
+
+private:
+	uint32_t input_sample_rate = 0;
+	uint32_t output_sample_rate = 0;
+	uint32_t max_input_frame_count = 0;
+	uint32_t max_frame_count = 0;
+
+	std::vector<float> mono_buffer;
+	// Resampled audio not yet cut into frames, frame_buffer_count frames
+	// of channel_count interleaved samples
+	std::vector<float> frame_buffer;
+	uint32_t frame_buffer_count = 0;
+
+	std::atomic<uint32_t> pending_frame_count;
+	uint32_t frame_count = 0;
+
+	std::atomic<uint32_t> pending_channel_count;
+	uint32_t channel_count = 1;
+
+	// LibResample
+	SRC_STATE *libresample_state = NULL;
+	int libresample_error = 0;
+
+	std::atomic<int> pending_resampler_quality;
+	int resampler_quality = -1;
+	PolyphaseResampler polyphase_resampler;
+	bool use_polyphase_resampler = false;
+
+	// Applied on top of the nominal ratio. Equal input and output rates are
+	// only resampled while it is further from 1 than MAX_SAMPLE_SLIP_DEVIATION.
+	double ratio_scale = 1.0;
+	// Whether the last equal-rate block went through the resampler, whose
+	// history is stale when it is needed again
+	bool resampling_equal_rates = false;
+	// Frames owed (above 0) or in excess (below 0) by the sample slips so far
+	double slip_debt = 0.0;
+	bool ratio_scale_applied = false;
+
+	std::atomic<bool> reset_pending;
+
+	// Position of the next block in the capture stream, for the echo canceller
+	int64_t stream_position = 0;
+
+	VoiceActivityDetector voice_activity_detector;
+	// Runs on mono blocks at the input rate, before the ratio scale touches them
+	EchoCanceller echo_canceller;
+	// Runs on each frame before it is converted, when any of its stages is enabled
+	SpeechEnhancer speech_enhancer;
+
+	SpeechStats *stats = NULL;
+
+	std::function<void(const std::string &)> error_handler;
+
+	void report_error(const std::string &p_message) {
+		if (error_handler) {
+			error_handler(p_message);
+		}
+	}
+
+	void setup_resampler(int p_quality);
+
+	// Runs the echo canceller on one mono input block in place
+	void cancel_echo(float *p_mono, uint32_t p_frame_count);
+
+	// Adds or removes whole frames at the end of the p_frame_count frames
+	// at p_frames to follow the ratio scale, returns the new frame count
+	uint32_t slip_frames(float *p_frames, uint32_t p_frame_count);
+
+	// Downmixes and resamples one input block onto the end of frame_buffer
+	void fill_frame_buffer(const float *p_stereo_input, uint32_t p_input_frame_count);
+
+	// Moves the frames after p_consumed_count to the start of frame_buffer
+	void keep_remainder(uint32_t p_consumed_count);
+
+	// Switches to pending_channel_count, dropping buffered audio and resampler history
+	void update_channel_count();
+
+public:
+	// Allocates every buffer, nothing is allocated by process afterwards
+	// except when the resampler quality changes
+	void configure(uint32_t p_input_sample_rate, uint32_t p_output_sample_rate, uint32_t p_max_input_frame_count, uint32_t p_max_frame_count);
+
+	// Drops buffered audio and resampler history
+	void reset();
+
+	// Resets from any thread, before the next block is processed
+	void request_reset() {
+		reset_pending = true;
+	}
+
+	// Receives messages for failures that cannot be returned, such as a resampler that could not be created
+	void set_error_handler(const std::function<void(const std::string &)> &p_error_handler) {
+		error_handler = p_error_handler;
+	}
+
+	// Downmix and resample times and captured frame counts are recorded here, NULL records nothing
+	void set_stats(SpeechStats *p_stats) {
+		stats = p_stats;
+	}
+
+	// Stretches (above 1) or compresses (below 1) the next blocks by varying
+	// the resample ratio, for drift correction and catching up on backlog.
+	// Equal rates slip single samples for small scales and only resample
+	// for larger ones. The polyphase resampler has a fixed ratio and ignores it.
+	void set_ratio_scale(double p_ratio_scale);
+	double get_ratio_scale() const {
+		return ratio_scale;
+	}
+
+	// Whether the last block was stretched by the ratio scale. False with
+	// the polyphase resampler, or when the block produced nothing.
+	bool is_ratio_scale_applied() const {
+		return ratio_scale_applied;
+	}
+
+	// Position of the next block in the capture stream, counted in input
+	// frames, dropped ones included, since the echo canceller was last
+	// reset. Advances by itself with each block.
+	void set_stream_position(int64_t p_position) {
+		stream_position = p_position;
+	}
+
+	// Appends interleaved stereo far-end audio for the echo canceller,
+	// frame n of which plays at the same time as frame n of the capture
+	void push_echo_reference(const float *p_stereo_input, uint32_t p_frame_count) {
+		echo_canceller.push_reference(p_stereo_input, p_frame_count);
+	}
+
+	// Frames per output frame, picked up at the next process call
+	void set_frame_count(uint32_t p_frame_count);
+	uint32_t get_frame_count() const {
+		return pending_frame_count;
+	}
+
+	// 1 for mono or 2 for stereo frames, picked up at the next process call
+	void set_channel_count(uint32_t p_channel_count);
+	uint32_t get_channel_count() const {
+		return pending_channel_count;
+	}
+
+	// One of ResamplerQuality, used when the input and output rates differ
+	void set_resampler_quality(int p_quality);
+	int get_resampler_quality() const {
+		return pending_resampler_quality;
+	}
+
+	uint32_t get_input_sample_rate() const {
+		return input_sample_rate;
+	}
+
+	VoiceActivityDetector &get_voice_activity_detector() {
+		return voice_activity_detector;
+	}
+
+	EchoCanceller &get_echo_canceller() {
+		return echo_canceller;
+	}
+
+	SpeechEnhancer &get_speech_enhancer() {
+		return speech_enhancer;
+	}
+
+	// Processes one block of interleaved stereo input. For every complete
+	// frame, the int16 samples are written to p_pcm_output, which must hold
+	// the largest frame count times MAX_CHANNEL_COUNT, and p_on_frame is
+	// called with a Frame pointing at them before the next frame overwrites them.
+	template <class F>
+	void process(const float *p_stereo_input, uint32_t p_input_frame_count, int16_t *p_pcm_output, F p_on_frame) {
+		if (reset_pending.exchange(false)) {
+			reset();
+		}
+		ratio_scale_applied = false;
+		frame_count = pending_frame_count;
+		if (frame_count == 0) {
+			return;
+		}
+		if (pending_channel_count != channel_count) {
+			update_channel_count();
+		}
+
+		fill_frame_buffer(p_stereo_input, p_input_frame_count);
+		stream_position += p_input_frame_count;
+
+		const AudioKernels &audio_kernels = get_audio_kernels();
+		float *frame_ptr = frame_buffer.data();
+		const uint32_t sample_count = frame_count * channel_count;
+		uint32_t offset = 0;
+		while (frame_buffer_count - offset >= frame_count) {
+			float *frame_samples = frame_ptr + offset * channel_count;
+			{
+				// Also called while disabled, so stages start clean when enabled again
+				SpeechStats::ScopedTimer enhance_timer(speech_enhancer.is_enabled() ? stats : NULL, SpeechStats::STAGE_ENHANCE);
+				speech_enhancer.process(frame_samples, frame_count, channel_count);
+			}
+			const float sum = audio_kernels.float_to_int16(frame_samples, p_pcm_output, sample_count);
+
+			Frame frame;
+			frame.pcm = p_pcm_output;
+			frame.frame_count = frame_count;
+			frame.channel_count = channel_count;
+			frame.loudness = sum / float(sample_count);
+			frame.voice_active = voice_activity_detector.process(frame.loudness, frame_count, output_sample_rate);
+			if (stats) {
+				stats->add(SpeechStats::COUNTER_CAPTURED_FRAMES);
+			}
+
+			p_on_frame(frame);
+
+			offset += frame_count;
+		}
+
+		keep_remainder(offset);
+	}
+
+	SpeechCapturePipeline();
+	~SpeechCapturePipeline();
+};
+
+}; // namespace godot
+
+#endif // SPEECH_CAPTURE_PIPELINE_HPP
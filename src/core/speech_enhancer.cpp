@@ -0,0 +1,236 @@
+#include "speech_enhancer.hpp"
+
+#include <math.h>
+#include <string.h>
+
+using namespace godot;
+
+// Weight of the previous power spectrum when smoothing it for the noise floor
+#define POWER_SMOOTHING 0.7f
+// Weight of the previous frame in the decision-directed SNR estimate
+#define DECISION_DIRECTED_ALPHA 0.96f
+// How fast the noise floor may rise while speech hides the minimum
+#define NOISE_RISE_DB_PER_SEC 3.0f
+// The minimum of the smoothed power sits below the mean noise power
+#define NOISE_OVERESTIMATE 2.0f
+#define MIN_NOISE_POWER 1e-12f
+
+float SpeechEnhancer::db_to_gain(float p_db) {
+	return powf(10.0f, p_db / 20.0f);
+}
+
+float SpeechEnhancer::gain_to_db(float p_gain) {
+	return p_gain > 1e-10f ? 20.0f * log10f(p_gain) : -200.0f;
+}
+
+void SpeechEnhancer::configure(uint32_t p_sample_rate) {
+	sample_rate = p_sample_rate > 0 ? p_sample_rate : 48000;
+
+	fft.configure(FFT_SIZE);
+	// Square root Hann, applied before and after the FFT its squares add up to one at half overlap
+	window.resize(FFT_SIZE);
+	for (uint32_t i = 0; i < FFT_SIZE; i++) {
+		window[i] = float(sqrt(0.5 - 0.5 * cos(2.0 * M_PI * double(i) / double(FFT_SIZE))));
+	}
+	input_history.resize(FFT_SIZE);
+	output_overlap.resize(FFT_SIZE);
+	output_hop.resize(HOP_SIZE);
+	block.resize(FFT_SIZE);
+	spectrum.resize(BIN_COUNT * 2);
+	smoothed_power.resize(BIN_COUNT);
+	noise_power.resize(BIN_COUNT);
+	previous_clean_power.resize(BIN_COUNT);
+
+	const float hop_sec = float(HOP_SIZE) / float(sample_rate);
+	noise_rise_factor = powf(10.0f, NOISE_RISE_DB_PER_SEC * hop_sec / 10.0f);
+	limiter_release_coefficient = 1.0f - expf(-1000.0f / (LIMITER_RELEASE_MSEC * float(sample_rate)));
+
+	reset_state();
+}
+
+void SpeechEnhancer::reset_noise_suppression() {
+	memset(input_history.data(), 0, input_history.size() * sizeof(float));
+	memset(output_overlap.data(), 0, output_overlap.size() * sizeof(float));
+	memset(output_hop.data(), 0, output_hop.size() * sizeof(float));
+	memset(smoothed_power.data(), 0, smoothed_power.size() * sizeof(float));
+	memset(noise_power.data(), 0, noise_power.size() * sizeof(float));
+	memset(previous_clean_power.data(), 0, previous_clean_power.size() * sizeof(float));
+	hop_fill = 0;
+	noise_estimate_valid = false;
+}
+
+void SpeechEnhancer::reset_state() {
+	reset_noise_suppression();
+	noise_suppression_active = false;
+	agc_gain_db = 0.0f;
+	agc_gain = 1.0f;
+	limiter_gain = 1.0f;
+}
+
+void SpeechEnhancer::process_hop() {
+	for (uint32_t i = 0; i < FFT_SIZE; i++) {
+		block[i] = input_history[i] * window[i];
+	}
+	fft.forward(block.data(), spectrum.data());
+
+	const float gain_floor = db_to_gain(-float(suppression_db));
+	for (uint32_t k = 0; k < BIN_COUNT; k++) {
+		const float re = spectrum[k * 2];
+		const float im = spectrum[k * 2 + 1];
+		const float power = re * re + im * im;
+
+		smoothed_power[k] = POWER_SMOOTHING * smoothed_power[k] + (1.0f - POWER_SMOOTHING) * power;
+		if (!noise_estimate_valid) {
+			noise_power[k] = power;
+		} else {
+			const float risen = noise_power[k] * noise_rise_factor;
+			noise_power[k] = smoothed_power[k] < risen ? smoothed_power[k] : risen;
+		}
+		if (noise_power[k] < MIN_NOISE_POWER) {
+			noise_power[k] = MIN_NOISE_POWER;
+		}
+
+		const float noise = noise_power[k] * NOISE_OVERESTIMATE;
+		const float posterior_snr = power / noise;
+		const float prior_snr = DECISION_DIRECTED_ALPHA * previous_clean_power[k] / noise +
+				(1.0f - DECISION_DIRECTED_ALPHA) * (posterior_snr > 1.0f ? posterior_snr - 1.0f : 0.0f);
+		float gain = prior_snr / (1.0f + prior_snr);
+		if (gain < gain_floor) {
+			gain = gain_floor;
+		}
+
+		previous_clean_power[k] = gain * gain * power;
+		spectrum[k * 2] = re * gain;
+		spectrum[k * 2 + 1] = im * gain;
+	}
+	noise_estimate_valid = true;
+
+	fft.inverse(spectrum.data(), block.data());
+	for (uint32_t i = 0; i < FFT_SIZE; i++) {
+		output_overlap[i] += block[i] * window[i];
+	}
+
+	// The first half now has both of its blocks
+	memcpy(output_hop.data(), output_overlap.data(), HOP_SIZE * sizeof(float));
+	memmove(output_overlap.data(), output_overlap.data() + HOP_SIZE, HOP_SIZE * sizeof(float));
+	memset(output_overlap.data() + HOP_SIZE, 0, HOP_SIZE * sizeof(float));
+	memmove(input_history.data(), input_history.data() + HOP_SIZE, HOP_SIZE * sizeof(float));
+}
+
+void SpeechEnhancer::suppress_noise(float *p_samples, uint32_t p_frame_count) {
+	float *hop_input = input_history.data() + HOP_SIZE;
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		hop_input[hop_fill] = p_samples[i];
+		p_samples[i] = output_hop[hop_fill];
+		hop_fill++;
+		if (hop_fill == HOP_SIZE) {
+			process_hop();
+			hop_fill = 0;
+		}
+	}
+}
+
+void SpeechEnhancer::apply_agc(float *p_samples, uint32_t p_frame_count, uint32_t p_channel_count) {
+	const uint32_t sample_count = p_frame_count * p_channel_count;
+	float sum = 0.0f;
+	for (uint32_t i = 0; i < sample_count; i++) {
+		sum += p_samples[i] * p_samples[i];
+	}
+	const float level_db = gain_to_db(sqrtf(sum / float(sample_count)));
+
+	const float max_gain_db = agc_max_gain_db;
+	if (level_db > AGC_GATE_DBFS) {
+		const float frame_sec = float(p_frame_count) / float(sample_rate);
+		const float desired_db = agc_target_dbfs - level_db;
+		if (desired_db > agc_gain_db) {
+			const float limit_db = agc_gain_db + AGC_INCREASE_DB_PER_SEC * frame_sec;
+			agc_gain_db = desired_db < limit_db ? desired_db : limit_db;
+		} else {
+			const float limit_db = agc_gain_db - AGC_DECREASE_DB_PER_SEC * frame_sec;
+			agc_gain_db = desired_db > limit_db ? desired_db : limit_db;
+		}
+	}
+	if (agc_gain_db > max_gain_db) {
+		agc_gain_db = max_gain_db;
+	} else if (agc_gain_db < AGC_MIN_GAIN_DB) {
+		agc_gain_db = AGC_MIN_GAIN_DB;
+	}
+
+	// Ramp to the new gain across the frame
+	const float target_gain = db_to_gain(agc_gain_db);
+	const float step = (target_gain - agc_gain) / float(p_frame_count);
+	float gain = agc_gain;
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		gain += step;
+		for (uint32_t channel = 0; channel < p_channel_count; channel++) {
+			p_samples[i * p_channel_count + channel] *= gain;
+		}
+	}
+	agc_gain = target_gain;
+}
+
+void SpeechEnhancer::apply_limiter(float *p_samples, uint32_t p_frame_count, uint32_t p_channel_count) {
+	const float ceiling = db_to_gain(limiter_ceiling_dbfs);
+	float gain = limiter_gain;
+	for (uint32_t i = 0; i < p_frame_count; i++) {
+		float *frame = p_samples + i * p_channel_count;
+		float peak = 0.0f;
+		for (uint32_t channel = 0; channel < p_channel_count; channel++) {
+			const float value = fabsf(frame[channel]);
+			peak = value > peak ? value : peak;
+		}
+
+		gain += (1.0f - gain) * limiter_release_coefficient;
+		if (peak * gain > ceiling) {
+			gain = ceiling / peak;
+		}
+		for (uint32_t channel = 0; channel < p_channel_count; channel++) {
+			frame[channel] *= gain;
+		}
+	}
+	limiter_gain = gain;
+}
+
+void SpeechEnhancer::process(float *p_samples, uint32_t p_frame_count, uint32_t p_channel_count) {
+	if (reset_pending.exchange(false)) {
+		reset_state();
+	}
+	if (p_frame_count == 0 || p_channel_count == 0) {
+		return;
+	}
+
+	if (noise_suppression_enabled && p_channel_count == 1) {
+		if (!noise_suppression_active) {
+			reset_noise_suppression();
+			noise_suppression_active = true;
+		}
+		suppress_noise(p_samples, p_frame_count);
+	} else {
+		noise_suppression_active = false;
+	}
+
+	if (agc_enabled) {
+		apply_agc(p_samples, p_frame_count, p_channel_count);
+	} else {
+		agc_gain_db = 0.0f;
+		agc_gain = 1.0f;
+	}
+
+	if (limiter_enabled) {
+		apply_limiter(p_samples, p_frame_count, p_channel_count);
+	} else {
+		limiter_gain = 1.0f;
+	}
+}
+
+SpeechEnhancer::SpeechEnhancer() :
+		noise_suppression_enabled(false),
+		suppression_db(DEFAULT_SUPPRESSION_DB),
+		agc_enabled(false),
+		agc_target_dbfs(DEFAULT_AGC_TARGET_DBFS),
+		agc_max_gain_db(DEFAULT_AGC_MAX_GAIN_DB),
+		limiter_enabled(false),
+		limiter_ceiling_dbfs(DEFAULT_LIMITER_CEILING_DBFS),
+		reset_pending(false) {
+	configure(sample_rate);
+}
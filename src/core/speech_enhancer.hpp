@@ -0,0 +1,176 @@
+#ifndef SPEECH_ENHANCER_HPP
+#define SPEECH_ENHANCER_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "real_fft.hpp"
+
+namespace godot {
+
+// Optional clean-up of captured frames before they are converted to int16:
+// spectral noise suppression, automatic gain control and a peak limiter,
+// each enabled on its own.
+//
+// Noise suppression works on overlapping FFT_SIZE blocks with a hop of
+// HOP_SIZE samples. A per-bin noise floor follows the minimum of the
+// smoothed power spectrum and rises slowly, and each bin is scaled by a
+// Wiener gain from a decision-directed SNR estimate, no lower than the
+// suppression floor. A sample is only complete once the block after it is
+// processed, so the audio is delayed by FFT_SIZE samples, about 11 ms at
+// 48 kHz. It only runs on mono frames.
+// AGC moves a frame gain towards the target level while the frame is above
+// the gate, faster down than up, and ramps it across the frame. The
+// limiter holds peaks to its ceiling with instant attack and a short
+// release. Stereo frames get one gain for both channels.
+//
+// The work per sample does not depend on the signal, so the cost of a frame
+// only depends on its length; speech_benchmark reports it. configure sizes
+// everything, process never allocates.
+// The settings may be changed from any thread, everything else must be
+// called from the thread processing the audio.
+class SpeechEnhancer {
+public:
+	static const uint32_t FFT_SIZE = 512;
+	static const uint32_t HOP_SIZE = FFT_SIZE / 2;
+	static const uint32_t BIN_COUNT = FFT_SIZE / 2 + 1;
+
+	static constexpr float DEFAULT_SUPPRESSION_DB = 15.0f;
+	static constexpr float DEFAULT_AGC_TARGET_DBFS = -18.0f;
+	static constexpr float DEFAULT_AGC_MAX_GAIN_DB = 20.0f;
+	static constexpr float DEFAULT_LIMITER_CEILING_DBFS = -1.0f;
+
+	// AGC leaves frames below this level alone, so pauses are not pumped up
+	static constexpr float AGC_GATE_DBFS = -50.0f;
+	static constexpr float AGC_MIN_GAIN_DB = -20.0f;
+	static constexpr float AGC_INCREASE_DB_PER_SEC = 6.0f;
+	static constexpr float AGC_DECREASE_DB_PER_SEC = 40.0f;
+	static constexpr float LIMITER_RELEASE_MSEC = 50.0f;
+
+private:
+	std::atomic<bool> noise_suppression_enabled;
+	std::atomic<float> suppression_db;
+	std::atomic<bool> agc_enabled;
+	std::atomic<float> agc_target_dbfs;
+	std::atomic<float> agc_max_gain_db;
+	std::atomic<bool> limiter_enabled;
+	std::atomic<float> limiter_ceiling_dbfs;
+	std::atomic<bool> reset_pending;
+
+	uint32_t sample_rate = 48000;
+
+	// Noise suppression
+	RealFft fft;
+	std::vector<float> window;
+	// The last FFT_SIZE input samples, the newest hop being filled
+	std::vector<float> input_history;
+	// Windowed output waiting to be overlapped with the next block
+	std::vector<float> output_overlap;
+	// The hop handed out while the next one is filled
+	std::vector<float> output_hop;
+	std::vector<float> block;
+	std::vector<float> spectrum;
+	std::vector<float> smoothed_power;
+	std::vector<float> noise_power;
+	std::vector<float> previous_clean_power;
+	uint32_t hop_fill = 0;
+	bool noise_estimate_valid = false;
+	// Whether the suppressor ran on the previous frame, it starts clean when turned on
+	bool noise_suppression_active = false;
+	float noise_rise_factor = 1.0f;
+
+	// AGC and limiter
+	float agc_gain_db = 0.0f;
+	float agc_gain = 1.0f;
+	float limiter_gain = 1.0f;
+	float limiter_release_coefficient = 1.0f;
+
+	void reset_noise_suppression();
+	void reset_state();
+
+	void process_hop();
+	void suppress_noise(float *p_samples, uint32_t p_frame_count);
+	void apply_agc(float *p_samples, uint32_t p_frame_count, uint32_t p_channel_count);
+	void apply_limiter(float *p_samples, uint32_t p_frame_count, uint32_t p_channel_count);
+
+public:
+	static float db_to_gain(float p_db);
+	static float gain_to_db(float p_gain);
+
+	// Sizes the buffers for audio at p_sample_rate and resets the state
+	void configure(uint32_t p_sample_rate);
+
+	void set_noise_suppression_enabled(bool p_enabled) {
+		noise_suppression_enabled = p_enabled;
+	}
+	bool is_noise_suppression_enabled() const {
+		return noise_suppression_enabled;
+	}
+
+	// How far noise-only bins are turned down at most, 0 to 60 dB
+	void set_suppression_db(float p_db) {
+		suppression_db = p_db < 0.0f ? 0.0f : (p_db > 60.0f ? 60.0f : p_db);
+	}
+	float get_suppression_db() const {
+		return suppression_db;
+	}
+
+	void set_agc_enabled(bool p_enabled) {
+		agc_enabled = p_enabled;
+	}
+	bool is_agc_enabled() const {
+		return agc_enabled;
+	}
+
+	// RMS level the AGC aims for
+	void set_agc_target_dbfs(float p_dbfs) {
+		agc_target_dbfs = p_dbfs > 0.0f ? 0.0f : p_dbfs;
+	}
+	float get_agc_target_dbfs() const {
+		return agc_target_dbfs;
+	}
+
+	void set_agc_max_gain_db(float p_db) {
+		agc_max_gain_db = p_db < 0.0f ? 0.0f : p_db;
+	}
+	float get_agc_max_gain_db() const {
+		return agc_max_gain_db;
+	}
+
+	void set_limiter_enabled(bool p_enabled) {
+		limiter_enabled = p_enabled;
+	}
+	bool is_limiter_enabled() const {
+		return limiter_enabled;
+	}
+
+	void set_limiter_ceiling_dbfs(float p_dbfs) {
+		limiter_ceiling_dbfs = p_dbfs > 0.0f ? 0.0f : p_dbfs;
+	}
+	float get_limiter_ceiling_dbfs() const {
+		return limiter_ceiling_dbfs;
+	}
+
+	bool is_enabled() const {
+		return noise_suppression_enabled || agc_enabled || limiter_enabled;
+	}
+
+	// Forgets the noise estimate and gains before the next frame is processed
+	void request_reset() {
+		reset_pending = true;
+	}
+
+	// Processes p_frame_count frames of p_channel_count interleaved samples in place
+	void process(float *p_samples, uint32_t p_frame_count, uint32_t p_channel_count);
+
+	float get_agc_gain_db() const {
+		return agc_gain_db;
+	}
+
+	SpeechEnhancer();
+};
+
+}; // namespace godot
+
+#endif // SPEECH_ENHANCER_HPP
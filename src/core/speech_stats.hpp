@@ -0,0 +1,188 @@
+#ifndef SPEECH_STATS_HPP
+#define SPEECH_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace godot {
+
+// Cumulative counters and per-stage timings for the voice pipeline.
+// Every field is a relaxed atomic, so any thread may record while another
+// takes a snapshot. A snapshot is not one consistent instant, but each
+// value in it is.
+class SpeechStats {
+public:
+	enum Stage {
+		// Fetching capture blocks from StreamAudio
+		STAGE_CAPTURE_DRAIN,
+		STAGE_DOWNMIX,
+		// Echo cancellation against the output bus, on mono capture before resampling
+		STAGE_ECHO_CANCEL,
+		STAGE_RESAMPLE,
+		// Noise suppression, AGC and limiter
+		STAGE_ENHANCE,
+		STAGE_ENCODE,
+		// Pushing finished packets to the outgoing queue
+		STAGE_QUEUE,
+		STAGE_DECODE,
+		STAGE_COUNT,
+	};
+
+	enum Counter {
+		COUNTER_CAPTURED_BLOCKS,
+		COUNTER_CAPTURED_FRAMES,
+		// Frames the VAD held back from the encoder
+		COUNTER_GATED_FRAMES,
+		// Capture blocks the scheduler dropped as stale backlog
+		COUNTER_CAPTURE_BLOCKS_DROPPED,
+		COUNTER_ENCODE_FAILURES,
+		COUNTER_BYTES_ENCODED,
+		COUNTER_PACKETS_OUT,
+		// Outgoing packets lost because the queue was full
+		COUNTER_PACKETS_DROPPED,
+		COUNTER_PACKETS_IN,
+		COUNTER_DECODE_FAILURES,
+		COUNTER_COUNT,
+	};
+
+	// Kept in nanoseconds, the cheapest stages take well under a microsecond
+	struct StageSnapshot {
+		uint64_t count = 0;
+		uint64_t total_nsec = 0;
+		uint64_t max_nsec = 0;
+	};
+
+	struct Snapshot {
+		StageSnapshot stages[STAGE_COUNT];
+		uint64_t counters[COUNTER_COUNT] = {};
+		// Capture blocks still queued after the last drain, and the most seen
+		uint32_t capture_backlog = 0;
+		uint32_t max_capture_backlog = 0;
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	// Records the time from construction to destruction against one stage
+	class ScopedTimer {
+		SpeechStats *stats;
+		Stage stage;
+		Clock::time_point start;
+
+	public:
+		ScopedTimer(SpeechStats *p_stats, Stage p_stage) :
+				stats(p_stats),
+				stage(p_stage),
+				start(p_stats ? Clock::now() : Clock::time_point()) {
+		}
+
+		~ScopedTimer() {
+			if (stats) {
+				stats->record(stage, start);
+			}
+		}
+	};
+
+private:
+	struct StageTiming {
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> total_nsec;
+		std::atomic<uint64_t> max_nsec;
+	};
+
+	StageTiming stages[STAGE_COUNT];
+	std::atomic<uint64_t> counters[COUNTER_COUNT];
+	std::atomic<uint32_t> capture_backlog;
+	std::atomic<uint32_t> max_capture_backlog;
+
+	template <class T>
+	static void store_max(std::atomic<T> &r_max, T p_value) {
+		T current = r_max.load(std::memory_order_relaxed);
+		while (p_value > current && !r_max.compare_exchange_weak(current, p_value, std::memory_order_relaxed)) {
+		}
+	}
+
+public:
+	void record(Stage p_stage, Clock::time_point p_start) {
+		const uint64_t nsec = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - p_start).count());
+		StageTiming &timing = stages[p_stage];
+		timing.count.fetch_add(1, std::memory_order_relaxed);
+		timing.total_nsec.fetch_add(nsec, std::memory_order_relaxed);
+		store_max(timing.max_nsec, nsec);
+	}
+
+	void add(Counter p_counter, uint64_t p_amount = 1) {
+		counters[p_counter].fetch_add(p_amount, std::memory_order_relaxed);
+	}
+
+	void set_capture_backlog(uint32_t p_block_count) {
+		capture_backlog.store(p_block_count, std::memory_order_relaxed);
+		store_max(max_capture_backlog, p_block_count);
+	}
+
+	Snapshot snapshot() const {
+		Snapshot result;
+		for (int i = 0; i < STAGE_COUNT; i++) {
+			result.stages[i].count = stages[i].count.load(std::memory_order_relaxed);
+			result.stages[i].total_nsec = stages[i].total_nsec.load(std::memory_order_relaxed);
+			result.stages[i].max_nsec = stages[i].max_nsec.load(std::memory_order_relaxed);
+		}
+		for (int i = 0; i < COUNTER_COUNT; i++) {
+			result.counters[i] = counters[i].load(std::memory_order_relaxed);
+		}
+		result.capture_backlog = capture_backlog.load(std::memory_order_relaxed);
+		result.max_capture_backlog = max_capture_backlog.load(std::memory_order_relaxed);
+		return result;
+	}
+
+	void reset() {
+		for (int i = 0; i < STAGE_COUNT; i++) {
+			stages[i].count.store(0, std::memory_order_relaxed);
+			stages[i].total_nsec.store(0, std::memory_order_relaxed);
+			stages[i].max_nsec.store(0, std::memory_order_relaxed);
+		}
+		for (int i = 0; i < COUNTER_COUNT; i++) {
+			counters[i].store(0, std::memory_order_relaxed);
+		}
+		capture_backlog.store(0, std::memory_order_relaxed);
+		max_capture_backlog.store(0, std::memory_order_relaxed);
+	}
+
+	static const char *get_stage_name(int p_stage) {
+		static const char *names[STAGE_COUNT] = {
+			"capture_drain",
+			"downmix",
+			"echo_cancel",
+			"resample",
+			"enhance",
+			"encode",
+			"queue",
+			"decode",
+		};
+		return p_stage >= 0 && p_stage < STAGE_COUNT ? names[p_stage] : "";
+	}
+
+	static const char *get_counter_name(int p_counter) {
+		static const char *names[COUNTER_COUNT] = {
+			"captured_blocks",
+			"captured_frames",
+			"gated_frames",
+			"capture_blocks_dropped",
+			"encode_failures",
+			"bytes_encoded",
+			"packets_out",
+			"packets_dropped",
+			"packets_in",
+			"decode_failures",
+		};
+		return p_counter >= 0 && p_counter < COUNTER_COUNT ? names[p_counter] : "";
+	}
+
+	SpeechStats() {
+		reset();
+	}
+};
+
+}; // namespace godot
+
+#endif // SPEECH_STATS_HPP
@@ -0,0 +1,141 @@
+#ifndef VOICE_ACTIVITY_DETECTOR_HPP
+#define VOICE_ACTIVITY_DETECTOR_HPP
+
+#include <atomic>
+#include <math.h>
+#include <stdint.h>
+
+namespace godot {
+
+// Energy based voice activity gate, run once per captured frame.
+// The frame loudness is smoothed by an envelope follower with separate
+// attack and release times; the gate opens as soon as the envelope
+// reaches the threshold and closes once it has stayed below it for the
+// hangover time. While open, the encoder's own DTX decision can also
+// count as silence so the gate closes on noise Opus would not send.
+// The settings may be changed from any thread, everything else must be
+// called from the thread processing the audio.
+class VoiceActivityDetector {
+public:
+	static constexpr float DEFAULT_THRESHOLD = 0.01f; // About -40 dBFS
+	static constexpr float DEFAULT_ATTACK_MSEC = 5.0f;
+	static constexpr float DEFAULT_RELEASE_MSEC = 50.0f;
+	static constexpr float DEFAULT_HANGOVER_MSEC = 200.0f;
+
+private:
+	std::atomic<float> threshold;
+	std::atomic<float> attack_msec;
+	std::atomic<float> release_msec;
+	std::atomic<float> hangover_msec;
+	std::atomic<bool> use_encoder_dtx;
+	std::atomic<bool> reset_pending;
+
+	float envelope = 0.0f;
+	float hangover_remaining_msec = 0.0f;
+	bool active = false;
+	bool encoder_in_dtx = false;
+
+	static float smoothing_coefficient(float p_frame_msec, float p_time_msec) {
+		if (p_time_msec <= 0.0f) {
+			return 1.0f;
+		}
+		return 1.0f - expf(-p_frame_msec / p_time_msec);
+	}
+
+public:
+	// Mean absolute sample value, 0 to 1
+	void set_threshold(float p_threshold) {
+		threshold = p_threshold < 0.0f ? 0.0f : p_threshold;
+	}
+	float get_threshold() const {
+		return threshold;
+	}
+
+	void set_attack_msec(float p_msec) {
+		attack_msec = p_msec < 0.0f ? 0.0f : p_msec;
+	}
+	float get_attack_msec() const {
+		return attack_msec;
+	}
+
+	void set_release_msec(float p_msec) {
+		release_msec = p_msec < 0.0f ? 0.0f : p_msec;
+	}
+	float get_release_msec() const {
+		return release_msec;
+	}
+
+	void set_hangover_msec(float p_msec) {
+		hangover_msec = p_msec < 0.0f ? 0.0f : p_msec;
+	}
+	float get_hangover_msec() const {
+		return hangover_msec;
+	}
+
+	// Only has an effect when the encoder reports its DTX state
+	void set_use_encoder_dtx(bool p_enabled) {
+		use_encoder_dtx = p_enabled;
+	}
+	bool is_using_encoder_dtx() const {
+		return use_encoder_dtx;
+	}
+
+	// Closes the gate before the next frame is processed
+	void request_reset() {
+		reset_pending = true;
+	}
+
+	// Whether the encoder treated the last frame it was given as silence
+	void set_encoder_in_dtx(bool p_in_dtx) {
+		encoder_in_dtx = p_in_dtx;
+	}
+
+	// Returns whether the frame should be sent
+	bool process(float p_loudness, uint32_t p_frame_count, uint32_t p_sample_rate) {
+		if (reset_pending.exchange(false)) {
+			envelope = 0.0f;
+			hangover_remaining_msec = 0.0f;
+			active = false;
+			encoder_in_dtx = false;
+		}
+
+		const float frame_msec = float(p_frame_count) * 1000.0f / float(p_sample_rate);
+		const float time_msec = p_loudness > envelope ? attack_msec : release_msec;
+		envelope += (p_loudness - envelope) * smoothing_coefficient(frame_msec, time_msec);
+
+		bool speech = envelope >= threshold;
+		// The encoder only analyses frames while the gate is open
+		if (active && use_encoder_dtx && encoder_in_dtx) {
+			speech = false;
+		}
+
+		if (speech) {
+			active = true;
+			hangover_remaining_msec = hangover_msec;
+		} else if (active) {
+			hangover_remaining_msec -= frame_msec;
+			if (hangover_remaining_msec <= 0.0f) {
+				active = false;
+				encoder_in_dtx = false;
+			}
+		}
+
+		return active;
+	}
+
+	bool is_active() const {
+		return active;
+	}
+
+	VoiceActivityDetector() :
+			threshold(DEFAULT_THRESHOLD),
+			attack_msec(DEFAULT_ATTACK_MSEC),
+			release_msec(DEFAULT_RELEASE_MSEC),
+			hangover_msec(DEFAULT_HANGOVER_MSEC),
+			use_encoder_dtx(false),
+			reset_pending(false) {}
+};
+
+}; // namespace godot
+
+#endif // VOICE_ACTIVITY_DETECTOR_HPP
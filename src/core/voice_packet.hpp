@@ -0,0 +1,304 @@
+#ifndef VOICE_PACKET_HPP
+#define VOICE_PACKET_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace godot {
+
+// Compact, versioned wire format for voice packets:
+//
+//   u8      version << 4 | flags
+//   varint  sequence of the first frame
+//   varint  timestamp of the first frame
+//   u8      loudness, square-root companded so quiet speech keeps its resolution
+//   u8      frame count, at least 1
+//   varint  frame duration in samples, only with more than one frame
+//   per frame: varint size, then that many bytes of Opus packet
+//
+// Varints are unsigned LEB128. Frame i of a packet has the sequence + i and
+// the timestamp + i * duration, so only consecutive frames share a packet.
+// Packets are self-delimiting and may be concatenated into one buffer.
+class VoicePacket {
+public:
+	static const uint8_t VERSION = 1;
+
+	enum Flags {
+		// The sender's encoder considered the frames silence
+		FLAG_DTX = 1 << 0,
+		// The frames carry inband FEC for the frame before them
+		FLAG_FEC = 1 << 1,
+		FLAG_MASK = 0x0f,
+	};
+
+	static const int MAX_FRAME_COUNT = 255;
+	static const int MAX_VARINT_SIZE = 5;
+	static const int MAX_HEADER_SIZE = 1 + MAX_VARINT_SIZE + MAX_VARINT_SIZE + 1 + 1 + MAX_VARINT_SIZE;
+
+	// Bytes a packet of one frame of p_frame_size bytes takes at most
+	static int get_max_packet_size(int p_frame_size) {
+		return MAX_HEADER_SIZE + MAX_VARINT_SIZE + p_frame_size;
+	}
+
+	static uint8_t quantize_loudness(float p_loudness) {
+		if (!(p_loudness > 0.0f)) {
+			return 0;
+		}
+		if (p_loudness >= 1.0f) {
+			return 255;
+		}
+		return uint8_t(lrintf(sqrtf(p_loudness) * 255.0f));
+	}
+
+	static float dequantize_loudness(uint8_t p_quantized) {
+		const float root = float(p_quantized) / 255.0f;
+		return root * root;
+	}
+
+	// Returns the bytes written, at most MAX_VARINT_SIZE
+	static int write_varint(uint32_t p_value, uint8_t *p_output) {
+		int size = 0;
+		while (p_value >= 0x80) {
+			p_output[size++] = uint8_t(p_value | 0x80);
+			p_value >>= 7;
+		}
+		p_output[size++] = uint8_t(p_value);
+		return size;
+	}
+
+	static int get_varint_size(uint32_t p_value) {
+		int size = 1;
+		while (p_value >= 0x80) {
+			p_value >>= 7;
+			size++;
+		}
+		return size;
+	}
+
+	// Advances r_ptr past the varint, false if it runs past p_end or is too long
+	static bool read_varint(const uint8_t *&r_ptr, const uint8_t *p_end, uint32_t *r_value) {
+		uint32_t value = 0;
+		for (int i = 0; i < MAX_VARINT_SIZE; i++) {
+			if (r_ptr >= p_end) {
+				return false;
+			}
+			const uint8_t byte = *r_ptr++;
+			value |= uint32_t(byte & 0x7f) << (7 * i);
+			if (!(byte & 0x80)) {
+				*r_value = value;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Builds one packet at a time into caller-owned memory. Frames are
+// written straight to their final place, the header is filled in by
+// finish, which moves the frames down once to close the gap left for it.
+class VoicePacketWriter {
+	struct State {
+		int size = 0;
+		int frame_count = 0;
+		uint32_t sequence = 0;
+		uint32_t timestamp = 0;
+		uint32_t frame_duration = 0;
+		float loudness = 0.0f;
+		uint8_t flags = 0;
+	};
+
+	uint8_t *output = NULL;
+	int capacity = 0;
+	State state;
+	// Before the last add_frame call, for drop_last_frame
+	State previous_state;
+
+public:
+	// Starts a packet at p_output, which must hold p_capacity bytes
+	void begin(uint8_t *p_output, int p_capacity) {
+		output = p_output;
+		capacity = p_capacity;
+		state = State();
+		state.size = VoicePacket::MAX_HEADER_SIZE;
+		previous_state = state;
+	}
+
+	// Returns false if the frame does not fit, or is not the next
+	// sequence at the frame duration of the ones already added, in which
+	// case the caller should finish the packet and start another.
+	// The packet loudness is the loudest frame's, a flag is only set if every frame has it.
+	bool add_frame(const uint8_t *p_data, int p_size, uint32_t p_sequence, uint32_t p_timestamp, float p_loudness, uint8_t p_flags) {
+		previous_state = state;
+		if (!output || p_size < 0 || state.frame_count >= VoicePacket::MAX_FRAME_COUNT) {
+			return false;
+		}
+		if (state.size + VoicePacket::get_varint_size(uint32_t(p_size)) + p_size > capacity) {
+			return false;
+		}
+
+		State next_state = state;
+		if (state.frame_count == 0) {
+			next_state.sequence = p_sequence;
+			next_state.timestamp = p_timestamp;
+			next_state.loudness = p_loudness;
+			next_state.flags = p_flags & VoicePacket::FLAG_MASK;
+		} else {
+			if (p_sequence != state.sequence + uint32_t(state.frame_count)) {
+				return false;
+			}
+			const uint32_t duration = p_timestamp - state.timestamp;
+			if (state.frame_count == 1) {
+				next_state.frame_duration = duration;
+			} else if (duration != state.frame_duration * uint32_t(state.frame_count)) {
+				return false;
+			}
+			if (p_loudness > next_state.loudness) {
+				next_state.loudness = p_loudness;
+			}
+			next_state.flags &= p_flags;
+		}
+
+		next_state.size += VoicePacket::write_varint(uint32_t(p_size), output + next_state.size);
+		memcpy(output + next_state.size, p_data, p_size);
+		next_state.size += p_size;
+		next_state.frame_count++;
+
+		state = next_state;
+		return true;
+	}
+
+	// Takes back the frame added by the last successful add_frame,
+	// e.g. when its source was overwritten while it was being copied
+	void drop_last_frame() {
+		state = previous_state;
+	}
+
+	int get_frame_count() const {
+		return state.frame_count;
+	}
+
+	// Writes the header and returns the packet size, 0 without frames.
+	// The writer must be begun again before adding more frames.
+	int finish() {
+		if (!output || state.frame_count == 0) {
+			output = NULL;
+			return 0;
+		}
+
+		uint8_t header[VoicePacket::MAX_HEADER_SIZE];
+		int header_size = 0;
+		header[header_size++] = uint8_t((VoicePacket::VERSION << 4) | state.flags);
+		header_size += VoicePacket::write_varint(state.sequence, header + header_size);
+		header_size += VoicePacket::write_varint(state.timestamp, header + header_size);
+		header[header_size++] = VoicePacket::quantize_loudness(state.loudness);
+		header[header_size++] = uint8_t(state.frame_count);
+		if (state.frame_count > 1) {
+			header_size += VoicePacket::write_varint(state.frame_duration, header + header_size);
+		}
+
+		const int frames_size = state.size - VoicePacket::MAX_HEADER_SIZE;
+		memmove(output + header_size, output + VoicePacket::MAX_HEADER_SIZE, frames_size);
+		memcpy(output, header, header_size);
+
+		output = NULL;
+		return header_size + frames_size;
+	}
+};
+
+// Walks every frame of a buffer of concatenated packets in place. Frames
+// point into the buffer, which must stay alive and unchanged meanwhile.
+class VoicePacketReader {
+public:
+	struct Frame {
+		const uint8_t *data = NULL;
+		int size = 0;
+		uint32_t sequence = 0;
+		uint32_t timestamp = 0;
+		float loudness = 0.0f;
+		uint8_t flags = 0;
+	};
+
+private:
+	const uint8_t *ptr = NULL;
+	const uint8_t *end = NULL;
+	bool error = false;
+
+	// The packet being read
+	int remaining_frame_count = 0;
+	uint32_t frame_duration = 0;
+	Frame next;
+
+	bool fail() {
+		error = true;
+		ptr = end;
+		remaining_frame_count = 0;
+		return false;
+	}
+
+	bool read_header() {
+		const uint8_t version_flags = *ptr++;
+		if ((version_flags >> 4) != VoicePacket::VERSION) {
+			return fail();
+		}
+		next.flags = version_flags & VoicePacket::FLAG_MASK;
+
+		if (!VoicePacket::read_varint(ptr, end, &next.sequence) ||
+				!VoicePacket::read_varint(ptr, end, &next.timestamp)) {
+			return fail();
+		}
+		if (end - ptr < 2) {
+			return fail();
+		}
+		next.loudness = VoicePacket::dequantize_loudness(*ptr++);
+		remaining_frame_count = *ptr++;
+		if (remaining_frame_count == 0) {
+			return fail();
+		}
+
+		frame_duration = 0;
+		if (remaining_frame_count > 1 && !VoicePacket::read_varint(ptr, end, &frame_duration)) {
+			return fail();
+		}
+		return true;
+	}
+
+public:
+	// Returns false at the end of the buffer or at the first malformed
+	// packet, after which has_error is true and nothing more is read
+	bool next_frame(Frame *r_frame) {
+		if (remaining_frame_count == 0) {
+			if (ptr >= end || !read_header()) {
+				return false;
+			}
+		}
+
+		uint32_t size = 0;
+		if (!VoicePacket::read_varint(ptr, end, &size) || size > uint32_t(end - ptr)) {
+			return fail();
+		}
+
+		next.data = ptr;
+		next.size = int(size);
+		*r_frame = next;
+
+		ptr += size;
+		remaining_frame_count--;
+		next.sequence++;
+		next.timestamp += frame_duration;
+		return true;
+	}
+
+	bool has_error() const {
+		return error;
+	}
+
+	VoicePacketReader(const uint8_t *p_data, int p_size) :
+			ptr(p_data),
+			end(p_data + (p_size > 0 ? p_size : 0)) {
+	}
+};
+
+}; // namespace godot
+
+#endif // VOICE_PACKET_HPP
@@ -0,0 +1,125 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace godot {
+
+// Small fork-join pool for splitting one batch across threads.
+// run calls the task once per worker, with worker 0 on the calling
+// thread, and returns when every worker has finished. Nothing is
+// allocated per run, so it is safe to call every tick.
+// set_thread_count and run must be called from the same thread.
+class WorkerPool {
+public:
+	typedef void (*Task)(void *p_userdata, uint32_t p_worker_index, uint32_t p_worker_count);
+
+private:
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	// Bumped for every run so sleeping workers can tell a new batch from a spurious wake
+	uint64_t generation = 0;
+	uint32_t pending_count = 0;
+	bool exiting = false;
+
+	Task task = NULL;
+	void *task_userdata = NULL;
+
+	void worker_func(uint32_t p_worker_index) {
+		uint64_t seen_generation = 0;
+		while (true) {
+			Task current_task = NULL;
+			void *current_userdata = NULL;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_condition.wait(lock, [&] { return exiting || generation != seen_generation; });
+				if (exiting) {
+					return;
+				}
+				seen_generation = generation;
+				current_task = task;
+				current_userdata = task_userdata;
+			}
+
+			current_task(current_userdata, p_worker_index, get_worker_count());
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending_count == 0) {
+				done_condition.notify_one();
+			}
+		}
+	}
+
+	void stop_threads() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			exiting = true;
+		}
+		start_condition.notify_all();
+		for (size_t i = 0; i < threads.size(); i++) {
+			threads[i].join();
+		}
+		threads.clear();
+		exiting = false;
+	}
+
+public:
+	// Threads besides the caller, 0 runs everything on the calling thread
+	void set_thread_count(uint32_t p_thread_count) {
+		if (p_thread_count == threads.size()) {
+			return;
+		}
+		stop_threads();
+		generation = 0;
+		threads.reserve(p_thread_count);
+		for (uint32_t i = 0; i < p_thread_count; i++) {
+			threads.push_back(std::thread(&WorkerPool::worker_func, this, i + 1));
+		}
+	}
+
+	uint32_t get_thread_count() const {
+		return uint32_t(threads.size());
+	}
+
+	uint32_t get_worker_count() const {
+		return uint32_t(threads.size()) + 1;
+	}
+
+	void run(Task p_task, void *p_userdata) {
+		if (threads.empty()) {
+			p_task(p_userdata, 0, 1);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = p_task;
+			task_userdata = p_userdata;
+			pending_count = uint32_t(threads.size());
+			generation++;
+		}
+		start_condition.notify_all();
+
+		p_task(p_userdata, 0, get_worker_count());
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, [&] { return pending_count == 0; });
+	}
+
+	WorkerPool() {}
+	~WorkerPool() {
+		stop_threads();
+	}
+};
+
+}; // namespace godot
+
+#endif // WORKER_POOL_HPP
@@ -8,46 +8,79 @@
 #include <Engine.hpp>
 #include <AudioServer.hpp>
 #include <ProjectSettings.hpp>
-#include <Mutex.hpp>
 
-#include "mutex_lock.hpp"
+#include <atomic>
+#include <vector>
+
+#include "core/packet_ring_buffer.hpp"
+#include "core/voice_packet.hpp"
 #include "speech_processor.hpp"
+#include "voice_mixer.hpp"
+#include "voice_relay.hpp"
 
 namespace godot {
 
 class GodotSpeech : public Node {
 	GODOT_CLASS(GodotSpeech, Node)
 	
-	static const int MAX_AUDIO_BUFFER_ARRAY_SIZE = 10;
-	
-	PoolByteArray input_byte_array;
-	float volume = 0.0;
+	static const int DEFAULT_INPUT_PACKET_CAPACITY = 10;
+	static const int PACKED_LENGTH_PREFIX_SIZE = sizeof(uint16_t);
 
-	Ref<Mutex> audio_mutex;
+	float volume = 0.0;
 
-	int skipped_audio_packets = 0;
+	std::atomic<int> skipped_audio_packets;
 
-	Node *voice_controller = NULL; // TODO: rewrite this in C++
+	Node *voice_controller = NULL; // Legacy script-side mixer, superseded by voice_mixer
 	SpeechProcessor *speech_processor = NULL;
-
-	struct InputPacket {
-		PoolByteArray compressed_byte_array;
-		int buffer_size = 0;
-		float loudness = 0.0;
-	};
-
-	int current_input_size = 0;
-	PoolByteArray compression_output_byte_array;
-	InputPacket input_audio_buffer_array[MAX_AUDIO_BUFFER_ARRAY_SIZE];
+	Ref<VoiceMixer> voice_mixer;
+	Ref<VoiceRelay> voice_relay;
+
+	// Filled by whichever thread runs speech_processed, drained by copy_and_clear_buffers
+	PacketRingBuffer input_packet_ring_buffer;
+
+	// Owned by whichever thread runs speech_processed.
+	// The sequence counts queued packets, the timestamp counts captured frames.
+	uint32_t input_sequence = 0;
+	uint32_t input_timestamp = 0;
+
+	// Frames waiting to be joined into one packet, also owned by the speech_processed thread
+	OpusFramePacker frame_packer;
+	uint8_t packed_frame_output[SpeechProcessor::MAX_PACKET_SIZE];
+	uint32_t packed_frame_timestamp = 0;
+	float packed_frame_loudness = 0.0;
+	// VoicePacket flags every packed frame had
+	uint8_t packed_frame_flags = 0;
+
+	// Reusable outputs of copy_and_clear_buffers_packed, sized to the ring capacity
+	PoolByteArray packed_byte_array;
+	PoolIntArray packed_size_array;
+	PoolRealArray packed_loudness_array;
+	PoolIntArray packed_sequence_array;
+	PoolIntArray packed_timestamp_array;
+	int packed_packet_count = 0;
+	int packed_byte_count = 0;
+
+	// Staging for copy_and_clear_buffers_wire, sized to the ring capacity
+	std::vector<uint8_t> wire_buffer;
 	//
 private:
 	// Assigns the memory to the fixed audio buffer arrays
 	void preallocate_buffers() {
-		input_byte_array.resize(SpeechProcessor::PCM_BUFFER_SIZE);
-		compression_output_byte_array.resize(SpeechProcessor::PCM_BUFFER_SIZE);
-		for (int i = 0; i < MAX_AUDIO_BUFFER_ARRAY_SIZE; i++) {
-			input_audio_buffer_array[i].compressed_byte_array.resize(SpeechProcessor::PCM_BUFFER_SIZE);
-		}
+		input_packet_ring_buffer.resize(DEFAULT_INPUT_PACKET_CAPACITY, SpeechProcessor::MAX_PACKET_SIZE);
+		preallocate_packed_buffers();
+	}
+
+	// Sizes the packed outputs so a full ring always fits without reallocating
+	void preallocate_packed_buffers() {
+		const int capacity = input_packet_ring_buffer.capacity();
+		packed_byte_array.resize(capacity * (PACKED_LENGTH_PREFIX_SIZE + SpeechProcessor::MAX_PACKET_SIZE));
+		packed_size_array.resize(capacity);
+		packed_loudness_array.resize(capacity);
+		packed_sequence_array.resize(capacity);
+		packed_timestamp_array.resize(capacity);
+		packed_packet_count = 0;
+		packed_byte_count = 0;
+		wire_buffer.resize(capacity * VoicePacket::get_max_packet_size(SpeechProcessor::MAX_PACKET_SIZE));
 	}
 
 	// Assigns a callback from the speech_processor to this object.
@@ -58,59 +91,94 @@ private:
 					std::bind(&GodotSpeech::speech_processed, this, std::placeholders::_1)
 				)
 			);
+
+			// Re-emit the talk signals from this node
+			speech_processor->connect("talk_started", this, "emit_signal", Array::make("talk_started"));
+			speech_processor->connect("talk_stopped", this, "emit_signal", Array::make("talk_stopped"));
 		}
 	}
 
-	// Returns a pointer to the first valid input packet
-	// If the current_input_size has exceeded MAX_AUDIO_BUFFER_ARRAY_SIZE,
-	// The front packet will be popped from the queue back recursively
-	// copying from the back.
-	InputPacket *get_next_valid_input_packet() {
-		if(current_input_size < MAX_AUDIO_BUFFER_ARRAY_SIZE) {
-			InputPacket *input_packet = &input_audio_buffer_array[current_input_size];
-			current_input_size++;
-			return input_packet;
-		} else {
-			for(int i = MAX_AUDIO_BUFFER_ARRAY_SIZE-1; i > 0; i--) {
-				memcpy(input_audio_buffer_array[i-1].compressed_byte_array.write().ptr(), 
-				input_audio_buffer_array[i].compressed_byte_array.read().ptr(),
-				SpeechProcessor::PCM_BUFFER_SIZE);
-
-				input_audio_buffer_array[i-1].buffer_size = input_audio_buffer_array[i].buffer_size;
-				input_audio_buffer_array[i-1].loudness = input_audio_buffer_array[i].loudness;
-			}
+	// Pushes a finished packet to the ring, dropping the oldest one if the consumer has fallen behind
+	void queue_packet(const uint8_t *p_data, const PacketRingBuffer::PacketInfo &p_packet_info) {
+		SpeechStats &stats = speech_processor->get_stats_internal();
+		SpeechStats::ScopedTimer queue_timer(&stats, SpeechStats::STAGE_QUEUE);
+		stats.add(SpeechStats::COUNTER_PACKETS_OUT);
+		if (!input_packet_ring_buffer.push(p_data, p_packet_info)) {
 			skipped_audio_packets++;
-			return &input_audio_buffer_array[MAX_AUDIO_BUFFER_ARRAY_SIZE-1];
+			stats.add(SpeechStats::COUNTER_PACKETS_DROPPED);
+		}
+	}
+
+	// Sends the frames gathered so far in frame_packer as one packet
+	void flush_packed_frames() {
+		if (frame_packer.get_frame_count() == 0) {
+			return;
+		}
+
+		PacketRingBuffer::PacketInfo packet_info;
+		packet_info.loudness = packed_frame_loudness / frame_packer.get_frame_count();
+		packet_info.sequence = input_sequence++;
+		packet_info.timestamp = packed_frame_timestamp;
+		packet_info.flags = packed_frame_flags;
+		packet_info.size = frame_packer.flush(packed_frame_output, SpeechProcessor::MAX_PACKET_SIZE);
+		packed_frame_loudness = 0.0;
+
+		if (packet_info.size > 0) {
+			queue_packet(packed_frame_output, packet_info);
 		}
 	}
 
 	// Is responsible for recieving packets from the SpeechProcessor and then compressing them
 	void speech_processed(SpeechProcessor::SpeechInput *p_mic_input) {
-		// Copy the raw PCM data from the SpeechInput packet to the input byte array
-		PoolByteArray *mic_input_byte_array = p_mic_input->pcm_byte_array;
-		memcpy(input_byte_array.write().ptr(), mic_input_byte_array->read().ptr(), SpeechProcessor::PCM_BUFFER_SIZE);
+		const uint32_t frame_timestamp = input_timestamp;
+		input_timestamp += p_mic_input->frame_count;
+
+		// Gated by the VAD, send whatever is already packed and skip encoding.
+		// The timestamp still advances so receivers see the silence gap.
+		if (!p_mic_input->voice_active) {
+			flush_packed_frames();
+			return;
+		}
 
-		// Create a new SpeechProcessor::CompressedBufferInput to be passed into the compressor
-		// and assign it the compressed_byte_array from the input packet
-		SpeechProcessor::CompressedSpeechBuffer compressed_buffer_input;
-		compressed_buffer_input.compressed_byte_array = &compression_output_byte_array;
+		// Encoded straight from the capture scratch space, no PoolVector is touched per packet
+		const uint8_t *frame_data = NULL;
+		uint8_t frame_flags = 0;
+		const int frame_size = speech_processor->encode_frame_internal(p_mic_input->pcm, p_mic_input->frame_count, p_mic_input->channel_count, &frame_data, &frame_flags);
+		if (frame_size < 0) {
+			return;
+		}
 
-		// Compress the packet
-		speech_processor->compress_buffer_internal(&input_byte_array, &compressed_buffer_input);
-		{
-			// Lock
-			MutexLock mutex_lock(audio_mutex.ptr());
+		const int frames_per_packet = speech_processor->get_frames_per_packet();
+		if (frames_per_packet <= 1 && frame_packer.get_frame_count() == 0) {
+			PacketRingBuffer::PacketInfo packet_info;
+			packet_info.size = frame_size;
+			packet_info.loudness = p_mic_input->volume;
+			packet_info.sequence = input_sequence++;
+			packet_info.timestamp = frame_timestamp;
+			packet_info.flags = frame_flags;
+
+			queue_packet(frame_data, packet_info);
+			return;
+		}
 
-			// Find the next valid input packet in the queue
-			InputPacket *input_packet = get_next_valid_input_packet();
-			// Copy the buffer size from the compressed_buffer_input back into the input packet
-			memcpy(
-				input_packet->compressed_byte_array.write().ptr(),
-				compressed_buffer_input.compressed_byte_array->read().ptr(),
-				SpeechProcessor::PCM_BUFFER_SIZE);
+		// Join frames with the repacketizer until a packet is full
+		if (frame_packer.get_frame_count() == 0) {
+			packed_frame_timestamp = frame_timestamp;
+			packed_frame_flags = frame_flags;
+		}
+		if (!frame_packer.add_frame(frame_data, frame_size)) {
+			flush_packed_frames();
+			packed_frame_timestamp = frame_timestamp;
+			packed_frame_flags = frame_flags;
+			if (!frame_packer.add_frame(frame_data, frame_size)) {
+				return;
+			}
+		}
+		packed_frame_loudness += p_mic_input->volume;
+		packed_frame_flags &= frame_flags;
 
-			input_packet->buffer_size = compressed_buffer_input.buffer_size;
-			input_packet->loudness = p_mic_input->volume;
+		if (frame_packer.get_frame_count() >= frames_per_packet) {
+			flush_packed_frames();
 		}
 	}
 public:
@@ -123,10 +191,30 @@ public:
 		register_method("clear_skipped_audio_packets", &GodotSpeech::clear_skipped_audio_packets);
 
 		register_method("decompress_buffer", &GodotSpeech::decompress_buffer);
+		register_method("decompress_buffers", &GodotSpeech::decompress_buffers);
+		register_method("set_decode_thread_count", &GodotSpeech::set_decode_thread_count);
+		register_method("get_decode_thread_count", &GodotSpeech::get_decode_thread_count);
 
 		register_method("copy_and_clear_buffers", &GodotSpeech::copy_and_clear_buffers);
+		register_method("copy_and_clear_buffers_packed", &GodotSpeech::copy_and_clear_buffers_packed);
+		register_method("get_packed_byte_array", &GodotSpeech::get_packed_byte_array);
+		register_method("copy_and_clear_buffers_wire", &GodotSpeech::copy_and_clear_buffers_wire);
+		register_method("parse_wire_packets", &GodotSpeech::parse_wire_packets);
+		register_method("get_packed_size_array", &GodotSpeech::get_packed_size_array);
+		register_method("get_packed_loudness_array", &GodotSpeech::get_packed_loudness_array);
+		register_method("get_packed_sequence_array", &GodotSpeech::get_packed_sequence_array);
+		register_method("get_packed_timestamp_array", &GodotSpeech::get_packed_timestamp_array);
+		register_method("get_packed_byte_count", &GodotSpeech::get_packed_byte_count);
+		register_method("set_input_packet_capacity", &GodotSpeech::set_input_packet_capacity);
+		register_method("get_input_packet_capacity", &GodotSpeech::get_input_packet_capacity);
 
 		register_method("get_speech_decoder", &GodotSpeech::get_speech_decoder);
+		register_method("set_decoder_pool_capacity", &GodotSpeech::set_decoder_pool_capacity);
+		register_method("get_decoder_pool_capacity", &GodotSpeech::get_decoder_pool_capacity);
+		register_method("get_decoder_pool_stats", &GodotSpeech::get_decoder_pool_stats);
+
+		register_method("get_stats", &GodotSpeech::get_stats);
+		register_method("reset_stats", &GodotSpeech::reset_stats);
 
 		register_method("start_recording", &GodotSpeech::start_recording);
 		register_method("end_recording", &GodotSpeech::end_recording);
@@ -134,8 +222,43 @@ public:
 		register_method("set_streaming_bus", &GodotSpeech::set_streaming_bus);
 		register_method("set_audio_input_stream_player", &GodotSpeech::set_audio_input_stream_player);
 
+		register_method("set_encoder_settings", &GodotSpeech::set_encoder_settings);
+		register_method("get_encoder_settings", &GodotSpeech::get_encoder_settings);
+		register_method("get_encoder_final_range", &GodotSpeech::get_encoder_final_range);
+		register_method("get_encoder_lookahead", &GodotSpeech::get_encoder_lookahead);
+
+		register_method("set_frame_duration_msec", &GodotSpeech::set_frame_duration_msec);
+		register_method("get_frame_duration_msec", &GodotSpeech::get_frame_duration_msec);
+		register_method("set_frames_per_packet", &GodotSpeech::set_frames_per_packet);
+		register_method("get_frames_per_packet", &GodotSpeech::get_frames_per_packet);
+
+		register_method("set_use_capture_thread", &GodotSpeech::set_use_capture_thread);
+		register_method("is_using_capture_thread", &GodotSpeech::is_using_capture_thread);
+
+		register_method("set_channel_count", &GodotSpeech::set_channel_count);
+		register_method("get_channel_count", &GodotSpeech::get_channel_count);
+
+		register_method("set_resampler_quality", &GodotSpeech::set_resampler_quality);
+		register_method("get_resampler_quality", &GodotSpeech::get_resampler_quality);
+
+		register_method("set_vad_settings", &GodotSpeech::set_vad_settings);
+		register_method("get_vad_settings", &GodotSpeech::get_vad_settings);
+		register_method("is_talking", &GodotSpeech::is_talking);
+
+		register_method("set_capture_settings", &GodotSpeech::set_capture_settings);
+		register_method("get_capture_settings", &GodotSpeech::get_capture_settings);
+
+		register_method("set_enhancement_settings", &GodotSpeech::set_enhancement_settings);
+		register_method("get_enhancement_settings", &GodotSpeech::get_enhancement_settings);
+		register_method("set_echo_cancellation_settings", &GodotSpeech::set_echo_cancellation_settings);
+		register_method("get_echo_cancellation_settings", &GodotSpeech::get_echo_cancellation_settings);
+
+		register_signal<GodotSpeech>("talk_started", Dictionary());
+		register_signal<GodotSpeech>("talk_stopped", Dictionary());
 
 		register_method("assign_voice_controller", &GodotSpeech::assign_voice_controller);
+		register_method("get_voice_mixer", &GodotSpeech::get_voice_mixer);
+		register_method("get_voice_relay", &GodotSpeech::get_voice_relay);
 	}
 
 	int get_skipped_audio_packets() {
@@ -152,36 +275,293 @@ public:
 			return PoolVector2Array();
 		}
 
-		if (speech_processor->decompress_buffer_internal(p_speech_decoder.ptr(), &p_read_byte_array, p_read_size, &p_write_vec2_array)) {
+		if (speech_processor && speech_processor->decompress_buffer_internal(p_speech_decoder.ptr(), &p_read_byte_array, p_read_size, &p_write_vec2_array)) {
 			return p_write_vec2_array;
 		}
 
 		return PoolVector2Array();
 	}
 
+	// Batched decode, see SpeechProcessor::decompress_buffers
+	virtual Dictionary decompress_buffers(Array p_speech_decoders, PoolByteArray p_packet_byte_array, PoolIntArray p_packet_offsets, PoolIntArray p_packet_sizes, Dictionary p_output_buffer) {
+		if(!speech_processor) {
+			return p_output_buffer;
+		}
+		return speech_processor->decompress_buffers(p_speech_decoders, p_packet_byte_array, p_packet_offsets, p_packet_sizes, p_output_buffer);
+	}
+
+	void set_decode_thread_count(int p_thread_count) {
+		if(speech_processor) {
+			speech_processor->set_decode_thread_count(p_thread_count);
+		}
+	}
+
+	int get_decode_thread_count() {
+		if(speech_processor) {
+			return speech_processor->get_decode_thread_count();
+		}
+		return 0;
+	}
+
+	void set_decoder_pool_capacity(int p_capacity) {
+		if(speech_processor) {
+			speech_processor->set_decoder_pool_capacity(p_capacity);
+		}
+	}
+
+	int get_decoder_pool_capacity() {
+		if(speech_processor) {
+			return speech_processor->get_decoder_pool_capacity();
+		}
+		return 0;
+	}
+
+	Dictionary get_decoder_pool_stats() {
+		if(speech_processor) {
+			return speech_processor->get_decoder_pool_stats();
+		}
+		return Dictionary();
+	}
+
+	// Pipeline counters and stage timings, see SpeechProcessor::get_stats
+	Dictionary get_stats() {
+		if(speech_processor) {
+			return speech_processor->get_stats();
+		}
+		return Dictionary();
+	}
+
+	void reset_stats() {
+		if(speech_processor) {
+			speech_processor->reset_stats();
+		}
+	}
+
 
 	// Copys all the input buffers to the output buffers
 	// Returns the amount of buffers
 	Array copy_and_clear_buffers() {
-		MutexLock mutex_lock(audio_mutex.ptr());
-		
 		Array output_array;
-		output_array.resize(current_input_size);
 
-		for (int i = 0; i < current_input_size; i++) {
-			Dictionary dict;
+		PacketRingBuffer::PacketInfo packet_info;
+		const uint8_t *packet_data = input_packet_ring_buffer.front(&packet_info);
+		while (packet_data) {
+			PoolByteArray byte_array;
+			byte_array.resize(packet_info.size);
+			memcpy(byte_array.write().ptr(), packet_data, packet_info.size);
 
-			dict["byte_array"] = input_audio_buffer_array[i].compressed_byte_array;
-			dict["buffer_size"] = input_audio_buffer_array[i].buffer_size;
-			dict["loudness"] = input_audio_buffer_array[i].loudness;
+			// The capture thread may have dropped this packet while it was being copied
+			if (input_packet_ring_buffer.commit_pop()) {
+				Dictionary dict;
 
-			output_array[i] = dict;
+				dict["byte_array"] = byte_array;
+				dict["buffer_size"] = packet_info.size;
+				dict["loudness"] = packet_info.loudness;
+				dict["sequence"] = int64_t(packet_info.sequence);
+				dict["timestamp"] = int64_t(packet_info.timestamp);
+
+				output_array.append(dict);
+			}
+
+			packet_data = input_packet_ring_buffer.front(&packet_info);
 		}
-		current_input_size = 0;
 
 		return output_array;
 	}
 
+	// Copies all pending packets into the reusable packed arrays in one pass.
+	// The byte array holds each packet as a little-endian uint16 length
+	// followed by its compressed bytes; the size, loudness, sequence and
+	// timestamp arrays hold one entry per packet. Only the first get_packed_byte_count() bytes
+	// and the first <return value> entries are valid.
+	// Returns the amount of packets
+	int copy_and_clear_buffers_packed() {
+		packed_packet_count = 0;
+		packed_byte_count = 0;
+
+		uint8_t *byte_write_ptr = packed_byte_array.write().ptr();
+		int *size_write_ptr = packed_size_array.write().ptr();
+		real_t *loudness_write_ptr = packed_loudness_array.write().ptr();
+		int *sequence_write_ptr = packed_sequence_array.write().ptr();
+		int *timestamp_write_ptr = packed_timestamp_array.write().ptr();
+		const int max_packet_count = packed_size_array.size();
+
+		PacketRingBuffer::PacketInfo packet_info;
+		const uint8_t *packet_data = NULL;
+		while (packed_packet_count < max_packet_count &&
+				(packet_data = input_packet_ring_buffer.front(&packet_info))) {
+			uint8_t *packet_ptr = byte_write_ptr + packed_byte_count;
+			packet_ptr[0] = packet_info.size & 0xff;
+			packet_ptr[1] = (packet_info.size >> 8) & 0xff;
+			memcpy(packet_ptr + PACKED_LENGTH_PREFIX_SIZE, packet_data, packet_info.size);
+
+			// The capture thread may have dropped this packet while it was being copied
+			if (input_packet_ring_buffer.commit_pop()) {
+				size_write_ptr[packed_packet_count] = packet_info.size;
+				loudness_write_ptr[packed_packet_count] = packet_info.loudness;
+				// Pool int arrays are 32-bit, the counters wrap into them unchanged
+				sequence_write_ptr[packed_packet_count] = static_cast<int>(packet_info.sequence);
+				timestamp_write_ptr[packed_packet_count] = static_cast<int>(packet_info.timestamp);
+				packed_byte_count += PACKED_LENGTH_PREFIX_SIZE + packet_info.size;
+				packed_packet_count++;
+			}
+		}
+
+		return packed_packet_count;
+	}
+
+	// Drains all pending packets into one buffer in the VoicePacket wire
+	// format, ready to send as is. Up to p_max_bundle_frames consecutive
+	// packets share a header; gaps from the VAD or dropped packets start a
+	// new one. Allocates only the returned array.
+	PoolByteArray copy_and_clear_buffers_wire(int p_max_bundle_frames) {
+		if (p_max_bundle_frames < 1) {
+			p_max_bundle_frames = 1;
+		}
+
+		uint8_t *wire_ptr = wire_buffer.data();
+		const int wire_capacity = int(wire_buffer.size());
+		int wire_size = 0;
+
+		VoicePacketWriter writer;
+		writer.begin(wire_ptr, wire_capacity);
+
+		PacketRingBuffer::PacketInfo packet_info;
+		const uint8_t *packet_data = NULL;
+		while ((packet_data = input_packet_ring_buffer.front(&packet_info))) {
+			const bool added = writer.get_frame_count() < p_max_bundle_frames &&
+					writer.add_frame(packet_data, packet_info.size, packet_info.sequence, packet_info.timestamp, packet_info.loudness, packet_info.flags);
+			if (!added) {
+				wire_size += writer.finish();
+				writer.begin(wire_ptr + wire_size, wire_capacity - wire_size);
+				if (!writer.add_frame(packet_data, packet_info.size, packet_info.sequence, packet_info.timestamp, packet_info.loudness, packet_info.flags)) {
+					break;
+				}
+			}
+
+			// The capture thread may have dropped this packet while it was being copied
+			if (!input_packet_ring_buffer.commit_pop()) {
+				writer.drop_last_frame();
+			}
+		}
+		wire_size += writer.finish();
+
+		PoolByteArray wire_byte_array;
+		wire_byte_array.resize(wire_size);
+		if (wire_size > 0) {
+			memcpy(wire_byte_array.write().ptr(), wire_ptr, wire_size);
+		}
+		return wire_byte_array;
+	}
+
+	// Reads every frame of a buffer from copy_and_clear_buffers_wire in
+	// place. Returns a Dictionary of equally long arrays, one entry per
+	// frame: offsets and sizes locate its Opus bytes inside p_wire_byte_array,
+	// which can be handed to decompress_buffers without copying, plus
+	// sequence, timestamp, loudness and flags. Stops at the first
+	// malformed packet and sets error to true.
+	Dictionary parse_wire_packets(PoolByteArray p_wire_byte_array) {
+		PoolByteArray::Read read = p_wire_byte_array.read();
+		const uint8_t *wire_ptr = read.ptr();
+		VoicePacketReader::Frame frame;
+
+		// Counted first so every array is sized once
+		int frame_count = 0;
+		VoicePacketReader counter(wire_ptr, p_wire_byte_array.size());
+		while (counter.next_frame(&frame)) {
+			frame_count++;
+		}
+
+		PoolIntArray offsets;
+		PoolIntArray sizes;
+		PoolIntArray sequences;
+		PoolIntArray timestamps;
+		PoolRealArray loudness;
+		PoolIntArray flags;
+		offsets.resize(frame_count);
+		sizes.resize(frame_count);
+		sequences.resize(frame_count);
+		timestamps.resize(frame_count);
+		loudness.resize(frame_count);
+		flags.resize(frame_count);
+
+		{
+			int *offset_write_ptr = offsets.write().ptr();
+			int *size_write_ptr = sizes.write().ptr();
+			int *sequence_write_ptr = sequences.write().ptr();
+			int *timestamp_write_ptr = timestamps.write().ptr();
+			real_t *loudness_write_ptr = loudness.write().ptr();
+			int *flags_write_ptr = flags.write().ptr();
+
+			VoicePacketReader reader(wire_ptr, p_wire_byte_array.size());
+			for (int i = 0; i < frame_count && reader.next_frame(&frame); i++) {
+				offset_write_ptr[i] = int(frame.data - wire_ptr);
+				size_write_ptr[i] = frame.size;
+				// Pool int arrays are 32-bit, the counters wrap into them unchanged
+				sequence_write_ptr[i] = static_cast<int>(frame.sequence);
+				timestamp_write_ptr[i] = static_cast<int>(frame.timestamp);
+				loudness_write_ptr[i] = frame.loudness;
+				flags_write_ptr[i] = frame.flags;
+			}
+		}
+
+		Dictionary result;
+		result["offsets"] = offsets;
+		result["sizes"] = sizes;
+		result["sequence"] = sequences;
+		result["timestamp"] = timestamps;
+		result["loudness"] = loudness;
+		result["flags"] = flags;
+		result["error"] = counter.has_error();
+		return result;
+	}
+
+	// The packed arrays are reused on every call, release them before
+	// the next call to avoid a copy-on-write.
+	PoolByteArray get_packed_byte_array() {
+		return packed_byte_array;
+	}
+
+	PoolIntArray get_packed_size_array() {
+		return packed_size_array;
+	}
+
+	PoolRealArray get_packed_loudness_array() {
+		return packed_loudness_array;
+	}
+
+	PoolIntArray get_packed_sequence_array() {
+		return packed_sequence_array;
+	}
+
+	PoolIntArray get_packed_timestamp_array() {
+		return packed_timestamp_array;
+	}
+
+	int get_packed_byte_count() {
+		return packed_byte_count;
+	}
+
+	// Sets how many packets are kept before the oldest ones are dropped.
+	// Discards any packets currently queued.
+	void set_input_packet_capacity(int p_capacity) {
+		if (p_capacity < 1) {
+			Godot::print_error("GodotSpeech: input packet capacity must be at least 1!", __FUNCTION__, __FILE__, __LINE__);
+			return;
+		}
+
+		// The ring can only be reallocated while the capture thread is stopped
+		bool use_capture_thread = is_using_capture_thread();
+		set_use_capture_thread(false);
+		input_packet_ring_buffer.resize(p_capacity, SpeechProcessor::MAX_PACKET_SIZE);
+		preallocate_packed_buffers();
+		set_use_capture_thread(use_capture_thread);
+	}
+
+	int get_input_packet_capacity() {
+		return input_packet_ring_buffer.capacity();
+	}
+
 	Ref<SpeechDecoder> get_speech_decoder() {
 		if(speech_processor) {
 			return speech_processor->get_speech_decoder();
@@ -190,6 +570,15 @@ public:
 		}
 	}
 
+	// The relay mixes in mono whatever the local capture layout
+	Ref<SpeechDecoder> get_mono_speech_decoder() {
+		if(speech_processor) {
+			return speech_processor->get_speech_decoder_internal(1);
+		} else {
+			return NULL;
+		}
+	}
+
 	bool start_recording() {
 		if (speech_processor) {
 			speech_processor->start();
@@ -204,6 +593,9 @@ public:
 		if (speech_processor) {
 			speech_processor->stop();
 		}
+		if(voice_mixer.is_valid()) {
+			voice_mixer->clear_all_player_audio();
+		}
 		if(voice_controller) {
 			if(voice_controller->has_method("clear_all_player_audio")) {
 				voice_controller->call("clear_all_player_audio");
@@ -211,16 +603,44 @@ public:
 		}
 	}
 
-	// TODO: replace this with a C++ class, must be assigned externally for now
+	// Kept for projects still mixing in script, new code should use get_voice_mixer
 	void assign_voice_controller(Node *p_voice_controller) {
 		voice_controller = p_voice_controller;
 	}
 
+	// Returns the native mixer for remote peers, creating decoders on demand.
+	// Once this node has left the tree no new peers can be added.
+	Ref<VoiceMixer> get_voice_mixer() {
+		if(voice_mixer.is_null()) {
+			voice_mixer.instance();
+			voice_mixer->register_speech_decoder_factory(
+				std::function<Ref<SpeechDecoder>()>(
+					std::bind(&GodotSpeech::get_speech_decoder, this)
+				)
+			);
+		}
+		return voice_mixer;
+	}
+
+	// Returns the server-side relay, creating decoders on demand when it mixes.
+	// Once this node has left the tree, peers without a decoder yet are
+	// forwarded but no longer mixed.
+	Ref<VoiceRelay> get_voice_relay() {
+		if(voice_relay.is_null()) {
+			voice_relay.instance();
+			voice_relay->register_speech_decoder_factory(
+				std::function<Ref<SpeechDecoder>()>(
+					std::bind(&GodotSpeech::get_mono_speech_decoder, this)
+				)
+			);
+		}
+		return voice_relay;
+	}
+
 	void _init() {
 		if (!Engine::get_singleton()->is_editor_hint()) {
 			preallocate_buffers();
 			speech_processor = SpeechProcessor::_new();
-			audio_mutex.instance();
 		}
 	}
 
@@ -228,7 +648,9 @@ public:
 		if (!Engine::get_singleton()->is_editor_hint()) {
 			setup_connections();
 
-			add_child(speech_processor);
+			if(speech_processor) {
+				add_child(speech_processor);
+			}
 		}
 	}
 
@@ -236,7 +658,11 @@ public:
 		if (!Engine::get_singleton()->is_editor_hint()) {
 			switch(p_what) {
 				case NOTIFICATION_EXIT_TREE:
-					speech_processor->queue_free();
+					// A mixer or relay kept by script may still ask for decoders
+					if(speech_processor) {
+						speech_processor->queue_free();
+						speech_processor = NULL;
+					}
 					break;
 				default:
 					break;
@@ -257,9 +683,296 @@ public:
 		}
 	}
 
+	// Applies any of bitrate, vbr, vbr_constraint, complexity, dtx, inband_fec,
+	// packet_loss_percentage, signal_type and max_bandwidth present in p_settings
+	void set_encoder_settings(Dictionary p_settings) {
+		if(!speech_processor) {
+			return;
+		}
+		if(p_settings.has("bitrate")) {
+			speech_processor->set_bitrate(p_settings["bitrate"]);
+		}
+		if(p_settings.has("vbr")) {
+			speech_processor->set_vbr(p_settings["vbr"]);
+		}
+		if(p_settings.has("vbr_constraint")) {
+			speech_processor->set_vbr_constraint(p_settings["vbr_constraint"]);
+		}
+		if(p_settings.has("complexity")) {
+			speech_processor->set_complexity(p_settings["complexity"]);
+		}
+		if(p_settings.has("dtx")) {
+			speech_processor->set_dtx(p_settings["dtx"]);
+		}
+		if(p_settings.has("inband_fec")) {
+			speech_processor->set_inband_fec(p_settings["inband_fec"]);
+		}
+		if(p_settings.has("packet_loss_percentage")) {
+			speech_processor->set_packet_loss_percentage(p_settings["packet_loss_percentage"]);
+		}
+		if(p_settings.has("signal_type")) {
+			speech_processor->set_signal_type(p_settings["signal_type"]);
+		}
+		if(p_settings.has("max_bandwidth")) {
+			speech_processor->set_max_bandwidth(p_settings["max_bandwidth"]);
+		}
+	}
+
+	Dictionary get_encoder_settings() {
+		Dictionary settings;
+		if(speech_processor) {
+			settings["bitrate"] = speech_processor->get_bitrate();
+			settings["vbr"] = speech_processor->get_vbr();
+			settings["vbr_constraint"] = speech_processor->get_vbr_constraint();
+			settings["complexity"] = speech_processor->get_complexity();
+			settings["dtx"] = speech_processor->get_dtx();
+			settings["inband_fec"] = speech_processor->get_inband_fec();
+			settings["packet_loss_percentage"] = speech_processor->get_packet_loss_percentage();
+			settings["signal_type"] = speech_processor->get_signal_type();
+			settings["max_bandwidth"] = speech_processor->get_max_bandwidth();
+		}
+		return settings;
+	}
+
+	int64_t get_encoder_final_range() {
+		if(speech_processor) {
+			return speech_processor->get_encoder_final_range();
+		}
+		return 0;
+	}
+
+	int get_encoder_lookahead() {
+		if(speech_processor) {
+			return speech_processor->get_encoder_lookahead();
+		}
+		return 0;
+	}
 
-	GodotSpeech() {};
+	void set_frame_duration_msec(float p_msec) {
+		if(speech_processor) {
+			speech_processor->set_frame_duration_msec(p_msec);
+		}
+	}
+
+	float get_frame_duration_msec() {
+		if(speech_processor) {
+			return speech_processor->get_frame_duration_msec();
+		}
+		return 0.0;
+	}
+
+	void set_frames_per_packet(int p_frames_per_packet) {
+		if(speech_processor) {
+			speech_processor->set_frames_per_packet(p_frames_per_packet);
+		}
+	}
+
+	int get_frames_per_packet() {
+		if(speech_processor) {
+			return speech_processor->get_frames_per_packet();
+		}
+		return 1;
+	}
+
+	void set_use_capture_thread(bool p_enabled) {
+		if(speech_processor) {
+			speech_processor->set_use_capture_thread(p_enabled);
+		}
+	}
+
+	bool is_using_capture_thread() {
+		if(speech_processor) {
+			return speech_processor->is_using_capture_thread();
+		}
+		return false;
+	}
+
+	// 1 for mono or 2 for stereo voice, see SpeechProcessor::set_channel_count
+	void set_channel_count(int p_channel_count) {
+		if(speech_processor) {
+			speech_processor->set_channel_count(p_channel_count);
+		}
+	}
+
+	int get_channel_count() {
+		if(speech_processor) {
+			return speech_processor->get_channel_count();
+		}
+		return SpeechProcessor::DEFAULT_CHANNEL_COUNT;
+	}
+
+	void set_resampler_quality(int p_quality) {
+		if(speech_processor) {
+			speech_processor->set_resampler_quality(p_quality);
+		}
+	}
+
+	int get_resampler_quality() {
+		if(speech_processor) {
+			return speech_processor->get_resampler_quality();
+		}
+		return SpeechProcessor::RESAMPLER_SINC_FASTEST;
+	}
+
+	// Applies any of enabled, threshold, attack_msec, release_msec,
+	// hangover_msec and use_opus_analysis present in p_settings
+	void set_vad_settings(Dictionary p_settings) {
+		if(!speech_processor) {
+			return;
+		}
+		if(p_settings.has("enabled")) {
+			speech_processor->set_vad_enabled(p_settings["enabled"]);
+		}
+		if(p_settings.has("threshold")) {
+			speech_processor->set_vad_threshold(p_settings["threshold"]);
+		}
+		if(p_settings.has("attack_msec")) {
+			speech_processor->set_vad_attack_msec(p_settings["attack_msec"]);
+		}
+		if(p_settings.has("release_msec")) {
+			speech_processor->set_vad_release_msec(p_settings["release_msec"]);
+		}
+		if(p_settings.has("hangover_msec")) {
+			speech_processor->set_vad_hangover_msec(p_settings["hangover_msec"]);
+		}
+		if(p_settings.has("use_opus_analysis")) {
+			speech_processor->set_vad_use_opus_analysis(p_settings["use_opus_analysis"]);
+		}
+	}
+
+	Dictionary get_vad_settings() {
+		Dictionary settings;
+		if(speech_processor) {
+			settings["enabled"] = speech_processor->is_vad_enabled();
+			settings["threshold"] = speech_processor->get_vad_threshold();
+			settings["attack_msec"] = speech_processor->get_vad_attack_msec();
+			settings["release_msec"] = speech_processor->get_vad_release_msec();
+			settings["hangover_msec"] = speech_processor->get_vad_hangover_msec();
+			settings["use_opus_analysis"] = speech_processor->is_vad_using_opus_analysis();
+		}
+		return settings;
+	}
+
+	// Capture backlog control: latency_target_msec, max_latency_msec,
+	// max_blocks_per_tick, max_time_compression and drift_correction
+	void set_capture_settings(Dictionary p_settings) {
+		if(!speech_processor) {
+			return;
+		}
+		if(p_settings.has("latency_target_msec")) {
+			speech_processor->set_capture_latency_target_msec(p_settings["latency_target_msec"]);
+		}
+		if(p_settings.has("max_latency_msec")) {
+			speech_processor->set_capture_max_latency_msec(p_settings["max_latency_msec"]);
+		}
+		if(p_settings.has("max_blocks_per_tick")) {
+			speech_processor->set_max_capture_blocks_per_tick(p_settings["max_blocks_per_tick"]);
+		}
+		if(p_settings.has("max_time_compression")) {
+			speech_processor->set_capture_max_time_compression(p_settings["max_time_compression"]);
+		}
+		if(p_settings.has("drift_correction")) {
+			speech_processor->set_capture_drift_correction(p_settings["drift_correction"]);
+		}
+	}
+
+	Dictionary get_capture_settings() {
+		Dictionary settings;
+		if(speech_processor) {
+			settings["latency_target_msec"] = speech_processor->get_capture_latency_target_msec();
+			settings["max_latency_msec"] = speech_processor->get_capture_max_latency_msec();
+			settings["max_blocks_per_tick"] = speech_processor->get_max_capture_blocks_per_tick();
+			settings["max_time_compression"] = speech_processor->get_capture_max_time_compression();
+			settings["drift_correction"] = speech_processor->is_capture_drift_correction_enabled();
+		}
+		return settings;
+	}
+
+	// Applies any of noise_suppression, noise_suppression_db, agc,
+	// agc_target_dbfs, agc_max_gain_db, limiter and limiter_ceiling_dbfs
+	// present in p_settings, see SpeechEnhancer
+	void set_enhancement_settings(Dictionary p_settings) {
+		if(!speech_processor) {
+			return;
+		}
+		if(p_settings.has("noise_suppression")) {
+			speech_processor->set_noise_suppression_enabled(p_settings["noise_suppression"]);
+		}
+		if(p_settings.has("noise_suppression_db")) {
+			speech_processor->set_noise_suppression_db(p_settings["noise_suppression_db"]);
+		}
+		if(p_settings.has("agc")) {
+			speech_processor->set_agc_enabled(p_settings["agc"]);
+		}
+		if(p_settings.has("agc_target_dbfs")) {
+			speech_processor->set_agc_target_dbfs(p_settings["agc_target_dbfs"]);
+		}
+		if(p_settings.has("agc_max_gain_db")) {
+			speech_processor->set_agc_max_gain_db(p_settings["agc_max_gain_db"]);
+		}
+		if(p_settings.has("limiter")) {
+			speech_processor->set_limiter_enabled(p_settings["limiter"]);
+		}
+		if(p_settings.has("limiter_ceiling_dbfs")) {
+			speech_processor->set_limiter_ceiling_dbfs(p_settings["limiter_ceiling_dbfs"]);
+		}
+	}
+
+	Dictionary get_enhancement_settings() {
+		Dictionary settings;
+		if(speech_processor) {
+			settings["noise_suppression"] = speech_processor->is_noise_suppression_enabled();
+			settings["noise_suppression_db"] = speech_processor->get_noise_suppression_db();
+			settings["agc"] = speech_processor->is_agc_enabled();
+			settings["agc_target_dbfs"] = speech_processor->get_agc_target_dbfs();
+			settings["agc_max_gain_db"] = speech_processor->get_agc_max_gain_db();
+			settings["limiter"] = speech_processor->is_limiter_enabled();
+			settings["limiter_ceiling_dbfs"] = speech_processor->get_limiter_ceiling_dbfs();
+		}
+		return settings;
+	}
+
+	// Applies any of enabled and reference_bus present in p_settings. The
+	// reference bus is usually Master and needs an AudioEffectStream, see
+	// SpeechProcessor::set_echo_reference_bus
+	void set_echo_cancellation_settings(Dictionary p_settings) {
+		if(!speech_processor) {
+			return;
+		}
+		if(p_settings.has("reference_bus")) {
+			speech_processor->set_echo_reference_bus(p_settings["reference_bus"]);
+		}
+		if(p_settings.has("enabled")) {
+			speech_processor->set_echo_cancellation_enabled(p_settings["enabled"]);
+		}
+	}
+
+	Dictionary get_echo_cancellation_settings() {
+		Dictionary settings;
+		if(speech_processor) {
+			settings["enabled"] = speech_processor->is_echo_cancellation_enabled();
+			settings["reference_bus"] = speech_processor->get_echo_reference_bus();
+		}
+		return settings;
+	}
+
+	bool is_talking() {
+		if(speech_processor) {
+			return speech_processor->is_talking();
+		}
+		return false;
+	}
+
+	GodotSpeech() :
+			skipped_audio_packets(0) {};
 	~GodotSpeech() {
+		// The mixer and relay may outlive this node if a script still references them
+		if(voice_mixer.is_valid()) {
+			voice_mixer->register_speech_decoder_factory(std::function<Ref<SpeechDecoder>()>());
+		}
+		if(voice_relay.is_valid()) {
+			voice_relay->register_speech_decoder_factory(std::function<Ref<SpeechDecoder>()>());
+		}
 	};
 };
 
@@ -5,6 +5,8 @@
 #include "speech_decoder.hpp"
 #include "godot_speech.hpp"
 #include "opus_codec.hpp"
+#include "voice_mixer.hpp"
+#include "voice_relay.hpp"
 
 extern "C"
 #ifdef __GNUC__
@@ -35,4 +37,6 @@ extern "C" void GDN_EXPORT godot_speech_nativescript_init(void *handle) {
 	godot::register_class<godot::SpeechProcessor>();
 	godot::register_class<godot::SpeechDecoder>();
 	godot::register_class<godot::GodotSpeech>();
+	godot::register_class<godot::VoiceMixer>();
+	godot::register_class<godot::VoiceRelay>();
 }
@@ -6,13 +6,22 @@
 #include <Godot.hpp>
 #include <opus.h>
 
+#include <memory>
+#include <mutex>
+
 #include "macros.hpp"
+#include "core/audio_kernels.hpp"
+#include "core/opus_decoder_pool.hpp"
+#include "core/opus_frame_packer.hpp"
+#include "core/opus_speech_encoder.hpp"
 
 namespace godot {
 
 #if SPEECH_DECODER_POLYMORPHISM
 class OpusSpeechDecoder : public SpeechDecoder {
 	::OpusDecoder *decoder = NULL;
+	std::shared_ptr<OpusDecoderPool> decoder_pool;
+	int channel_count = 1;
 
 public:
 	static void _register_methods() {
@@ -26,11 +35,21 @@ public:
 
 	void _init() {}
 
-	void set_decoder(::OpusDecoder *p_decoder) {
-		if (!decoder) {
-			opus_decoder_destroy(decoder);
+	void set_decoder(::OpusDecoder *p_decoder, const std::shared_ptr<OpusDecoderPool> &p_decoder_pool = std::shared_ptr<OpusDecoderPool>(), int p_channel_count = 1) {
+		if (decoder) {
+			if (decoder_pool) {
+				decoder_pool->release(decoder);
+			} else {
+				opus_decoder_destroy(decoder);
+			}
 		}
 		decoder = p_decoder;
+		decoder_pool = p_decoder_pool;
+		channel_count = p_channel_count;
+	}
+
+	virtual int get_channel_count() const {
+		return channel_count;
 	}
 
 	virtual bool process(
@@ -50,22 +69,101 @@ public:
 
 		return false;
 	}
+
+	virtual int decode(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size,
+		int16_t *p_pcm_output_buffer,
+		const int p_buffer_frame_count,
+		const int p_decode_fec = 0)
+	{
+		if (decoder) {
+			return opus_decode(decoder, p_compressed_buffer, p_compressed_buffer_size, p_pcm_output_buffer, p_buffer_frame_count, p_decode_fec);
+		}
+
+		return -1;
+	}
+
+	virtual int decode_float(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size,
+		float *p_pcm_output_buffer,
+		const int p_buffer_frame_count,
+		const int p_decode_fec = 0)
+	{
+		if (decoder) {
+			return opus_decode_float(decoder, p_compressed_buffer, p_compressed_buffer_size, p_pcm_output_buffer, p_buffer_frame_count, p_decode_fec);
+		}
+
+		return -1;
+	}
+
+	virtual int get_frame_count(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size)
+	{
+		if (!decoder) {
+			return -1;
+		}
+
+		if (!p_compressed_buffer || p_compressed_buffer_size <= 0) {
+			opus_int32 last_packet_duration = 0;
+			if (opus_decoder_ctl(decoder, OPUS_GET_LAST_PACKET_DURATION(&last_packet_duration)) != OPUS_OK) {
+				return -1;
+			}
+			return last_packet_duration;
+		}
+
+		const int frame_count = opus_decoder_get_nb_samples(decoder, p_compressed_buffer, p_compressed_buffer_size);
+		return frame_count > 0 ? frame_count : -1;
+	}
 };
 #endif
 
 // TODO: always assumes little endian
 
-template <uint32_t SAMPLE_RATE, uint32_t CHANNEL_COUNT, uint32_t MILLISECONDS_PER_PACKET>
+// The channel count is picked at run time. The encoder follows the
+// frames it is given, decoders are created for the decoder channel count.
+template <uint32_t SAMPLE_RATE>
 class OpusCodec {
+public:
+	typedef OpusSpeechEncoder::Settings EncoderSettings;
+
 private:
 	static const uint32_t APPLICATION = OPUS_APPLICATION_VOIP;
 
-	static const int BUFFER_FRAME_COUNT = SAMPLE_RATE / MILLISECONDS_PER_PACKET;
-	
-	static const int INTERNAL_BUFFER_SIZE = (3*1276);
-	unsigned char internal_buffer[INTERNAL_BUFFER_SIZE];
+public:
+	// Decoders preallocated up front, enough for a typical voice session
+	static const int DEFAULT_DECODER_POOL_CAPACITY = 16;
+
+private:
+
+	// Encodes the capture stream, only ever on the thread processing it
+	OpusSpeechEncoder encoder;
+	// Separate stream for encode_buffer, which script may call from any
+	// thread while capture is running
+	OpusSpeechEncoder buffer_encoder;
+	std::mutex buffer_encoder_mutex;
+	std::shared_ptr<OpusDecoderPool> decoder_pool;
 
-	OpusEncoder *encoder = NULL;
+	static void print_encoder_error(const std::string &p_message) {
+		Godot::print_error(String("OpusCodec: ") + String(p_message.c_str()), __FUNCTION__, __FILE__, __LINE__);
+	}
+
+	// Rebuilds the encoder when the frames change layout, on the encoding thread.
+	// Settings carry over, the stream restarts.
+	bool prepare_encoder(OpusSpeechEncoder &p_encoder, int p_channel_count) {
+		if (p_encoder.get_channel_count() == p_channel_count) {
+			return true;
+		}
+		const int error = p_encoder.init(SAMPLE_RATE, p_channel_count, APPLICATION);
+		if (error != OPUS_OK) {
+			print_opus_error(error);
+			Godot::print_error(String("OpusCodec: could not create Opus encoder!"), __FUNCTION__, __FILE__, __LINE__);
+			return false;
+		}
+		return true;
+	}
 
 protected:
 	void print_opus_error(int error_code) {
@@ -97,10 +195,21 @@ protected:
 		}
 	}
 public:
-	Ref<SpeechDecoder> get_speech_decoder() {
-		int error;
-		::OpusDecoder *decoder = opus_decoder_create(SAMPLE_RATE, CHANNEL_COUNT, &error);
-		if (error != OPUS_OK) {
+	static bool is_valid_frame_count(int p_frame_count) {
+		return OpusSpeechEncoder::is_valid_frame_count(SAMPLE_RATE, p_frame_count);
+	}
+
+	static bool can_report_dtx() {
+		return OpusSpeechEncoder::can_report_dtx();
+	}
+
+	// Decoders for the decoder channel count come from the pool, so this
+	// only allocates the wrapper until more than the pool's capacity are
+	// alive at once. Other channel counts always allocate.
+	Ref<SpeechDecoder> get_speech_decoder(int p_channel_count) {
+		std::shared_ptr<OpusDecoderPool> current_decoder_pool = decoder_pool;
+		::OpusDecoder *decoder = current_decoder_pool->acquire(SAMPLE_RATE, p_channel_count);
+		if (!decoder) {
 			Godot::print_error(String("OpusCodec: could not create Opus decoder!"), __FUNCTION__, __FILE__, __LINE__);
 			return NULL;
 		}
@@ -110,64 +219,162 @@ public:
 #else
 		Ref<SpeechDecoder> speech_decoder = SpeechDecoder::_new();
 #endif
-		speech_decoder->set_decoder(decoder);
+		speech_decoder->set_decoder(decoder, current_decoder_pool, p_channel_count);
 
 		return speech_decoder;
 	}
 
-	int encode_buffer(const PoolByteArray *p_pcm_buffer, PoolByteArray *p_output_buffer) {
-		int number_of_bytes = -1;
+	Ref<SpeechDecoder> get_speech_decoder() {
+		return get_speech_decoder(get_decoder_channel_count());
+	}
 
-		if (encoder) {
-			const opus_int16 *pcm_buffer_pointer = reinterpret_cast<const opus_int16 *>(p_pcm_buffer->read().ptr());
+	// Replaces the pool with one of p_capacity decoders. Decoders already
+	// handed out go back to the old pool, which is freed once they are.
+	bool set_decoder_pool_capacity(int p_capacity) {
+		return configure_decoder_pool(p_capacity, get_decoder_channel_count());
+	}
 
-			opus_int32 ret_value = opus_encode(encoder, pcm_buffer_pointer, BUFFER_FRAME_COUNT, internal_buffer, INTERNAL_BUFFER_SIZE);
-			if (ret_value >= 0) {
-				number_of_bytes = ret_value;
+	bool configure_decoder_pool(int p_capacity, int p_channel_count) {
+		std::shared_ptr<OpusDecoderPool> new_decoder_pool = std::make_shared<OpusDecoderPool>();
+		const int error = new_decoder_pool->configure(p_capacity, SAMPLE_RATE, p_channel_count);
+		if (error != OPUS_OK) {
+			print_opus_error(error);
+			Godot::print_error(String("OpusCodec: could not create Opus decoder pool!"), __FUNCTION__, __FILE__, __LINE__);
+			return false;
+		}
+		decoder_pool = new_decoder_pool;
+		return true;
+	}
 
-				if (number_of_bytes > 0) {
-					unsigned char *output_buffer_pointer = reinterpret_cast<unsigned char *>(p_output_buffer->write().ptr());
-					memcpy(output_buffer_pointer, internal_buffer, number_of_bytes);
-				}
-			}
-			else {
-				print_opus_error(ret_value);
-			}
+	// Channels of the decoders get_speech_decoder hands out from now on.
+	// Existing decoders keep theirs.
+	bool set_decoder_channel_count(int p_channel_count) {
+		if (p_channel_count == get_decoder_channel_count()) {
+			return true;
 		}
+		return configure_decoder_pool(decoder_pool->get_stats().capacity, p_channel_count);
+	}
+
+	int get_decoder_channel_count() const {
+		return decoder_pool ? decoder_pool->get_channel_count() : 1;
+	}
+
+	OpusDecoderPool::Stats get_decoder_pool_stats() {
+		return decoder_pool->get_stats();
+	}
+
+	void set_encoder_settings(const EncoderSettings &p_settings) {
+		encoder.set_settings(p_settings);
+		buffer_encoder.set_settings(p_settings);
+	}
 
-		return number_of_bytes;
+	EncoderSettings get_encoder_settings() {
+		return encoder.get_settings();
 	}
 
-	bool decode_buffer(
+	uint32_t get_final_range() const {
+		return encoder.get_final_range();
+	}
+
+	int get_lookahead() const {
+		return encoder.get_lookahead();
+	}
+
+	bool is_in_dtx() const {
+		return encoder.is_in_dtx();
+	}
+
+	bool is_inband_fec_active() const {
+		return encoder.is_inband_fec_active();
+	}
+
+	// Encodes a single frame of p_frame_count samples per channel
+	// straight into p_output_buffer. Uses its own encoder, so it never
+	// disturbs the capture stream and is safe from any thread.
+	int encode_buffer(const PoolByteArray *p_pcm_buffer, const int p_frame_count, const int p_channel_count, PoolByteArray *p_output_buffer) {
+		std::lock_guard<std::mutex> lock(buffer_encoder_mutex);
+		if (!prepare_encoder(buffer_encoder, p_channel_count)) {
+			return -1;
+		}
+		const int ret_value = buffer_encoder.encode(
+			reinterpret_cast<const int16_t *>(p_pcm_buffer->read().ptr()),
+			p_frame_count,
+			reinterpret_cast<uint8_t *>(p_output_buffer->write().ptr()),
+			p_output_buffer->size());
+		if (ret_value < 0) {
+			print_opus_error(ret_value);
+			return -1;
+		}
+
+		return ret_value;
+	}
+
+	// Encodes the next frame of the capture stream from and into raw memory.
+	// Only call from the thread processing the capture.
+	int encode_frame(const int16_t *p_pcm, const int p_frame_count, const int p_channel_count, uint8_t *p_output, const int p_output_size) {
+		if (!prepare_encoder(encoder, p_channel_count)) {
+			return -1;
+		}
+		const int ret_value = encoder.encode(p_pcm, p_frame_count, p_output, p_output_size);
+		if (ret_value < 0) {
+			print_opus_error(ret_value);
+			return -1;
+		}
+
+		return ret_value;
+	}
+
+	// Decodes one packet straight into interleaved stereo floats.
+	// p_stereo_output must hold p_frame_count stereo frames. Stereo decoders
+	// write it directly, mono is decoded into its first half and then
+	// widened in place, so no other buffer is touched and decoders can run
+	// on different threads at once.
+	// Returns the number of decoded frames, or -1 on failure.
+	static int decode_buffer(
 		SpeechDecoder *p_speech_decoder,
-		const PoolByteArray *p_compressed_buffer,
-		PoolByteArray *p_pcm_output_buffer,
+		const uint8_t *p_compressed_buffer,
 		const int p_compressed_buffer_size,
-		const int p_pcm_output_buffer_size) {
+		float *p_stereo_output,
+		const int p_frame_count,
+		const int p_decode_fec = 0) {
 
-		if(p_pcm_output_buffer->size() != p_pcm_output_buffer_size) {
-			Godot::print_error(String("OpusCodec: decode_buffer output_buffer_size mismatch!"), __FUNCTION__, __FILE__, __LINE__);
-			return false;
+		const int frame_count = p_speech_decoder->decode_float(
+			p_compressed_buffer,
+			p_compressed_buffer_size,
+			p_stereo_output,
+			p_frame_count,
+			p_decode_fec);
+		if (frame_count <= 0) {
+			return -1;
 		}
 
-		return p_speech_decoder->process(p_compressed_buffer, p_pcm_output_buffer, p_compressed_buffer_size, p_pcm_output_buffer_size, BUFFER_FRAME_COUNT);
+		if (p_speech_decoder->get_channel_count() == 1) {
+			get_audio_kernels().mono_to_stereo_float(p_stereo_output, p_stereo_output, frame_count);
+		}
+		return frame_count;
 	}
 
 	OpusCodec() {
 		Godot::print(String("OpusCodec::OpusCodec"));
-		int error = 0;
-		encoder = opus_encoder_create(SAMPLE_RATE, CHANNEL_COUNT, APPLICATION, &error);
-		if (error != OPUS_OK) {
+		encoder.set_error_handler(&OpusCodec::print_encoder_error);
+		buffer_encoder.set_error_handler(&OpusCodec::print_encoder_error);
+
+		if (encoder.init(SAMPLE_RATE, 1, APPLICATION) != OPUS_OK ||
+				buffer_encoder.init(SAMPLE_RATE, 1, APPLICATION) != OPUS_OK) {
 			Godot::print_error(String("OpusCodec: could not create Opus encoder!"), __FUNCTION__, __FILE__, __LINE__);
 		}
+
+		if (!configure_decoder_pool(DEFAULT_DECODER_POOL_CAPACITY, 1)) {
+			// Every decoder falls back to its own allocation
+			configure_decoder_pool(0, 1);
+		}
 	}
 
 	~OpusCodec() {
 		Godot::print(String("OpusCodec::~OpusCodec"));
-		opus_encoder_destroy(encoder);
 	}
 };
 
 }; // namespace godot
 
-#endif // OPUS_CODEC_HPP
\ No newline at end of file
+#endif // OPUS_CODEC_HPP
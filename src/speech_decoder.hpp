@@ -9,6 +9,10 @@
 #if SPEECH_DECODER_POLYMORPHISM
 #else
 #include <opus.h>
+
+#include <memory>
+
+#include "core/opus_decoder_pool.hpp"
 #endif
 
 namespace godot {
@@ -31,6 +35,26 @@ public:
 		const int p_pcm_output_buffer_size,
 		const int p_buffer_frame_count) {return false;}
 
+	virtual int decode(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size,
+		int16_t *p_pcm_output_buffer,
+		const int p_buffer_frame_count,
+		const int p_decode_fec = 0) {return -1;}
+
+	virtual int decode_float(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size,
+		float *p_pcm_output_buffer,
+		const int p_buffer_frame_count,
+		const int p_decode_fec = 0) {return -1;}
+
+	virtual int get_frame_count(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size) {return -1;}
+
+	virtual int get_channel_count() const {return 1;}
+
 	void _init() {}
 };
 #else
@@ -42,6 +66,9 @@ public:
 	}
 private:
 	::OpusDecoder *decoder = NULL;
+	// Set when decoder came from a pool, which outlives it through this reference
+	std::shared_ptr<OpusDecoderPool> decoder_pool;
+	int channel_count = 1;
 public:
 	SpeechDecoder() {
 	}
@@ -51,11 +78,25 @@ public:
 
 	void _init() {}
 
-	void set_decoder(::OpusDecoder *p_decoder) {
-		if (!decoder) {
-			opus_decoder_destroy(decoder);
+	// Takes ownership of p_decoder, created for p_channel_count channels.
+	// With a p_decoder_pool, the decoder is handed back to it rather than destroyed.
+	void set_decoder(::OpusDecoder *p_decoder, const std::shared_ptr<OpusDecoderPool> &p_decoder_pool = std::shared_ptr<OpusDecoderPool>(), int p_channel_count = 1) {
+		if (decoder) {
+			if (decoder_pool) {
+				decoder_pool->release(decoder);
+			} else {
+				opus_decoder_destroy(decoder);
+			}
 		}
 		decoder = p_decoder;
+		decoder_pool = p_decoder_pool;
+		channel_count = p_channel_count;
+	}
+
+	// Interleaved channels every decode writes per frame. Any packet
+	// decodes to this layout, Opus downmixes or duplicates as needed.
+	int get_channel_count() const {
+		return channel_count;
 	}
 
 	virtual bool process(
@@ -75,6 +116,62 @@ public:
 
 		return false;
 	}
+
+	// Decodes straight from and into raw memory.
+	// A NULL p_compressed_buffer runs packet loss concealment, and
+	// p_decode_fec = 1 recovers the previous packet from this one's in-band FEC.
+	// Returns the number of decoded frames, or -1 on failure.
+	int decode(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size,
+		int16_t *p_pcm_output_buffer,
+		const int p_buffer_frame_count,
+		const int p_decode_fec = 0)
+	{
+		if (decoder) {
+			return opus_decode(decoder, p_compressed_buffer, p_compressed_buffer_size, p_pcm_output_buffer, p_buffer_frame_count, p_decode_fec);
+		}
+
+		return -1;
+	}
+
+	// Same as decode, but decodes to -1..1 floats without an int16 step
+	int decode_float(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size,
+		float *p_pcm_output_buffer,
+		const int p_buffer_frame_count,
+		const int p_decode_fec = 0)
+	{
+		if (decoder) {
+			return opus_decode_float(decoder, p_compressed_buffer, p_compressed_buffer_size, p_pcm_output_buffer, p_buffer_frame_count, p_decode_fec);
+		}
+
+		return -1;
+	}
+
+	// Frames that decode will produce for this packet without decoding it.
+	// For a NULL p_compressed_buffer, the length of the concealed frame.
+	// Returns -1 on failure.
+	int get_frame_count(
+		const uint8_t *p_compressed_buffer,
+		const int p_compressed_buffer_size)
+	{
+		if (!decoder) {
+			return -1;
+		}
+
+		if (!p_compressed_buffer || p_compressed_buffer_size <= 0) {
+			opus_int32 last_packet_duration = 0;
+			if (opus_decoder_ctl(decoder, OPUS_GET_LAST_PACKET_DURATION(&last_packet_duration)) != OPUS_OK) {
+				return -1;
+			}
+			return last_packet_duration;
+		}
+
+		const int frame_count = opus_decoder_get_nb_samples(decoder, p_compressed_buffer, p_compressed_buffer_size);
+		return frame_count > 0 ? frame_count : -1;
+	}
 };
 #endif
 
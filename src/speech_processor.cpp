@@ -1,19 +1,15 @@
 #include "speech_processor.hpp"
+#include "core/audio_kernels.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <string.h>
 
 using namespace godot;
 
-#define SET_BUFFER_16_BIT(buffer, buffer_pos, sample) ((int16_t *)buffer)[buffer_pos] = sample >> 16;
-#define STEREO_CHANNEL_COUNT 2
-
-#define SIGNED_32_BIT_SIZE 2147483647
-#define UNSIGNED_32_BIT_SIZE 4294967295
-#define SIGNED_16_BIT_SIZE 32767
-#define UNSIGNED_16_BIT_SIZE 65536
-
 #define RECORD_MIX_FRAMES 1024 * 2
-#define RESAMPLED_BUFFER_FACTOR sizeof(int)
+
+#define CAPTURE_THREAD_IDLE_MSEC 5
 
 void SpeechProcessor::_register_methods() {
 	register_method("_init", &SpeechProcessor::_init);
@@ -25,124 +21,270 @@ void SpeechProcessor::_register_methods() {
 
 	register_method("compress_buffer", &SpeechProcessor::compress_buffer);
 	register_method("decompress_buffer", &SpeechProcessor::decompress_buffer);
+	register_method("decompress_buffers", &SpeechProcessor::decompress_buffers);
+	register_method("set_decode_thread_count", &SpeechProcessor::set_decode_thread_count);
+	register_method("get_decode_thread_count", &SpeechProcessor::get_decode_thread_count);
+	register_method("set_decoder_pool_capacity", &SpeechProcessor::set_decoder_pool_capacity);
+	register_method("get_decoder_pool_capacity", &SpeechProcessor::get_decoder_pool_capacity);
+	register_method("get_decoder_pool_stats", &SpeechProcessor::get_decoder_pool_stats);
+	register_method("get_stats", &SpeechProcessor::get_stats);
+	register_method("reset_stats", &SpeechProcessor::reset_stats);
 
 	register_method("set_streaming_bus", &SpeechProcessor::set_streaming_bus);
 	register_method("set_audio_input_stream_player", &SpeechProcessor::set_audio_input_stream_player);
 
+	register_method("set_bitrate", &SpeechProcessor::set_bitrate);
+	register_method("get_bitrate", &SpeechProcessor::get_bitrate);
+	register_method("set_vbr", &SpeechProcessor::set_vbr);
+	register_method("get_vbr", &SpeechProcessor::get_vbr);
+	register_method("set_vbr_constraint", &SpeechProcessor::set_vbr_constraint);
+	register_method("get_vbr_constraint", &SpeechProcessor::get_vbr_constraint);
+	register_method("set_complexity", &SpeechProcessor::set_complexity);
+	register_method("get_complexity", &SpeechProcessor::get_complexity);
+	register_method("set_dtx", &SpeechProcessor::set_dtx);
+	register_method("get_dtx", &SpeechProcessor::get_dtx);
+	register_method("set_inband_fec", &SpeechProcessor::set_inband_fec);
+	register_method("get_inband_fec", &SpeechProcessor::get_inband_fec);
+	register_method("set_packet_loss_percentage", &SpeechProcessor::set_packet_loss_percentage);
+	register_method("get_packet_loss_percentage", &SpeechProcessor::get_packet_loss_percentage);
+	register_method("set_signal_type", &SpeechProcessor::set_signal_type);
+	register_method("get_signal_type", &SpeechProcessor::get_signal_type);
+	register_method("set_max_bandwidth", &SpeechProcessor::set_max_bandwidth);
+	register_method("get_max_bandwidth", &SpeechProcessor::get_max_bandwidth);
+	register_method("get_encoder_final_range", &SpeechProcessor::get_encoder_final_range);
+	register_method("get_encoder_lookahead", &SpeechProcessor::get_encoder_lookahead);
+
+	register_method("set_frame_duration_msec", &SpeechProcessor::set_frame_duration_msec);
+	register_method("get_frame_duration_msec", &SpeechProcessor::get_frame_duration_msec);
+	register_method("set_frames_per_packet", &SpeechProcessor::set_frames_per_packet);
+	register_method("get_frames_per_packet", &SpeechProcessor::get_frames_per_packet);
+
+	register_method("set_use_capture_thread", &SpeechProcessor::set_use_capture_thread);
+	register_method("is_using_capture_thread", &SpeechProcessor::is_using_capture_thread);
+
+	register_method("set_vad_enabled", &SpeechProcessor::set_vad_enabled);
+	register_method("is_vad_enabled", &SpeechProcessor::is_vad_enabled);
+	register_method("set_vad_threshold", &SpeechProcessor::set_vad_threshold);
+	register_method("get_vad_threshold", &SpeechProcessor::get_vad_threshold);
+	register_method("set_vad_attack_msec", &SpeechProcessor::set_vad_attack_msec);
+	register_method("get_vad_attack_msec", &SpeechProcessor::get_vad_attack_msec);
+	register_method("set_vad_release_msec", &SpeechProcessor::set_vad_release_msec);
+	register_method("get_vad_release_msec", &SpeechProcessor::get_vad_release_msec);
+	register_method("set_vad_hangover_msec", &SpeechProcessor::set_vad_hangover_msec);
+	register_method("get_vad_hangover_msec", &SpeechProcessor::get_vad_hangover_msec);
+	register_method("set_vad_use_opus_analysis", &SpeechProcessor::set_vad_use_opus_analysis);
+	register_method("is_vad_using_opus_analysis", &SpeechProcessor::is_vad_using_opus_analysis);
+	register_method("is_talking", &SpeechProcessor::is_talking);
+
+	register_method("set_noise_suppression_enabled", &SpeechProcessor::set_noise_suppression_enabled);
+	register_method("is_noise_suppression_enabled", &SpeechProcessor::is_noise_suppression_enabled);
+	register_method("set_noise_suppression_db", &SpeechProcessor::set_noise_suppression_db);
+	register_method("get_noise_suppression_db", &SpeechProcessor::get_noise_suppression_db);
+	register_method("set_agc_enabled", &SpeechProcessor::set_agc_enabled);
+	register_method("is_agc_enabled", &SpeechProcessor::is_agc_enabled);
+	register_method("set_agc_target_dbfs", &SpeechProcessor::set_agc_target_dbfs);
+	register_method("get_agc_target_dbfs", &SpeechProcessor::get_agc_target_dbfs);
+	register_method("set_agc_max_gain_db", &SpeechProcessor::set_agc_max_gain_db);
+	register_method("get_agc_max_gain_db", &SpeechProcessor::get_agc_max_gain_db);
+	register_method("set_limiter_enabled", &SpeechProcessor::set_limiter_enabled);
+	register_method("is_limiter_enabled", &SpeechProcessor::is_limiter_enabled);
+	register_method("set_limiter_ceiling_dbfs", &SpeechProcessor::set_limiter_ceiling_dbfs);
+	register_method("get_limiter_ceiling_dbfs", &SpeechProcessor::get_limiter_ceiling_dbfs);
+
+	register_method("set_echo_cancellation_enabled", &SpeechProcessor::set_echo_cancellation_enabled);
+	register_method("is_echo_cancellation_enabled", &SpeechProcessor::is_echo_cancellation_enabled);
+	register_method("set_echo_reference_bus", &SpeechProcessor::set_echo_reference_bus);
+	register_method("get_echo_reference_bus", &SpeechProcessor::get_echo_reference_bus);
+	register_method("get_echo_delay_msec", &SpeechProcessor::get_echo_delay_msec);
+	register_method("get_echo_erle_db", &SpeechProcessor::get_echo_erle_db);
+
+	register_method("get_audio_kernel_name", &SpeechProcessor::get_audio_kernel_name);
+
+	register_method("set_capture_latency_target_msec", &SpeechProcessor::set_capture_latency_target_msec);
+	register_method("get_capture_latency_target_msec", &SpeechProcessor::get_capture_latency_target_msec);
+	register_method("set_capture_max_latency_msec", &SpeechProcessor::set_capture_max_latency_msec);
+	register_method("get_capture_max_latency_msec", &SpeechProcessor::get_capture_max_latency_msec);
+	register_method("set_max_capture_blocks_per_tick", &SpeechProcessor::set_max_capture_blocks_per_tick);
+	register_method("get_max_capture_blocks_per_tick", &SpeechProcessor::get_max_capture_blocks_per_tick);
+	register_method("set_capture_max_time_compression", &SpeechProcessor::set_capture_max_time_compression);
+	register_method("get_capture_max_time_compression", &SpeechProcessor::get_capture_max_time_compression);
+	register_method("set_capture_drift_correction", &SpeechProcessor::set_capture_drift_correction);
+	register_method("is_capture_drift_correction_enabled", &SpeechProcessor::is_capture_drift_correction_enabled);
+	register_method("get_capture_backlog_msec", &SpeechProcessor::get_capture_backlog_msec);
+	register_method("get_capture_drift_ppm", &SpeechProcessor::get_capture_drift_ppm);
+
+	register_method("set_channel_count", &SpeechProcessor::set_channel_count);
+	register_method("get_channel_count", &SpeechProcessor::get_channel_count);
+
+	register_method("set_resampler_quality", &SpeechProcessor::set_resampler_quality);
+	register_method("get_resampler_quality", &SpeechProcessor::get_resampler_quality);
+
+	register_method("set_speech_signal_mode", &SpeechProcessor::set_speech_signal_mode);
+	register_method("get_speech_signal_mode", &SpeechProcessor::get_speech_signal_mode);
+
 	register_signal<SpeechProcessor>("speech_processed", "packet", GODOT_VARIANT_TYPE_DICTIONARY);
+	register_signal<SpeechProcessor>("speech_processed_batch", "batch", GODOT_VARIANT_TYPE_DICTIONARY);
+	register_signal<SpeechProcessor>("talk_started", Dictionary());
+	register_signal<SpeechProcessor>("talk_stopped", Dictionary());
 }
 
-uint32_t SpeechProcessor::_resample_audio_buffer(
-	const float *p_src,
-	const uint32_t p_src_frame_count,
-	const uint32_t p_src_samplerate,
-	const uint32_t p_target_samplerate,
-	float *p_dst) {
+void SpeechProcessor::_print_capture_error(const std::string &p_message) {
+	Godot::print_error(String("SpeechProcessor: ") + String(p_message.c_str()), __FUNCTION__, __FILE__, __LINE__);
+}
 
-	if (p_src_samplerate != p_target_samplerate) {
-		SRC_DATA src_data;
+void SpeechProcessor::_frame_captured(const SpeechCapturePipeline::Frame &p_frame) {
+	talking = p_frame.voice_active;
+	const bool send_frame = p_frame.voice_active || !vad_enabled;
+	if (!send_frame) {
+		stats.add(SpeechStats::COUNTER_GATED_FRAMES);
+	}
 
-		src_data.data_in = p_src;
-		src_data.data_out = p_dst;
+	if (send_frame && speech_signal_connected) {
+		switch (speech_signal_mode) {
+			case SPEECH_SIGNAL_PER_FRAME:
+				// Signals can only be emitted safely from the main thread
+				if (!use_capture_thread) {
+					_emit_speech_signal(p_frame);
+				}
+				break;
+			case SPEECH_SIGNAL_BATCHED:
+				_batch_speech_frame(p_frame);
+				break;
+			default:
+				break;
+		}
+	}
 
-		src_data.input_frames = p_src_frame_count;
-		src_data.output_frames = p_src_frame_count * RESAMPLED_BUFFER_FACTOR;
+	if (speech_processed) {
+		SpeechInput speech_input;
+		speech_input.pcm = p_frame.pcm;
+		speech_input.frame_count = p_frame.frame_count;
+		speech_input.channel_count = p_frame.channel_count;
+		speech_input.volume = p_frame.loudness;
+		speech_input.voice_active = send_frame;
 
-		src_data.src_ratio = (double)p_target_samplerate / (double)p_src_samplerate;
-		src_data.end_of_input = 0;
+		speech_processed(&speech_input);
 
-		int error = src_process(libresample_state, &src_data);
-		if (error != 0) {
-			Godot::print_error("resample_error!", __FUNCTION__, __FILE__, __LINE__);
-			return 0;
+		if (send_frame) {
+			capture_pipeline.get_voice_activity_detector().set_encoder_in_dtx(opus_codec->is_in_dtx());
 		}
-		return src_data.output_frames_gen;
-	} else {
-		memcpy(p_dst, p_src, static_cast<size_t>(p_src_frame_count) * sizeof(float));
-		return p_src_frame_count;
 	}
 }
 
-void SpeechProcessor::_get_capture_block(AudioServer *p_audio_server,
-	const uint32_t &p_mix_frame_count,
-	const float *p_process_buffer_in,
-	float *p_process_buffer_out)
-{
-
-	// 0.1 second based on the internal sample rate
-	//uint32_t playback_delay = std::min<uint32_t>(((50 * mix_rate) / 1000) * 2, capture_buffer.size() >> 1);
-
-	size_t capture_offset = 0;
-	{
-		for (size_t i = 0; i < p_mix_frame_count; i++) {
-			{
-				float mono = 0.0f;
-				for (size_t j = 0; j < STEREO_CHANNEL_COUNT; j++) {
-					mono += p_process_buffer_in[capture_offset] * 0.5f;
-					capture_offset++;
-				}
-				p_process_buffer_out[i] = mono;
-			}
-		}
+void SpeechProcessor::_update_speech_signal_connected() {
+	switch (speech_signal_mode) {
+		case SPEECH_SIGNAL_PER_FRAME:
+			speech_signal_connected = get_signal_connection_list("speech_processed").size() > 0;
+			break;
+		case SPEECH_SIGNAL_BATCHED:
+			speech_signal_connected = get_signal_connection_list("speech_processed_batch").size() > 0;
+			break;
+		default:
+			speech_signal_connected = false;
+			break;
 	}
 }
 
-void SpeechProcessor::_mix_audio(const float *p_incoming_buffer) {
-	int8_t *write_buffer = reinterpret_cast<int8_t *>(mix_byte_array.write().ptr());
-	if (audio_server) {
-		_get_capture_block(audio_server, RECORD_MIX_FRAMES, p_incoming_buffer, mono_real_array.write().ptr());
-		uint32_t resampled_frame_count = resampled_real_array_offset + _resample_audio_buffer(
-			mono_real_array.read().ptr(), // Pointer to source buffer
-			RECORD_MIX_FRAMES, // Size of source buffer * sizeof(float)
-			mix_rate, // Source sample rate
-			VOICE_SAMPLE_RATE, // Target sample rate
-			resampled_real_array.write().ptr() + static_cast<size_t>(resampled_real_array_offset));
-		
-		resampled_real_array_offset = 0;
+void SpeechProcessor::_emit_speech_signal(const SpeechCapturePipeline::Frame &p_frame) {
+	PoolByteArray buffer;
+	buffer.resize(p_frame.frame_count * BUFFER_BYTE_COUNT * p_frame.channel_count);
+	memcpy(buffer.write().ptr(), p_frame.pcm, buffer.size());
 
-		const float *resampled_real_array_read_ptr = resampled_real_array.read().ptr();
-		double_t sum = 0;
-		while (resampled_real_array_offset < resampled_frame_count - BUFFER_FRAME_COUNT) {
-			sum = 0.0;
-			for (size_t i = 0; i < BUFFER_FRAME_COUNT; i++) {
-				float frame_float = resampled_real_array_read_ptr[static_cast<size_t>(resampled_real_array_offset) + i];
-				int frame_integer = int32_t(frame_float * (float)SIGNED_32_BIT_SIZE);
+	Dictionary voice_data_packet;
+	voice_data_packet["buffer"] = buffer;
+	voice_data_packet["channel_count"] = int(p_frame.channel_count);
+	voice_data_packet["loudness"] = p_frame.loudness;
 
-				sum += fabsf(frame_float);
+	emit_signal("speech_processed", voice_data_packet);
+}
 
-				write_buffer[i*2] = SET_BUFFER_16_BIT(write_buffer, i, frame_integer);
-			}
+void SpeechProcessor::_batch_speech_frame(const SpeechCapturePipeline::Frame &p_frame) {
+	std::lock_guard<std::mutex> lock(speech_batch_mutex);
+	// Frames batched before the channel count changed are stale
+	if (p_frame.channel_count != speech_batch_channel_count) {
+		speech_batch_pcm.clear();
+		speech_batch_frame_counts.clear();
+		speech_batch_loudness.clear();
+		speech_batch_channel_count = p_frame.channel_count;
+	}
+	const size_t sample_count = p_frame.frame_count * p_frame.channel_count;
+	// Nobody has emitted for a second, drop frames rather than grow
+	if (speech_batch_pcm.size() + sample_count > size_t(MAX_BATCHED_FRAME_COUNT) * p_frame.channel_count) {
+		return;
+	}
+	speech_batch_pcm.insert(speech_batch_pcm.end(), p_frame.pcm, p_frame.pcm + sample_count);
+	speech_batch_frame_counts.push_back(int(p_frame.frame_count));
+	speech_batch_loudness.push_back(p_frame.loudness);
+}
 
-			float average = (float)sum / (float)BUFFER_FRAME_COUNT;
+void SpeechProcessor::_emit_speech_batch() {
+	{
+		std::lock_guard<std::mutex> lock(speech_batch_mutex);
+		if (speech_batch_frame_counts.empty()) {
+			return;
+		}
+		speech_batch_pcm.swap(speech_batch_emit_pcm);
+		speech_batch_frame_counts.swap(speech_batch_emit_frame_counts);
+		speech_batch_loudness.swap(speech_batch_emit_loudness);
+		speech_batch_emit_channel_count = speech_batch_channel_count;
+	}
 
-			Dictionary voice_data_packet;
-			voice_data_packet["buffer"] = &mix_byte_array;
-			voice_data_packet["loudness"] = average;
-			
-			emit_signal("speech_processed", voice_data_packet);
+	const int frame_count = int(speech_batch_emit_frame_counts.size());
+	PoolByteArray pcm;
+	pcm.resize(int(speech_batch_emit_pcm.size() * sizeof(int16_t)));
+	memcpy(pcm.write().ptr(), speech_batch_emit_pcm.data(), pcm.size());
+	PoolIntArray frame_counts;
+	frame_counts.resize(frame_count);
+	memcpy(frame_counts.write().ptr(), speech_batch_emit_frame_counts.data(), frame_count * sizeof(int));
+	PoolRealArray loudness;
+	loudness.resize(frame_count);
+	{
+		PoolRealArray::Write loudness_write = loudness.write();
+		for (int i = 0; i < frame_count; i++) {
+			loudness_write[i] = speech_batch_emit_loudness[i];
+		}
+	}
 
-			if (speech_processed) {
-				SpeechInput speech_input;
-				speech_input.pcm_byte_array = &mix_byte_array;
-				speech_input.volume = average;
+	speech_batch_emit_pcm.clear();
+	speech_batch_emit_frame_counts.clear();
+	speech_batch_emit_loudness.clear();
 
-				speech_processed(&speech_input);
-			}
+	// Frames are back to back in pcm, frame i is frame_counts[i] samples
+	// per channel long, with channel_count interleaved channels
+	Dictionary batch;
+	batch["pcm"] = pcm;
+	batch["frame_counts"] = frame_counts;
+	batch["loudness"] = loudness;
+	batch["channel_count"] = int(speech_batch_emit_channel_count);
 
-			resampled_real_array_offset += BUFFER_FRAME_COUNT;
-		}
+	emit_signal("speech_processed_batch", batch);
+}
 
-		{
-			float *resampled_buffer_write_ptr = resampled_real_array.write().ptr();
-			uint32_t remaining_resampled_buffer_frames = (resampled_frame_count - resampled_real_array_offset);
-			
-			// Copy the remaining frames to the beginning of the buffer for the next around
-			if (remaining_resampled_buffer_frames > 0) {
-				memcpy(resampled_buffer_write_ptr, resampled_real_array_read_ptr + resampled_real_array_offset, static_cast<size_t>(remaining_resampled_buffer_frames) * sizeof(float));
-			}
-			resampled_real_array_offset = remaining_resampled_buffer_frames;
-		}
+void SpeechProcessor::set_speech_signal_mode(int p_mode) {
+	if (p_mode < SPEECH_SIGNAL_DISABLED || p_mode > SPEECH_SIGNAL_BATCHED) {
+		Godot::print_error("SpeechProcessor: invalid speech signal mode!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	speech_signal_mode = p_mode;
+	_update_speech_signal_connected();
+
+	// Frames batched under the old mode are stale
+	std::lock_guard<std::mutex> lock(speech_batch_mutex);
+	speech_batch_pcm.clear();
+	speech_batch_frame_counts.clear();
+	speech_batch_loudness.clear();
+}
+
+void SpeechProcessor::_mix_audio(const float *p_incoming_buffer, uint32_t p_frame_count) {
+	if (!audio_server) {
+		return;
 	}
+
+	// The pipeline writes each frame into capture_pcm before handing it on
+	capture_pipeline.process(p_incoming_buffer, p_frame_count, capture_pcm,
+		[this](const SpeechCapturePipeline::Frame &p_frame) {
+			_frame_captured(p_frame);
+		});
 }
 
 void SpeechProcessor::start() {
@@ -156,70 +298,244 @@ void SpeechProcessor::start() {
 	}
 
 	audio_input_stream_player->play();
-	stream_audio->clear();
+	// The capture thread may be reading the streams, so they are cleared
+	// and the capture state reset at its next drain
+	capture_restart_pending = true;
+	capture_active = true;
 }
 
 void SpeechProcessor::stop() {
+	capture_active = false;
+	talking = false;
+
 	if(!audio_input_stream_player) {
 		return;
 	}
 	audio_input_stream_player->stop();
 }
 
-bool SpeechProcessor::_16_pcm_mono_to_real_stereo(const PoolByteArray *p_src_buffer, PoolVector2Array *p_dst_buffer) {
-	uint32_t buffer_size = p_src_buffer->size();
+void SpeechProcessor::_emit_talk_signals() {
+	const bool is_talking_now = talking;
+	if (is_talking_now != talking_signalled) {
+		talking_signalled = is_talking_now;
+		emit_signal(is_talking_now ? "talk_started" : "talk_stopped");
+	}
+}
 
-	ERR_FAIL_COND_V(buffer_size % 2, false);
+void SpeechProcessor::_drain_audio_frames() {
+	if (capture_restart_pending.exchange(false)) {
+		stream_audio->clear();
+		// Both streams count from 0 again, so the echo canceller starts over with them
+		if (echo_reference_stream_audio) {
+			echo_reference_stream_audio->clear();
+		}
+		capture_pipeline.get_echo_canceller().request_reset();
 
-	uint32_t frame_count = buffer_size / 2;
-    
-	const int16_t *src_buffer_ptr = reinterpret_cast<const int16_t *>(p_src_buffer->read().ptr());
-	real_t *real_buffer_ptr = reinterpret_cast<real_t *>(p_dst_buffer->write().ptr());
+		// Also forgets the ratio scale, the scheduler measures drift afresh
+		capture_pipeline.request_reset();
+		capture_scheduler.request_reset();
+	}
+
+	// Take everything StreamAudio holds so its buffer never overflows,
+	// the scheduler decides how much of it is processed now
+	const uint64_t now_usec = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	uint32_t block_count = 0;
+	uint32_t dropped_block_count = 0;
+	PoolRealArray audio_frames = _get_audio_frames();
+	while (audio_frames.size() > 0) {
+		dropped_block_count += capture_scheduler.push_block(audio_frames.read().ptr(), audio_frames.size() / 2, now_usec);
+		block_count++;
+		audio_frames = _get_audio_frames();
+	}
+	stats.add(SpeechStats::COUNTER_CAPTURED_BLOCKS, block_count);
+	stats.add(SpeechStats::COUNTER_CAPTURE_BLOCKS_DROPPED, dropped_block_count);
+
+	// Drained right after the capture, so both streams hold the same mixes
+	if (echo_reference_bound) {
+		PoolRealArray reference_frames = _get_echo_reference_frames();
+		while (reference_frames.size() > 0) {
+			capture_pipeline.push_echo_reference(reference_frames.read().ptr(), reference_frames.size() / 2);
+			reference_frames = _get_echo_reference_frames();
+		}
+	}
+
+	capture_scheduler.begin_tick();
+	uint32_t frame_count = 0;
+	const float *block = capture_scheduler.front(&frame_count);
+	while (block) {
+		capture_pipeline.set_ratio_scale(capture_scheduler.get_ratio_scale());
+		capture_pipeline.set_stream_position(int64_t(capture_scheduler.get_front_position()));
+		_mix_audio(block, frame_count);
+		capture_scheduler.pop(capture_pipeline.is_ratio_scale_applied());
+		record_mix_frames_processed++;
+		block = capture_scheduler.front(&frame_count);
+	}
+	stats.set_capture_backlog(capture_scheduler.get_block_count());
+}
+
+PoolRealArray SpeechProcessor::_get_audio_frames() {
+	SpeechStats::ScopedTimer drain_timer(&stats, SpeechStats::STAGE_CAPTURE_DRAIN);
+	return stream_audio->get_audio_frames(RECORD_MIX_FRAMES);
+}
+
+PoolRealArray SpeechProcessor::_get_echo_reference_frames() {
+	SpeechStats::ScopedTimer drain_timer(&stats, SpeechStats::STAGE_CAPTURE_DRAIN);
+	return echo_reference_stream_audio->get_audio_frames(RECORD_MIX_FRAMES);
+}
+
+void SpeechProcessor::_capture_thread_func() {
+	while (capture_thread_running) {
+		if (capture_active && stream_audio) {
+			_drain_audio_frames();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_THREAD_IDLE_MSEC));
+	}
+}
+
+void SpeechProcessor::_start_capture_thread() {
+	if (capture_thread.joinable()) {
+		return;
+	}
+	capture_thread_running = true;
+	capture_thread = std::thread(&SpeechProcessor::_capture_thread_func, this);
+}
 
-	for(int i = 0; i < frame_count; i++) {
-		float value = ((float)*src_buffer_ptr) / 32768.0f;
+void SpeechProcessor::_stop_capture_thread() {
+	capture_thread_running = false;
+	if (capture_thread.joinable()) {
+		capture_thread.join();
+	}
+}
 
-		*(real_buffer_ptr+0) = value;
-		*(real_buffer_ptr+1) = value;
+void SpeechProcessor::set_use_capture_thread(bool p_enabled) {
+	if (use_capture_thread == p_enabled) {
+		return;
+	}
 
-		real_buffer_ptr+=2;
-		src_buffer_ptr++;
+	// Stop the worker before flipping the flag so _mix_audio never
+	// runs on both threads at once.
+	if (!p_enabled) {
+		_stop_capture_thread();
+	}
+	use_capture_thread = p_enabled;
+	if (p_enabled && stream_audio) {
+		_start_capture_thread();
 	}
+}
+
+void SpeechProcessor::set_capture_latency_target_msec(float p_msec) {
+	capture_scheduler.set_latency_target_msec(p_msec);
+}
+
+float SpeechProcessor::get_capture_latency_target_msec() {
+	return capture_scheduler.get_latency_target_msec();
+}
+
+void SpeechProcessor::set_capture_max_latency_msec(float p_msec) {
+	capture_scheduler.set_max_latency_msec(p_msec);
+}
+
+float SpeechProcessor::get_capture_max_latency_msec() {
+	return capture_scheduler.get_max_latency_msec();
+}
+
+void SpeechProcessor::set_max_capture_blocks_per_tick(int p_count) {
+	capture_scheduler.set_max_blocks_per_tick(p_count);
+}
+
+int SpeechProcessor::get_max_capture_blocks_per_tick() {
+	return capture_scheduler.get_max_blocks_per_tick();
+}
+
+void SpeechProcessor::set_capture_max_time_compression(float p_fraction) {
+	capture_scheduler.set_max_time_compression(p_fraction);
+}
 
-	return true;
+float SpeechProcessor::get_capture_max_time_compression() {
+	return capture_scheduler.get_max_time_compression();
+}
+
+void SpeechProcessor::set_capture_drift_correction(bool p_enabled) {
+	capture_scheduler.set_drift_correction(p_enabled);
+}
+
+bool SpeechProcessor::is_capture_drift_correction_enabled() {
+	return capture_scheduler.is_drift_correction_enabled();
+}
+
+float SpeechProcessor::get_capture_backlog_msec() {
+	return capture_scheduler.get_backlog_msec();
+}
+
+float SpeechProcessor::get_capture_drift_ppm() {
+	return capture_scheduler.get_drift_ppm();
+}
+
+String SpeechProcessor::get_audio_kernel_name() {
+	return String(get_audio_kernels().name);
+}
+
+bool SpeechProcessor::decompress_buffer_internal(
+	SpeechDecoder *speech_decoder,
+	const PoolByteArray *p_read_byte_array,
+	const int p_read_size,
+	PoolVector2Array *p_write_vec2_array) {
+	if (!speech_decoder) {
+		return false;
+	}
+
+	const uint8_t *read_ptr = p_read_byte_array->read().ptr();
+	const int frame_count = speech_decoder->get_frame_count(read_ptr, p_read_size);
+	if (frame_count <= 0 || frame_count > int(MAX_BUFFER_FRAME_COUNT)) {
+		return false;
+	}
+
+	if (p_write_vec2_array->size() != frame_count) {
+		p_write_vec2_array->resize(frame_count);
+	}
+	// Vector2 is a pair of floats unless godot-cpp is built with double precision
+	float *write_ptr = reinterpret_cast<float *>(p_write_vec2_array->write().ptr());
+
+	return _decode_buffer(&stats, speech_decoder, read_ptr, p_read_size, write_ptr, frame_count) > 0;
+}
+
+int SpeechProcessor::_decode_buffer(SpeechStats *p_stats, SpeechDecoder *p_speech_decoder, const uint8_t *p_compressed_buffer, int p_compressed_buffer_size, float *p_stereo_output, int p_frame_count) {
+	SpeechStats::ScopedTimer decode_timer(p_stats, SpeechStats::STAGE_DECODE);
+	const int frame_count = SpeechOpusCodec::decode_buffer(p_speech_decoder, p_compressed_buffer, p_compressed_buffer_size, p_stereo_output, p_frame_count);
+	p_stats->add(frame_count > 0 ? SpeechStats::COUNTER_PACKETS_IN : SpeechStats::COUNTER_DECODE_FAILURES);
+	return frame_count;
 }
 
 Dictionary SpeechProcessor::compress_buffer(const PoolByteArray &p_pcm_byte_array, Dictionary p_output_buffer) {
-	if (p_pcm_byte_array.size() != PCM_BUFFER_SIZE) {
+	// Encoded with the capture channel count
+	const uint32_t channel_count = capture_pipeline.get_channel_count();
+	const int frame_count = p_pcm_byte_array.size() / (BUFFER_BYTE_COUNT * channel_count);
+	if (p_pcm_byte_array.size() % (BUFFER_BYTE_COUNT * channel_count) != 0 || !SpeechOpusCodec::is_valid_frame_count(frame_count)) {
 		Godot::print_error("SpeechProcessor: PCM buffer is incorrect size!", __FUNCTION__, __FILE__, __LINE__);
 		return p_output_buffer;
 	}
 
-	PoolByteArray *byte_array = NULL;
 	if (!p_output_buffer.has("byte_array")) {
-		byte_array = (PoolByteArray *)&p_output_buffer["byte_array"];
-	}
-
-	if(!byte_array) {
 		Godot::print_error("SpeechProcessor: did not provide valid 'byte_array' in p_output_buffer argument!", __FUNCTION__, __FILE__, __LINE__);
 		return p_output_buffer;
-	} else {
-		if(byte_array->size() == PCM_BUFFER_SIZE) {
-			Godot::print_error("SpeechProcessor: output byte array is incorrect size!", __FUNCTION__, __FILE__, __LINE__);
-			return p_output_buffer;
-		}
+	}
+
+	PoolByteArray byte_array = p_output_buffer["byte_array"];
+	if (byte_array.size() < int(MAX_PACKET_SIZE)) {
+		byte_array.resize(MAX_PACKET_SIZE);
 	}
 
 	CompressedSpeechBuffer compressed_speech_buffer;
-	compressed_speech_buffer.compressed_byte_array = byte_array;
+	compressed_speech_buffer.compressed_byte_array = &byte_array;
 
-	if (compress_buffer_internal(&p_pcm_byte_array, &compressed_speech_buffer)) {
+	if (compress_buffer_internal(&p_pcm_byte_array, frame_count, channel_count, &compressed_speech_buffer)) {
 		p_output_buffer["buffer_size"] = compressed_speech_buffer.buffer_size;
 	} else {
 		p_output_buffer["buffer_size"] = -1;
 	}
 
-	p_output_buffer["byte_array"] = *compressed_speech_buffer.compressed_byte_array;
+	p_output_buffer["byte_array"] = byte_array;
 
 	return p_output_buffer;
 }
@@ -242,6 +558,553 @@ PoolVector2Array SpeechProcessor::decompress_buffer(
 	return PoolVector2Array();
 }
 
+namespace {
+struct DecodeBatch {
+	SpeechProcessor::DecodeBatchItem *items;
+	int item_count;
+	SpeechStats *stats;
+};
+
+// Spreads decoders over workers by address, so every packet of one decoder lands on the same worker
+uint32_t decoder_worker_index(const SpeechDecoder *p_speech_decoder, uint32_t p_worker_count) {
+	return uint32_t((uint64_t(uintptr_t(p_speech_decoder)) * 11400714819323198485ull) >> 32) % p_worker_count;
+}
+} // namespace
+
+void SpeechProcessor::_decode_batch_task(void *p_userdata, uint32_t p_worker_index, uint32_t p_worker_count) {
+	DecodeBatch *batch = static_cast<DecodeBatch *>(p_userdata);
+
+	for (int i = 0; i < batch->item_count; i++) {
+		DecodeBatchItem &item = batch->items[i];
+		if (decoder_worker_index(item.speech_decoder, p_worker_count) != p_worker_index) {
+			continue;
+		}
+
+		item.frame_count = -1;
+		if (!item.speech_decoder || !item.stereo_output || item.max_frame_count <= 0) {
+			continue;
+		}
+
+		const uint8_t *compressed_buffer = item.compressed_buffer_size > 0 ? item.compressed_buffer : NULL;
+		item.frame_count = _decode_buffer(
+			batch->stats,
+			item.speech_decoder,
+			compressed_buffer,
+			compressed_buffer ? item.compressed_buffer_size : 0,
+			item.stereo_output,
+			std::min(item.max_frame_count, int(MAX_BUFFER_FRAME_COUNT)));
+	}
+}
+
+void SpeechProcessor::decompress_buffers_internal(DecodeBatchItem *p_items, const int p_item_count) {
+	DecodeBatch batch;
+	batch.items = p_items;
+	batch.item_count = p_item_count;
+	batch.stats = &stats;
+
+	decode_worker_pool.run(&SpeechProcessor::_decode_batch_task, &batch);
+}
+
+void SpeechProcessor::set_decode_thread_count(int p_thread_count) {
+	if (p_thread_count < 0 || p_thread_count > int(MAX_DECODE_THREAD_COUNT)) {
+		Godot::print_error("SpeechProcessor: invalid decode thread count!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	decode_worker_pool.set_thread_count(p_thread_count);
+}
+
+void SpeechProcessor::set_decoder_pool_capacity(int p_capacity) {
+	if (p_capacity < 0) {
+		Godot::print_error("SpeechProcessor: invalid decoder pool capacity!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	opus_codec->set_decoder_pool_capacity(p_capacity);
+}
+
+int SpeechProcessor::get_decoder_pool_capacity() {
+	return opus_codec->get_decoder_pool_stats().capacity;
+}
+
+Dictionary SpeechProcessor::get_stats() {
+	const SpeechStats::Snapshot snapshot = stats.snapshot();
+
+	Dictionary dict;
+	for (int i = 0; i < SpeechStats::STAGE_COUNT; i++) {
+		Dictionary stage;
+		stage["count"] = int64_t(snapshot.stages[i].count);
+		// Fractional, so stages shorter than a microsecond do not read as 0
+		stage["total_usec"] = double(snapshot.stages[i].total_nsec) / 1000.0;
+		stage["max_usec"] = double(snapshot.stages[i].max_nsec) / 1000.0;
+		dict[SpeechStats::get_stage_name(i)] = stage;
+	}
+	for (int i = 0; i < SpeechStats::COUNTER_COUNT; i++) {
+		dict[SpeechStats::get_counter_name(i)] = int64_t(snapshot.counters[i]);
+	}
+	dict["capture_backlog"] = snapshot.capture_backlog;
+	dict["max_capture_backlog"] = snapshot.max_capture_backlog;
+	dict["capture_backlog_msec"] = capture_scheduler.get_backlog_msec();
+	dict["capture_drift_ppm"] = capture_scheduler.get_drift_ppm();
+	dict["echo_delay_msec"] = capture_pipeline.get_echo_canceller().get_delay_msec();
+	dict["echo_erle_db"] = capture_pipeline.get_echo_canceller().get_erle_db();
+	return dict;
+}
+
+void SpeechProcessor::reset_stats() {
+	stats.reset();
+}
+
+Dictionary SpeechProcessor::get_decoder_pool_stats() {
+	const OpusDecoderPool::Stats stats = opus_codec->get_decoder_pool_stats();
+
+	Dictionary dict;
+	dict["capacity"] = stats.capacity;
+	dict["in_use"] = stats.in_use;
+	dict["high_water"] = stats.high_water;
+	dict["overflow"] = stats.overflow;
+	dict["unpooled"] = stats.unpooled;
+	return dict;
+}
+
+int SpeechProcessor::_get_batch_frame_count(const DecodeBatchItem *p_items, const int p_index) {
+	const DecodeBatchItem &item = p_items[p_index];
+	if (item.compressed_buffer) {
+		return std::max(0, item.speech_decoder->get_frame_count(item.compressed_buffer, item.compressed_buffer_size));
+	}
+
+	// Concealment is as long as the last packet the decoder decoded. That
+	// is the previous item for the same decoder if the batch has one, it
+	// is not decoded yet so the decoder cannot be asked.
+	for (int i = p_index - 1; i >= 0; i--) {
+		if (p_items[i].speech_decoder == item.speech_decoder && p_items[i].max_frame_count > 0) {
+			return p_items[i].max_frame_count;
+		}
+	}
+	return std::max(0, item.speech_decoder->get_frame_count(NULL, 0));
+}
+
+Dictionary SpeechProcessor::decompress_buffers(
+	Array p_speech_decoders,
+	const PoolByteArray &p_packet_byte_array,
+	const PoolIntArray &p_packet_offsets,
+	const PoolIntArray &p_packet_sizes,
+	Dictionary p_output_buffer) {
+
+	const int packet_count = p_packet_sizes.size();
+	if (p_speech_decoders.size() != packet_count || p_packet_offsets.size() != packet_count) {
+		Godot::print_error("SpeechProcessor: decoder, offset and size arrays differ in length!", __FUNCTION__, __FILE__, __LINE__);
+		return p_output_buffer;
+	}
+
+	if (!p_output_buffer.has("pcm") || !p_output_buffer.has("frame_offsets") || !p_output_buffer.has("frame_counts")) {
+		Godot::print_error("SpeechProcessor: did not provide valid 'pcm', 'frame_offsets' and 'frame_counts' in p_output_buffer argument!", __FUNCTION__, __FILE__, __LINE__);
+		return p_output_buffer;
+	}
+
+	// Take the arrays out of the dictionary first, so writing to them
+	// does not copy them as long as the caller keeps no other reference
+	PoolVector2Array pcm = p_output_buffer["pcm"];
+	PoolIntArray frame_offsets = p_output_buffer["frame_offsets"];
+	PoolIntArray frame_counts = p_output_buffer["frame_counts"];
+	p_output_buffer["pcm"] = PoolVector2Array();
+	p_output_buffer["frame_offsets"] = PoolIntArray();
+	p_output_buffer["frame_counts"] = PoolIntArray();
+
+	if (frame_offsets.size() < packet_count) {
+		frame_offsets.resize(packet_count);
+	}
+	if (frame_counts.size() < packet_count) {
+		frame_counts.resize(packet_count);
+	}
+	if (int(decode_batch_items.size()) < packet_count) {
+		decode_batch_items.resize(packet_count);
+	}
+
+	// Work out where every packet goes before decoding anything
+	int total_frame_count = 0;
+	{
+		const int byte_count = p_packet_byte_array.size();
+		const uint8_t *packet_bytes = p_packet_byte_array.read().ptr();
+		PoolIntArray::Read offsets_read = p_packet_offsets.read();
+		PoolIntArray::Read sizes_read = p_packet_sizes.read();
+		PoolIntArray::Write frame_offsets_write = frame_offsets.write();
+
+		for (int i = 0; i < packet_count; i++) {
+			DecodeBatchItem &item = decode_batch_items[i];
+			item = DecodeBatchItem();
+			frame_offsets_write[i] = total_frame_count;
+
+			const int offset = offsets_read[i];
+			const int size = sizes_read[i];
+			if (offset < 0 || size < 0 || size > byte_count - offset) {
+				Godot::print_error("SpeechProcessor: packet outside the packet byte array!", __FUNCTION__, __FILE__, __LINE__);
+				continue;
+			}
+
+			item.speech_decoder = Object::cast_to<SpeechDecoder>(p_speech_decoders[i]);
+			if (!item.speech_decoder) {
+				continue;
+			}
+			item.compressed_buffer = size > 0 ? packet_bytes + offset : NULL;
+			item.compressed_buffer_size = size;
+			item.max_frame_count = _get_batch_frame_count(decode_batch_items.data(), i);
+			total_frame_count += item.max_frame_count;
+		}
+	}
+
+	if (pcm.size() < total_frame_count) {
+		pcm.resize(total_frame_count);
+	}
+
+	{
+		PoolVector2Array::Write pcm_write = pcm.write();
+		PoolIntArray::Read frame_offsets_read = frame_offsets.read();
+		// Vector2 is a pair of floats unless godot-cpp is built with double precision
+		float *pcm_ptr = reinterpret_cast<float *>(pcm_write.ptr());
+		for (int i = 0; i < packet_count; i++) {
+			decode_batch_items[i].stereo_output = pcm_ptr + size_t(frame_offsets_read[i]) * 2;
+		}
+
+		decompress_buffers_internal(decode_batch_items.data(), packet_count);
+	}
+
+	{
+		PoolIntArray::Write frame_counts_write = frame_counts.write();
+		for (int i = 0; i < packet_count; i++) {
+			frame_counts_write[i] = decode_batch_items[i].frame_count;
+		}
+	}
+
+	p_output_buffer["pcm"] = pcm;
+	p_output_buffer["frame_offsets"] = frame_offsets;
+	p_output_buffer["frame_counts"] = frame_counts;
+	p_output_buffer["packet_count"] = packet_count;
+	p_output_buffer["frame_count"] = total_frame_count;
+
+	return p_output_buffer;
+}
+
+void SpeechProcessor::set_bitrate(int p_bitrate) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	// Zero or less lets the encoder pick
+	settings.bitrate = p_bitrate > 0 ? p_bitrate : OPUS_AUTO;
+	opus_codec->set_encoder_settings(settings);
+}
+
+int SpeechProcessor::get_bitrate() {
+	const int bitrate = opus_codec->get_encoder_settings().bitrate;
+	return bitrate == OPUS_AUTO ? 0 : bitrate;
+}
+
+void SpeechProcessor::set_vbr(bool p_enabled) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	settings.vbr = p_enabled;
+	opus_codec->set_encoder_settings(settings);
+}
+
+bool SpeechProcessor::get_vbr() {
+	return opus_codec->get_encoder_settings().vbr;
+}
+
+void SpeechProcessor::set_vbr_constraint(bool p_enabled) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	settings.vbr_constraint = p_enabled;
+	opus_codec->set_encoder_settings(settings);
+}
+
+bool SpeechProcessor::get_vbr_constraint() {
+	return opus_codec->get_encoder_settings().vbr_constraint;
+}
+
+void SpeechProcessor::set_complexity(int p_complexity) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	settings.complexity = std::min(std::max(p_complexity, 0), 10);
+	opus_codec->set_encoder_settings(settings);
+}
+
+int SpeechProcessor::get_complexity() {
+	return opus_codec->get_encoder_settings().complexity;
+}
+
+void SpeechProcessor::set_dtx(bool p_enabled) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	settings.dtx = p_enabled;
+	opus_codec->set_encoder_settings(settings);
+}
+
+bool SpeechProcessor::get_dtx() {
+	return opus_codec->get_encoder_settings().dtx;
+}
+
+void SpeechProcessor::set_inband_fec(bool p_enabled) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	settings.inband_fec = p_enabled;
+	opus_codec->set_encoder_settings(settings);
+}
+
+bool SpeechProcessor::get_inband_fec() {
+	return opus_codec->get_encoder_settings().inband_fec;
+}
+
+void SpeechProcessor::set_packet_loss_percentage(int p_percentage) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	settings.packet_loss_percentage = std::min(std::max(p_percentage, 0), 100);
+	opus_codec->set_encoder_settings(settings);
+}
+
+int SpeechProcessor::get_packet_loss_percentage() {
+	return opus_codec->get_encoder_settings().packet_loss_percentage;
+}
+
+void SpeechProcessor::set_signal_type(int p_signal_type) {
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	switch (p_signal_type) {
+		case SIGNAL_VOICE:
+			settings.signal = OPUS_SIGNAL_VOICE;
+			break;
+		case SIGNAL_MUSIC:
+			settings.signal = OPUS_SIGNAL_MUSIC;
+			break;
+		default:
+			settings.signal = OPUS_AUTO;
+			break;
+	}
+	opus_codec->set_encoder_settings(settings);
+}
+
+int SpeechProcessor::get_signal_type() {
+	switch (opus_codec->get_encoder_settings().signal) {
+		case OPUS_SIGNAL_VOICE:
+			return SIGNAL_VOICE;
+		case OPUS_SIGNAL_MUSIC:
+			return SIGNAL_MUSIC;
+		default:
+			return SIGNAL_AUTO;
+	}
+}
+
+void SpeechProcessor::set_max_bandwidth(int p_bandwidth) {
+	if (p_bandwidth < BANDWIDTH_NARROWBAND || p_bandwidth > BANDWIDTH_FULLBAND) {
+		Godot::print_error("SpeechProcessor: invalid max bandwidth!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	SpeechOpusCodec::EncoderSettings settings = opus_codec->get_encoder_settings();
+	// The Opus bandwidth constants are consecutive
+	settings.max_bandwidth = OPUS_BANDWIDTH_NARROWBAND + p_bandwidth;
+	opus_codec->set_encoder_settings(settings);
+}
+
+int SpeechProcessor::get_max_bandwidth() {
+	return opus_codec->get_encoder_settings().max_bandwidth - OPUS_BANDWIDTH_NARROWBAND;
+}
+
+int64_t SpeechProcessor::get_encoder_final_range() {
+	return opus_codec->get_final_range();
+}
+
+int SpeechProcessor::get_encoder_lookahead() {
+	return opus_codec->get_lookahead();
+}
+
+void SpeechProcessor::set_frame_duration_msec(float p_msec) {
+	const int frame_count = int(p_msec * (VOICE_SAMPLE_RATE / 1000) + 0.5f);
+	if (!SpeechOpusCodec::is_valid_frame_count(frame_count)) {
+		Godot::print_error("SpeechProcessor: frame duration must be 2.5, 5, 10, 20, 40 or 60 ms!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	capture_pipeline.set_frame_count(frame_count);
+
+	// Keep packed packets within the 120 ms Opus limit
+	set_frames_per_packet(frames_per_packet);
+}
+
+float SpeechProcessor::get_frame_duration_msec() {
+	return float(capture_pipeline.get_frame_count()) / float(VOICE_SAMPLE_RATE / 1000);
+}
+
+void SpeechProcessor::set_frames_per_packet(int p_frames_per_packet) {
+	const int max_frames_per_packet = std::min<int>(MAX_FRAMES_PER_PACKET, MAX_BUFFER_FRAME_COUNT / capture_pipeline.get_frame_count());
+	frames_per_packet = std::min(std::max(p_frames_per_packet, 1), max_frames_per_packet);
+}
+
+void SpeechProcessor::set_vad_enabled(bool p_enabled) {
+	vad_enabled = p_enabled;
+}
+
+bool SpeechProcessor::is_vad_enabled() {
+	return vad_enabled;
+}
+
+void SpeechProcessor::set_vad_threshold(float p_threshold) {
+	capture_pipeline.get_voice_activity_detector().set_threshold(p_threshold);
+}
+
+float SpeechProcessor::get_vad_threshold() {
+	return capture_pipeline.get_voice_activity_detector().get_threshold();
+}
+
+void SpeechProcessor::set_vad_attack_msec(float p_msec) {
+	capture_pipeline.get_voice_activity_detector().set_attack_msec(p_msec);
+}
+
+float SpeechProcessor::get_vad_attack_msec() {
+	return capture_pipeline.get_voice_activity_detector().get_attack_msec();
+}
+
+void SpeechProcessor::set_vad_release_msec(float p_msec) {
+	capture_pipeline.get_voice_activity_detector().set_release_msec(p_msec);
+}
+
+float SpeechProcessor::get_vad_release_msec() {
+	return capture_pipeline.get_voice_activity_detector().get_release_msec();
+}
+
+void SpeechProcessor::set_vad_hangover_msec(float p_msec) {
+	capture_pipeline.get_voice_activity_detector().set_hangover_msec(p_msec);
+}
+
+float SpeechProcessor::get_vad_hangover_msec() {
+	return capture_pipeline.get_voice_activity_detector().get_hangover_msec();
+}
+
+void SpeechProcessor::set_vad_use_opus_analysis(bool p_enabled) {
+	if (p_enabled && !SpeechOpusCodec::can_report_dtx()) {
+		Godot::print_warning("SpeechProcessor: this Opus build cannot report DTX, using the energy gate only.", __FUNCTION__, __FILE__, __LINE__);
+	}
+	capture_pipeline.get_voice_activity_detector().set_use_encoder_dtx(p_enabled);
+}
+
+bool SpeechProcessor::is_vad_using_opus_analysis() {
+	return capture_pipeline.get_voice_activity_detector().is_using_encoder_dtx();
+}
+
+bool SpeechProcessor::is_talking() {
+	return talking;
+}
+
+void SpeechProcessor::set_channel_count(int p_channel_count) {
+	if (p_channel_count < 1 || p_channel_count > int(MAX_CHANNEL_COUNT)) {
+		Godot::print_error("SpeechProcessor: channel count must be 1 or 2!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	capture_pipeline.set_channel_count(p_channel_count);
+	opus_codec->set_decoder_channel_count(p_channel_count);
+}
+
+void SpeechProcessor::set_noise_suppression_enabled(bool p_enabled) {
+	capture_pipeline.get_speech_enhancer().set_noise_suppression_enabled(p_enabled);
+}
+
+bool SpeechProcessor::is_noise_suppression_enabled() {
+	return capture_pipeline.get_speech_enhancer().is_noise_suppression_enabled();
+}
+
+void SpeechProcessor::set_noise_suppression_db(float p_db) {
+	capture_pipeline.get_speech_enhancer().set_suppression_db(p_db);
+}
+
+float SpeechProcessor::get_noise_suppression_db() {
+	return capture_pipeline.get_speech_enhancer().get_suppression_db();
+}
+
+void SpeechProcessor::set_agc_enabled(bool p_enabled) {
+	capture_pipeline.get_speech_enhancer().set_agc_enabled(p_enabled);
+}
+
+bool SpeechProcessor::is_agc_enabled() {
+	return capture_pipeline.get_speech_enhancer().is_agc_enabled();
+}
+
+void SpeechProcessor::set_agc_target_dbfs(float p_dbfs) {
+	capture_pipeline.get_speech_enhancer().set_agc_target_dbfs(p_dbfs);
+}
+
+float SpeechProcessor::get_agc_target_dbfs() {
+	return capture_pipeline.get_speech_enhancer().get_agc_target_dbfs();
+}
+
+void SpeechProcessor::set_agc_max_gain_db(float p_db) {
+	capture_pipeline.get_speech_enhancer().set_agc_max_gain_db(p_db);
+}
+
+float SpeechProcessor::get_agc_max_gain_db() {
+	return capture_pipeline.get_speech_enhancer().get_agc_max_gain_db();
+}
+
+void SpeechProcessor::set_limiter_enabled(bool p_enabled) {
+	capture_pipeline.get_speech_enhancer().set_limiter_enabled(p_enabled);
+}
+
+bool SpeechProcessor::is_limiter_enabled() {
+	return capture_pipeline.get_speech_enhancer().is_limiter_enabled();
+}
+
+void SpeechProcessor::set_limiter_ceiling_dbfs(float p_dbfs) {
+	capture_pipeline.get_speech_enhancer().set_limiter_ceiling_dbfs(p_dbfs);
+}
+
+float SpeechProcessor::get_limiter_ceiling_dbfs() {
+	return capture_pipeline.get_speech_enhancer().get_limiter_ceiling_dbfs();
+}
+
+void SpeechProcessor::set_echo_cancellation_enabled(bool p_enabled) {
+	capture_pipeline.get_echo_canceller().set_enabled(p_enabled);
+}
+
+bool SpeechProcessor::is_echo_cancellation_enabled() {
+	return capture_pipeline.get_echo_canceller().is_enabled();
+}
+
+void SpeechProcessor::set_echo_reference_bus(const String &p_name) {
+	if(!audio_server || !stream_audio || !echo_reference_stream_audio) {
+		return;
+	}
+
+	echo_reference_bound = false;
+	int index = audio_server->get_bus_index(p_name);
+	if(index != -1) {
+		int effect_count = audio_server->get_bus_effect_count(index);
+		for (int i = 0; i < effect_count; i++) {
+			Ref<AudioEffect> audio_effect = audio_server->get_bus_effect(index, i);
+			Ref<AudioEffectStream> audio_effect_stream = audio_effect;
+			if (audio_effect_stream.is_valid()) {
+				echo_reference_stream_audio->set_audio_effect_stream(index, i);
+				echo_reference_bound = true;
+			}
+		}
+	}
+	if (!echo_reference_bound) {
+		Godot::print_error("SpeechProcessor: echo reference bus has no AudioEffectStream!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	echo_reference_bus = p_name;
+
+	// The canceller lines the two streams up by position, so both start over
+	stream_audio->clear();
+	echo_reference_stream_audio->clear();
+	capture_scheduler.request_reset();
+	capture_pipeline.get_echo_canceller().request_reset();
+}
+
+String SpeechProcessor::get_echo_reference_bus() {
+	return echo_reference_bus;
+}
+
+float SpeechProcessor::get_echo_delay_msec() {
+	return capture_pipeline.get_echo_canceller().get_delay_msec();
+}
+
+float SpeechProcessor::get_echo_erle_db() {
+	return capture_pipeline.get_echo_canceller().get_erle_db();
+}
+
+void SpeechProcessor::set_resampler_quality(int p_quality) {
+	capture_pipeline.set_resampler_quality(p_quality);
+}
+
+int SpeechProcessor::get_resampler_quality() {
+	return capture_pipeline.get_resampler_quality();
+}
+
 void SpeechProcessor::set_streaming_bus(const String &p_name) {
 	if(!audio_server) {
 		return;
@@ -275,6 +1138,8 @@ void SpeechProcessor::_init() {
 	audio_server = AudioServer::get_singleton();
 	if(audio_server != NULL) {
 		mix_rate = audio_server->get_mix_rate();
+		capture_pipeline.configure(mix_rate, VOICE_SAMPLE_RATE, RECORD_MIX_FRAMES, MAX_BUFFER_FRAME_COUNT);
+		capture_scheduler.configure(mix_rate, RECORD_MIX_FRAMES);
 	}
 }
 
@@ -282,6 +1147,10 @@ void SpeechProcessor::_setup() {
 	stream_audio = StreamAudio::_new();
 	stream_audio->set_name("StreamAudio");
 	add_child(stream_audio);
+
+	echo_reference_stream_audio = StreamAudio::_new();
+	echo_reference_stream_audio->set_name("EchoReferenceStreamAudio");
+	add_child(echo_reference_stream_audio);
 }
 
 void SpeechProcessor::set_process_all(bool p_active) {
@@ -294,6 +1163,10 @@ void SpeechProcessor::_ready() {
 	if (!Engine::get_singleton()->is_editor_hint()) {
 		_setup();
 
+		if (use_capture_thread) {
+			_start_capture_thread();
+		}
+
 		set_process_all(true);
 	} else {
 		set_process_all(false);
@@ -302,47 +1175,69 @@ void SpeechProcessor::_ready() {
 
 void SpeechProcessor::_notification(int p_what) {
 	switch(p_what) {
-		case NOTIFICATION_ENTER_TREE:
-			if(!Engine::get_singleton()->is_editor_hint()) {
-				mix_byte_array.resize(BUFFER_FRAME_COUNT * BUFFER_BYTE_COUNT);
-			}
-		break;
 		case NOTIFICATION_EXIT_TREE:
 			if(!Engine::get_singleton()->is_editor_hint()) {
 				stop();
-				mix_byte_array.resize(0);
-				
+				_stop_capture_thread();
+
 				audio_server = NULL;
 			}
 		break;
 		case NOTIFICATION_PROCESS:
 			if(!Engine::get_singleton()->is_editor_hint()) {
-				if (stream_audio && audio_input_stream_player && audio_input_stream_player->is_playing()) {
-					// This is pretty ugly, but needed to keep the audio from going out of sync
-					PoolRealArray audio_frames = stream_audio->get_audio_frames(RECORD_MIX_FRAMES);
-					while (audio_frames.size() > 0) {
-						_mix_audio(audio_frames.read().ptr());
-						record_mix_frames_processed++;
-						audio_frames = stream_audio->get_audio_frames(RECORD_MIX_FRAMES);
-					}
+				if (!use_capture_thread && stream_audio && audio_input_stream_player && audio_input_stream_player->is_playing()) {
+					_drain_audio_frames();
+				}
+				// Talk state changes are polled so they are also signalled when capturing on a thread
+				_emit_talk_signals();
+				_update_speech_signal_connected();
+				if (speech_signal_mode == SPEECH_SIGNAL_BATCHED) {
+					_emit_speech_batch();
 				}
 			}
 		break;
 	}
 }
 
-SpeechProcessor::SpeechProcessor() {
+SpeechProcessor::SpeechProcessor() :
+		frames_per_packet(1),
+		vad_enabled(false),
+		talking(false),
+		speech_signal_mode(SPEECH_SIGNAL_PER_FRAME),
+		speech_signal_connected(false),
+		capture_thread_running(false),
+		capture_active(false),
+		echo_reference_bound(false),
+		capture_restart_pending(false) {
 	Godot::print(String("SpeechProcessor::SpeechProcessor"));
-	opus_codec = new OpusCodec<VOICE_SAMPLE_RATE, CHANNEL_COUNT, MILLISECONDS_PER_PACKET>();
-
-	mono_real_array.resize(RECORD_MIX_FRAMES);
-	resampled_real_array.resize(RECORD_MIX_FRAMES * RESAMPLED_BUFFER_FACTOR);
-	pcm_byte_array_cache.resize(PCM_BUFFER_SIZE);
-	libresample_state = src_new(SRC_SINC_BEST_QUALITY, CHANNEL_COUNT, &libresample_error);
+	opus_codec = new SpeechOpusCodec();
+
+
+	capture_pipeline.set_error_handler(&SpeechProcessor::_print_capture_error);
+	capture_pipeline.set_stats(&stats);
+
+	capture_arena.configure(
+			ScratchArena::get_size<int16_t>(MAX_BUFFER_FRAME_COUNT * MAX_CHANNEL_COUNT) +
+			ScratchArena::get_size<uint8_t>(MAX_PACKET_SIZE));
+	capture_pcm = capture_arena.allocate<int16_t>(MAX_BUFFER_FRAME_COUNT * MAX_CHANNEL_COUNT);
+	encoded_packet = capture_arena.allocate<uint8_t>(MAX_PACKET_SIZE);
+
+	// Sized once for the shortest 2.5 ms frames, _batch_speech_frame never grows them
+	const size_t max_batched_frames = MAX_BATCHED_FRAME_COUNT / (VOICE_SAMPLE_RATE / 400);
+	speech_batch_pcm.reserve(MAX_BATCHED_FRAME_COUNT * MAX_CHANNEL_COUNT);
+	speech_batch_frame_counts.reserve(max_batched_frames);
+	speech_batch_loudness.reserve(max_batched_frames);
+	speech_batch_emit_pcm.reserve(MAX_BATCHED_FRAME_COUNT * MAX_CHANNEL_COUNT);
+	speech_batch_emit_frame_counts.reserve(max_batched_frames);
+	speech_batch_emit_loudness.reserve(max_batched_frames);
+	capture_pipeline.set_frame_count(DEFAULT_BUFFER_FRAME_COUNT);
+	// Reconfigured for the real mix rate in _init
+	capture_pipeline.configure(mix_rate, VOICE_SAMPLE_RATE, RECORD_MIX_FRAMES, MAX_BUFFER_FRAME_COUNT);
+	capture_scheduler.configure(mix_rate, RECORD_MIX_FRAMES);
 }
 
 SpeechProcessor::~SpeechProcessor() {
-	libresample_state = src_delete(libresample_state);
+	_stop_capture_thread();
 
 	Godot::print(String("SpeechProcessor::~SpeechProcessor"));
 	delete opus_codec;
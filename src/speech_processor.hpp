@@ -15,10 +15,19 @@
 #include <AudioStreamMicrophone.hpp>
 
 #include <stdlib.h>
+#include <atomic>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-#include "samplerate.h"
 #include "opus_codec.hpp"
+#include "core/capture_scheduler.hpp"
+#include "core/scratch_arena.hpp"
+#include "core/speech_capture_pipeline.hpp"
+#include "core/speech_stats.hpp"
+#include "core/voice_packet.hpp"
+#include "core/worker_pool.hpp"
 
 #include "speech_decoder.hpp"
 
@@ -30,38 +39,158 @@ class SpeechProcessor : public Node {
 	//
 public:
 	static const uint32_t VOICE_SAMPLE_RATE = 48000;
-	static const uint32_t CHANNEL_COUNT = 1;
-	static const uint32_t MILLISECONDS_PER_PACKET = 100;
-	static const uint32_t BUFFER_FRAME_COUNT = VOICE_SAMPLE_RATE / MILLISECONDS_PER_PACKET;
+	// Captured frames are mono unless set_channel_count is called
+	static const uint32_t DEFAULT_CHANNEL_COUNT = 1;
+	static const uint32_t MAX_CHANNEL_COUNT = SpeechCapturePipeline::MAX_CHANNEL_COUNT;
+	// 10 ms frames unless set_frame_duration_msec is called
+	static const uint32_t DEFAULT_BUFFER_FRAME_COUNT = VOICE_SAMPLE_RATE / 100;
+	// 120 ms, the longest a single Opus packet can be, covers packed frames too
+	static const uint32_t MAX_BUFFER_FRAME_COUNT = VOICE_SAMPLE_RATE * 120 / 1000;
+	static const uint32_t MAX_FRAMES_PER_PACKET = 6;
 	static const uint32_t BUFFER_BYTE_COUNT = sizeof(uint16_t);
-	static const uint32_t PCM_BUFFER_SIZE = BUFFER_FRAME_COUNT * BUFFER_BYTE_COUNT * CHANNEL_COUNT;
+	// Large enough for the longest frame or packet, the valid part depends on the frame duration
+	static const uint32_t PCM_BUFFER_SIZE = MAX_BUFFER_FRAME_COUNT * BUFFER_BYTE_COUNT * MAX_CHANNEL_COUNT;
+	static const uint32_t MAX_PACKET_SIZE = OpusFramePacker::MAX_PACKET_SIZE;
+	static const uint32_t MAX_DECODE_THREAD_COUNT = 32;
+
+	// Script-facing values for set_signal_type and set_max_bandwidth
+	enum SignalType {
+		SIGNAL_AUTO,
+		SIGNAL_VOICE,
+		SIGNAL_MUSIC,
+	};
+
+	enum Bandwidth {
+		BANDWIDTH_NARROWBAND,
+		BANDWIDTH_MEDIUMBAND,
+		BANDWIDTH_WIDEBAND,
+		BANDWIDTH_SUPERWIDEBAND,
+		BANDWIDTH_FULLBAND,
+	};
+
+	// Script-facing values for set_resampler_quality, cheapest last
+	enum ResamplerQuality {
+		RESAMPLER_SINC_BEST = SpeechCapturePipeline::RESAMPLER_SINC_BEST,
+		RESAMPLER_SINC_MEDIUM = SpeechCapturePipeline::RESAMPLER_SINC_MEDIUM,
+		RESAMPLER_SINC_FASTEST = SpeechCapturePipeline::RESAMPLER_SINC_FASTEST,
+		RESAMPLER_LINEAR = SpeechCapturePipeline::RESAMPLER_LINEAR,
+		RESAMPLER_POLYPHASE = SpeechCapturePipeline::RESAMPLER_POLYPHASE,
+	};
+
+	// Script-facing values for set_speech_signal_mode
+	enum SpeechSignalMode {
+		SPEECH_SIGNAL_DISABLED,
+		// speech_processed for every frame, not emitted while using the capture thread
+		SPEECH_SIGNAL_PER_FRAME,
+		// speech_processed_batch once per process tick with every frame since the last
+		SPEECH_SIGNAL_BATCHED,
+	};
+
+	// One second of audio is held for speech_processed_batch at most
+	static const uint32_t MAX_BATCHED_FRAME_COUNT = VOICE_SAMPLE_RATE;
+
+	typedef OpusCodec<VOICE_SAMPLE_RATE> SpeechOpusCodec;
 
 private:
-	OpusCodec<VOICE_SAMPLE_RATE, CHANNEL_COUNT, MILLISECONDS_PER_PACKET> *opus_codec;
+	SpeechOpusCodec *opus_codec;
     
 private:
 	uint32_t record_mix_frames_processed = 0;
 
 	AudioServer *audio_server = NULL;
 	StreamAudio *stream_audio = NULL;
+	// Taps the output bus the echo canceller uses as its reference
+	StreamAudio *echo_reference_stream_audio = NULL;
+	String echo_reference_bus;
 	AudioStreamPlayer *audio_input_stream_player = NULL;
 	
-	uint32_t mix_rate;
-	PoolByteArray mix_byte_array;
-
-	PoolRealArray mono_real_array;
-	PoolRealArray resampled_real_array;
-	uint32_t resampled_real_array_offset = 0;
-
-	PoolByteArray pcm_byte_array_cache;
-
-	// LibResample
-	SRC_STATE *libresample_state;
-	int libresample_error;
+	uint32_t mix_rate = VOICE_SAMPLE_RATE;
+
+	// Capture scratch space, sized once in the constructor so capturing
+	// and encoding never allocate or lock a PoolVector
+	ScratchArena capture_arena;
+	// The frame the pipeline is handing on
+	int16_t *capture_pcm = NULL;
+	// The packet last written by encode_frame_internal
+	uint8_t *encoded_packet = NULL;
+
+	// Downmix, resampling, framing and VAD, free of Godot types.
+	// Frame duration and resampler quality may be set from the main
+	// thread, the pipeline picks them up at the next block.
+	SpeechCapturePipeline capture_pipeline;
+	// Bounds the blocks processed per tick and keeps capture latency near its target
+	CaptureScheduler capture_scheduler;
+	std::atomic<uint32_t> frames_per_packet;
+
+	// Voice activity. The detector always runs so talk signals work,
+	// vad_enabled decides whether silent frames are dropped.
+	std::atomic<bool> vad_enabled;
+	std::atomic<bool> talking;
+	bool talking_signalled = false;
+
+	void _emit_talk_signals();
+
+	// Script signals for captured frames. Whether anything is connected is
+	// checked once per process tick, so frames never touch Variants when
+	// nobody listens.
+	std::atomic<int> speech_signal_mode;
+	std::atomic<bool> speech_signal_connected;
+
+	// Frames waiting for speech_processed_batch, filled by the capture side
+	std::mutex speech_batch_mutex;
+	std::vector<int16_t> speech_batch_pcm;
+	std::vector<int> speech_batch_frame_counts;
+	std::vector<float> speech_batch_loudness;
+	// Every frame of a batch has the same channel count
+	uint32_t speech_batch_channel_count = DEFAULT_CHANNEL_COUNT;
+	// Swapped with the above on the main thread, so neither side allocates
+	std::vector<int16_t> speech_batch_emit_pcm;
+	std::vector<int> speech_batch_emit_frame_counts;
+	std::vector<float> speech_batch_emit_loudness;
+	uint32_t speech_batch_emit_channel_count = DEFAULT_CHANNEL_COUNT;
+
+	void _update_speech_signal_connected();
+	void _emit_speech_signal(const SpeechCapturePipeline::Frame &p_frame);
+	void _batch_speech_frame(const SpeechCapturePipeline::Frame &p_frame);
+	void _emit_speech_batch();
+
+	void _frame_captured(const SpeechCapturePipeline::Frame &p_frame);
+	static void _print_capture_error(const std::string &p_message);
+
+	// Capture thread
+	bool use_capture_thread = false;
+	std::thread capture_thread;
+	std::atomic<bool> capture_thread_running;
+	std::atomic<bool> capture_active;
+	std::atomic<bool> echo_reference_bound;
+	// Set by start, acted on by whichever thread drains the streams
+	std::atomic<bool> capture_restart_pending;
+
+	void _drain_audio_frames();
+	PoolRealArray _get_audio_frames();
+	PoolRealArray _get_echo_reference_frames();
+	void _capture_thread_func();
+	void _start_capture_thread();
+	void _stop_capture_thread();
+
+	// Batched decoding
+	WorkerPool decode_worker_pool;
+
+	SpeechStats stats;
+
+	static void _decode_batch_task(void *p_userdata, uint32_t p_worker_index, uint32_t p_worker_count);
+	// SpeechOpusCodec::decode_buffer, timed and counted in p_stats
+	static int _decode_buffer(SpeechStats *p_stats, SpeechDecoder *p_speech_decoder, const uint8_t *p_compressed_buffer, int p_compressed_buffer_size, float *p_stereo_output, int p_frame_count);
 public:
 	struct SpeechInput {
-		PoolByteArray *pcm_byte_array = NULL;
+		// Only valid during the speech_processed callback
+		const int16_t *pcm = NULL;
+		// Samples per channel, pcm holds frame_count * channel_count interleaved samples
+		uint32_t frame_count = 0;
+		uint32_t channel_count = DEFAULT_CHANNEL_COUNT;
 		float volume = 0.0;
+		// False when the VAD gated this frame, it should not be encoded
+		bool voice_active = true;
 	};
 
 	struct CompressedSpeechBuffer {
@@ -69,53 +198,157 @@ public:
 		int buffer_size = 0;
 	};
 
+	// Native consumers get every frame here without any Variant being built
 	std::function<void(SpeechInput *)> speech_processed;
 	void register_speech_processed(const std::function<void(SpeechInput *)> &callback)
 	{
 		speech_processed = callback;
 	}
 
-	static void _register_methods();
+	// One of SpeechSignalMode, SPEECH_SIGNAL_PER_FRAME by default
+	void set_speech_signal_mode(int p_mode);
+	int get_speech_signal_mode() const {
+		return speech_signal_mode;
+	}
 
-	uint32_t _resample_audio_buffer(const float *p_src,
-		const uint32_t p_src_frame_count,
-		const uint32_t p_src_samplerate,
-		const uint32_t p_target_samplerate,
-		float *p_dst);
+	static void _register_methods();
 
 	void start();
 	void stop();
 
-	static void _get_capture_block(
-		AudioServer *p_audio_server,
-		const uint32_t &p_mix_frame_count,
-		const float *p_process_buffer_in,
-		float *p_process_buffer_out);
+	// When enabled, capture, resampling and the speech_processed callback
+	// run on a background thread instead of NOTIFICATION_PROCESS.
+	void set_use_capture_thread(bool p_enabled);
+	bool is_using_capture_thread() const {
+		return use_capture_thread;
+	}
 
-	void _mix_audio(const float *p_process_buffer_in);
+	void _mix_audio(const float *p_process_buffer_in, uint32_t p_frame_count);
+
+	// Capture backlog control, see CaptureScheduler
+	void set_capture_latency_target_msec(float p_msec);
+	float get_capture_latency_target_msec();
+	void set_capture_max_latency_msec(float p_msec);
+	float get_capture_max_latency_msec();
+	void set_max_capture_blocks_per_tick(int p_count);
+	int get_max_capture_blocks_per_tick();
+	void set_capture_max_time_compression(float p_fraction);
+	float get_capture_max_time_compression();
+	void set_capture_drift_correction(bool p_enabled);
+	bool is_capture_drift_correction_enabled();
+	float get_capture_backlog_msec();
+	float get_capture_drift_ppm();
+
+	// Instruction set of the conversion kernels picked for this CPU
+	String get_audio_kernel_name();
+
+	// Frame duration in milliseconds, one of 2.5, 5, 10, 20, 40 or 60
+	void set_frame_duration_msec(float p_msec);
+	float get_frame_duration_msec();
+
+	// How many frames GodotSpeech joins into each outgoing packet,
+	// limited to 120 ms of audio per packet
+	void set_frames_per_packet(int p_frames_per_packet);
+	int get_frames_per_packet() const {
+		return frames_per_packet;
+	}
 
-	static bool _16_pcm_mono_to_real_stereo(const PoolByteArray *p_src_buffer, PoolVector2Array *p_dst_buffer);
+	// 1 for mono or 2 for stereo capture. Stereo frames are encoded as one
+	// coupled Opus stream, the decoders handed out from then on are stereo.
+	void set_channel_count(int p_channel_count);
+	int get_channel_count() const {
+		return int(capture_pipeline.get_channel_count());
+	}
 
-	virtual bool compress_buffer_internal(const PoolByteArray *p_pcm_byte_array, CompressedSpeechBuffer *p_output_buffer) {
-		p_output_buffer->buffer_size = opus_codec->encode_buffer(p_pcm_byte_array, p_output_buffer->compressed_byte_array);
+	// Encodes on an Opus stream of its own, safe while the capture thread runs
+	virtual bool compress_buffer_internal(const PoolByteArray *p_pcm_byte_array, const uint32_t p_frame_count, const uint32_t p_channel_count, CompressedSpeechBuffer *p_output_buffer) {
+		SpeechStats::ScopedTimer encode_timer(&stats, SpeechStats::STAGE_ENCODE);
+		p_output_buffer->buffer_size = opus_codec->encode_buffer(p_pcm_byte_array, p_frame_count, p_channel_count, p_output_buffer->compressed_byte_array);
 		if(p_output_buffer->buffer_size != -1) {
+			stats.add(SpeechStats::COUNTER_BYTES_ENCODED, p_output_buffer->buffer_size);
 			return true;
 		}
 
+		stats.add(SpeechStats::COUNTER_ENCODE_FAILURES);
 		return false;
 	}
 
+	// Encodes one captured frame into the processor's scratch space.
+	// *r_packet points at the packet until the next call, *r_flags gets
+	// its VoicePacket flags.
+	// Returns the packet size, or -1 on failure.
+	int encode_frame_internal(const int16_t *p_pcm, const uint32_t p_frame_count, const uint32_t p_channel_count, const uint8_t **r_packet, uint8_t *r_flags) {
+		SpeechStats::ScopedTimer encode_timer(&stats, SpeechStats::STAGE_ENCODE);
+		const int packet_size = opus_codec->encode_frame(p_pcm, p_frame_count, p_channel_count, encoded_packet, MAX_PACKET_SIZE);
+		if (packet_size < 0) {
+			stats.add(SpeechStats::COUNTER_ENCODE_FAILURES);
+			return -1;
+		}
+
+		stats.add(SpeechStats::COUNTER_BYTES_ENCODED, packet_size);
+		*r_packet = encoded_packet;
+
+		// Opus sends DTX frames as the table of contents byte alone, which
+		// tells them apart even without OPUS_GET_IN_DTX
+		uint8_t flags = 0;
+		if (packet_size <= 2 || opus_codec->is_in_dtx()) {
+			flags |= VoicePacket::FLAG_DTX;
+		}
+		if (opus_codec->is_inband_fec_active()) {
+			flags |= VoicePacket::FLAG_FEC;
+		}
+		*r_flags = flags;
+		return packet_size;
+	}
+
+	// Shared with GodotSpeech, which records the queue stage and outgoing packets
+	SpeechStats &get_stats_internal() {
+		return stats;
+	}
+
+	// Returns a snapshot of every counter, and for each stage a Dictionary
+	// of count, total_usec and max_usec, the times fractional.
+	// Cheap enough to poll every second.
+	Dictionary get_stats();
+	void reset_stats();
+
+	// Decodes straight into p_write_vec2_array, resizing it to the packet's
+	// frame count when it differs. Only touches the decoder and the output,
+	// so different decoders may be used from different threads at once.
 	virtual bool decompress_buffer_internal(
 		SpeechDecoder *speech_decoder,
 		const PoolByteArray *p_read_byte_array,
 		const int p_read_size,
-		PoolVector2Array *p_write_vec2_array) {
-		if (opus_codec->decode_buffer(speech_decoder, p_read_byte_array, &pcm_byte_array_cache, p_read_size, PCM_BUFFER_SIZE)) {
-			if(_16_pcm_mono_to_real_stereo(&pcm_byte_array_cache, p_write_vec2_array)) {
-				return true;
-			}
-		}
-		return true;
+		PoolVector2Array *p_write_vec2_array);
+
+	// One packet of a batched decode
+	struct DecodeBatchItem {
+		SpeechDecoder *speech_decoder = NULL;
+		// NULL or a size of 0 conceals a lost packet
+		const uint8_t *compressed_buffer = NULL;
+		int compressed_buffer_size = 0;
+		// Caller owned, room for max_frame_count interleaved stereo frames
+		float *stereo_output = NULL;
+		int max_frame_count = 0;
+		// Set to the decoded frame count, or -1 on failure
+		int frame_count = 0;
+	};
+
+private:
+	std::vector<DecodeBatchItem> decode_batch_items;
+
+	// Frames item p_index decodes to, before any item is decoded
+	static int _get_batch_frame_count(const DecodeBatchItem *p_items, const int p_index);
+
+public:
+	// Decodes every item, spread over the decode threads.
+	// Items sharing a decoder are decoded in order on the same thread.
+	void decompress_buffers_internal(DecodeBatchItem *p_items, const int p_item_count);
+
+	// Threads used by decompress_buffers besides the calling one, 0 decodes on the caller
+	void set_decode_thread_count(int p_thread_count);
+	int get_decode_thread_count() const {
+		return decode_worker_pool.get_thread_count();
 	}
 
 	virtual Dictionary compress_buffer(
@@ -128,6 +361,23 @@ public:
 		const int p_read_size,
 		PoolVector2Array p_write_vec2_array);
 
+	// Decodes many packets in one call. The packets sit back to back in
+	// p_packet_byte_array, packet i starts at p_packet_offsets[i], is
+	// p_packet_sizes[i] bytes long and is decoded with p_speech_decoders[i].
+	// A size of 0 conceals a lost packet, as long as the packet before it for
+	// the same decoder, in this batch or the last one decoded before it.
+	// p_output_buffer must hold "pcm" (PoolVector2Array), "frame_offsets" and
+	// "frame_counts" (PoolIntArray). They are grown when too small and reused
+	// otherwise. Packet i is decoded into pcm from frame_offsets[i], and
+	// frame_counts[i] is its frame count or -1 if it failed. Only the first
+	// "packet_count" entries and "frame_count" frames are valid.
+	virtual Dictionary decompress_buffers(
+		Array p_speech_decoders,
+		const PoolByteArray &p_packet_byte_array,
+		const PoolIntArray &p_packet_offsets,
+		const PoolIntArray &p_packet_sizes,
+		Dictionary p_output_buffer);
+
 	Ref<SpeechDecoder> get_speech_decoder() {
 		if(opus_codec) {
 			return opus_codec->get_speech_decoder();
@@ -136,6 +386,99 @@ public:
 		}
 	}
 
+	// A decoder with p_channel_count channels whatever the capture layout,
+	// e.g. mono for mixing on a relay
+	Ref<SpeechDecoder> get_speech_decoder_internal(int p_channel_count) {
+		if(opus_codec) {
+			return opus_codec->get_speech_decoder(p_channel_count);
+		} else {
+			return NULL;
+		}
+	}
+
+	// Decoders kept preallocated for get_speech_decoder
+	void set_decoder_pool_capacity(int p_capacity);
+	int get_decoder_pool_capacity();
+	// Returns the pool's capacity, in_use, high_water, overflow and unpooled counts
+	Dictionary get_decoder_pool_stats();
+
+	// Encoder tuning, applied before the next packet is encoded
+	void set_bitrate(int p_bitrate);
+	int get_bitrate();
+	void set_vbr(bool p_enabled);
+	bool get_vbr();
+	void set_vbr_constraint(bool p_enabled);
+	bool get_vbr_constraint();
+	void set_complexity(int p_complexity);
+	int get_complexity();
+	void set_dtx(bool p_enabled);
+	bool get_dtx();
+	void set_inband_fec(bool p_enabled);
+	bool get_inband_fec();
+	void set_packet_loss_percentage(int p_percentage);
+	int get_packet_loss_percentage();
+	void set_signal_type(int p_signal_type);
+	int get_signal_type();
+	void set_max_bandwidth(int p_bandwidth);
+	int get_max_bandwidth();
+
+	int64_t get_encoder_final_range();
+	int get_encoder_lookahead();
+
+	// Voice activity gate, silent frames are not encoded when enabled
+	void set_vad_enabled(bool p_enabled);
+	bool is_vad_enabled();
+	void set_vad_threshold(float p_threshold);
+	float get_vad_threshold();
+	void set_vad_attack_msec(float p_msec);
+	float get_vad_attack_msec();
+	void set_vad_release_msec(float p_msec);
+	float get_vad_release_msec();
+	void set_vad_hangover_msec(float p_msec);
+	float get_vad_hangover_msec();
+	// Lets the Opus DTX analysis close the gate, needs DTX enabled
+	void set_vad_use_opus_analysis(bool p_enabled);
+	bool is_vad_using_opus_analysis();
+	bool is_talking();
+
+	// Noise suppression, AGC and limiter run on each frame before it is
+	// encoded, all disabled by default. Noise suppression only runs on mono
+	// frames and delays them by SpeechEnhancer::FFT_SIZE samples.
+	void set_noise_suppression_enabled(bool p_enabled);
+	bool is_noise_suppression_enabled();
+	void set_noise_suppression_db(float p_db);
+	float get_noise_suppression_db();
+	void set_agc_enabled(bool p_enabled);
+	bool is_agc_enabled();
+	void set_agc_target_dbfs(float p_dbfs);
+	float get_agc_target_dbfs();
+	void set_agc_max_gain_db(float p_db);
+	float get_agc_max_gain_db();
+	void set_limiter_enabled(bool p_enabled);
+	bool is_limiter_enabled();
+	void set_limiter_ceiling_dbfs(float p_dbfs);
+	float get_limiter_ceiling_dbfs();
+
+	// Echo cancellation subtracts what the game plays on the echo reference
+	// bus from the capture, disabled by default. The bus needs an
+	// AudioEffectStream and must not carry the capture itself. Only runs
+	// on mono capture and delays it by EchoCanceller::BLOCK_SIZE frames.
+	void set_echo_cancellation_enabled(bool p_enabled);
+	bool is_echo_cancellation_enabled();
+	void set_echo_reference_bus(const String &p_name);
+	String get_echo_reference_bus();
+	// Estimated delay of the echo, -1 until found
+	float get_echo_delay_msec();
+	// How much echo is removed while the reference plays
+	float get_echo_erle_db();
+
+	// One of ResamplerQuality, used when the mix rate is not VOICE_SAMPLE_RATE.
+	// The polyphase resampler cannot time-compress or correct drift, so
+	// with it backlog beyond the latency target is only shed by dropping
+	// blocks at the max latency.
+	void set_resampler_quality(int p_quality);
+	int get_resampler_quality();
+
 	void set_streaming_bus(const String &p_name);
 
 	void set_audio_input_stream_player(AudioStreamPlayer *p_audio_input_stream_player);
@@ -0,0 +1,340 @@
+#include "voice_mixer.hpp"
+
+#include <algorithm>
+
+using namespace godot;
+
+void VoiceMixer::_register_methods() {
+	register_method("_init", &VoiceMixer::_init);
+
+	register_method("add_peer", &VoiceMixer::add_peer);
+	register_method("remove_peer", &VoiceMixer::remove_peer);
+	register_method("has_peer", &VoiceMixer::has_peer);
+	register_method("get_peer_count", &VoiceMixer::get_peer_count);
+
+	register_method("set_peer_volume", &VoiceMixer::set_peer_volume);
+	register_method("get_peer_jitter_stats", &VoiceMixer::get_peer_jitter_stats);
+
+	register_method("push_packet", &VoiceMixer::push_packet);
+	register_method("push_packet_with_loudness", &VoiceMixer::push_packet_with_loudness);
+	register_method("push_wire_packets", &VoiceMixer::push_wire_packets);
+
+	register_method("set_max_active_speakers", &VoiceMixer::set_max_active_speakers);
+	register_method("get_max_active_speakers", &VoiceMixer::get_max_active_speakers);
+	register_method("set_speaker_switch_margin", &VoiceMixer::set_speaker_switch_margin);
+	register_method("get_speaker_switch_margin", &VoiceMixer::get_speaker_switch_margin);
+	register_method("set_speaker_hold_msec", &VoiceMixer::set_speaker_hold_msec);
+	register_method("get_speaker_hold_msec", &VoiceMixer::get_speaker_hold_msec);
+	register_method("is_speaker_active", &VoiceMixer::is_speaker_active);
+	register_method("get_active_speakers", &VoiceMixer::get_active_speakers);
+	register_method("mix", &VoiceMixer::mix);
+
+	register_method("clear_all_player_audio", &VoiceMixer::clear_all_player_audio);
+}
+
+VoiceMixer::PeerVoice *VoiceMixer::_find_peer(int p_peer_id) {
+	for (size_t i = 0; i < peer_voices.size(); i++) {
+		if (peer_voices[i].peer_id == p_peer_id) {
+			return &peer_voices[i];
+		}
+	}
+	return NULL;
+}
+
+bool VoiceMixer::add_peer(int p_peer_id) {
+	if (_find_peer(p_peer_id)) {
+		return true;
+	}
+
+	if (!speech_decoder_factory) {
+		Godot::print_error("VoiceMixer: no speech decoder factory registered!", __FUNCTION__, __FILE__, __LINE__);
+		return false;
+	}
+
+	Ref<SpeechDecoder> speech_decoder = speech_decoder_factory();
+	if (speech_decoder.is_null()) {
+		return false;
+	}
+
+	// All per-peer buffers are allocated here, once, when the peer joins
+	peer_voices.push_back(PeerVoice());
+	PeerVoice &peer_voice = peer_voices.back();
+	peer_voice.peer_id = p_peer_id;
+	peer_voice.speech_decoder = speech_decoder;
+	peer_voice.jitter_buffer.resize(
+			PEER_JITTER_BUFFER_SIZE,
+			SpeechProcessor::MAX_PACKET_SIZE,
+			SpeechProcessor::DEFAULT_BUFFER_FRAME_COUNT,
+			SpeechProcessor::VOICE_SAMPLE_RATE);
+	peer_voice.channel_count = std::min(std::max(speech_decoder->get_channel_count(), 1), 2);
+	peer_voice.pcm_buffer.resize(SpeechProcessor::MAX_BUFFER_FRAME_COUNT * peer_voice.channel_count);
+	peer_voice.active = speaker_selector.get_max_active_count() == 0;
+	speaker_selector.add_speaker(p_peer_id);
+
+	return true;
+}
+
+void VoiceMixer::remove_peer(int p_peer_id) {
+	for (size_t i = 0; i < peer_voices.size(); i++) {
+		if (peer_voices[i].peer_id == p_peer_id) {
+			peer_voices.erase(peer_voices.begin() + i);
+			speaker_selector.remove_speaker(p_peer_id);
+			return;
+		}
+	}
+}
+
+bool VoiceMixer::has_peer(int p_peer_id) {
+	return _find_peer(p_peer_id) != NULL;
+}
+
+int VoiceMixer::get_peer_count() const {
+	return peer_voices.size();
+}
+
+void VoiceMixer::set_peer_volume(int p_peer_id, float p_volume) {
+	PeerVoice *peer_voice = _find_peer(p_peer_id);
+	if (peer_voice) {
+		peer_voice->volume = p_volume;
+	}
+}
+
+Dictionary VoiceMixer::get_peer_jitter_stats(int p_peer_id) {
+	Dictionary stats;
+
+	PeerVoice *peer_voice = _find_peer(p_peer_id);
+	if (peer_voice) {
+		const JitterBuffer &jitter_buffer = peer_voice->jitter_buffer;
+		stats["late"] = jitter_buffer.get_late_packets();
+		stats["lost"] = jitter_buffer.get_lost_packets();
+		stats["concealed"] = jitter_buffer.get_concealed_packets();
+		stats["recovered"] = jitter_buffer.get_recovered_packets();
+		stats["dropped"] = jitter_buffer.get_dropped_packets();
+		stats["buffered"] = jitter_buffer.get_buffered_count();
+		stats["target_delay"] = jitter_buffer.get_target_delay();
+		stats["jitter_msec"] = jitter_buffer.get_jitter_msec();
+	}
+
+	return stats;
+}
+
+bool VoiceMixer::push_packet(int p_peer_id, const PoolByteArray &p_byte_array, int p_buffer_size, int64_t p_sequence, int64_t p_timestamp) {
+	return push_packet_with_loudness(p_peer_id, p_byte_array, p_buffer_size, p_sequence, p_timestamp, 1.0);
+}
+
+bool VoiceMixer::push_packet_with_loudness(int p_peer_id, const PoolByteArray &p_byte_array, int p_buffer_size, int64_t p_sequence, int64_t p_timestamp, float p_loudness) {
+	if (p_buffer_size < 0 || p_buffer_size > int(SpeechProcessor::MAX_PACKET_SIZE) || p_byte_array.size() < p_buffer_size) {
+		Godot::print_error("VoiceMixer: invalid packet size!", __FUNCTION__, __FILE__, __LINE__);
+		return false;
+	}
+
+	if (!add_peer(p_peer_id)) {
+		return false;
+	}
+	PeerVoice *peer_voice = _find_peer(p_peer_id);
+	speaker_selector.push_loudness(p_peer_id, p_loudness);
+
+	// Inactive peers are still buffered, so a newly selected one starts
+	// with the packets of the current block
+	return peer_voice->jitter_buffer.push(
+			static_cast<uint32_t>(p_sequence),
+			static_cast<uint32_t>(p_timestamp),
+			p_byte_array.read().ptr(),
+			p_buffer_size);
+}
+
+int VoiceMixer::push_wire_packets(int p_peer_id, PoolByteArray p_wire_byte_array) {
+	if (!add_peer(p_peer_id)) {
+		return -1;
+	}
+	PeerVoice *peer_voice = _find_peer(p_peer_id);
+
+	PoolByteArray::Read read = p_wire_byte_array.read();
+	VoicePacketReader reader(read.ptr(), p_wire_byte_array.size());
+	VoicePacketReader::Frame frame;
+	int frame_count = 0;
+	while (reader.next_frame(&frame)) {
+		if (frame.size > int(SpeechProcessor::MAX_PACKET_SIZE)) {
+			Godot::print_error("VoiceMixer: invalid packet size!", __FUNCTION__, __FILE__, __LINE__);
+			continue;
+		}
+		speaker_selector.push_loudness(p_peer_id, frame.loudness);
+		if (peer_voice->jitter_buffer.push(frame.sequence, frame.timestamp, frame.data, frame.size)) {
+			frame_count++;
+		}
+	}
+
+	if (reader.has_error()) {
+		Godot::print_error("VoiceMixer: malformed wire packet!", __FUNCTION__, __FILE__, __LINE__);
+		return -1;
+	}
+	return frame_count;
+}
+
+bool VoiceMixer::_decode_next_packet(PeerVoice *p_peer_voice) {
+	const uint8_t *packet_data = NULL;
+	int packet_size = 0;
+	const JitterBuffer::PlayoutAction playout_action = p_peer_voice->jitter_buffer.pop(&packet_data, &packet_size);
+	if (playout_action == JitterBuffer::PLAYOUT_NONE) {
+		return false;
+	}
+
+	p_peer_voice->pcm_frame_offset = 0;
+	p_peer_voice->pcm_frame_count = 0;
+
+	// PLC decodes from a NULL payload, FEC decodes the lost frame from the next packet.
+	// Both must be told the duration of the missing packet, which is assumed
+	// to match the last one received.
+	const bool concealing = playout_action != JitterBuffer::PLAYOUT_PACKET;
+	const int decoded_frame_count = p_peer_voice->speech_decoder->decode_float(
+			playout_action == JitterBuffer::PLAYOUT_PLC ? NULL : packet_data,
+			packet_size,
+			p_peer_voice->pcm_buffer.data(),
+			concealing ? p_peer_voice->last_packet_frame_count : SpeechProcessor::MAX_BUFFER_FRAME_COUNT,
+			playout_action == JitterBuffer::PLAYOUT_FEC ? 1 : 0);
+	if (decoded_frame_count > 0) {
+		p_peer_voice->pcm_frame_count = decoded_frame_count;
+		if (!concealing && decoded_frame_count != int(p_peer_voice->last_packet_frame_count)) {
+			p_peer_voice->last_packet_frame_count = decoded_frame_count;
+			p_peer_voice->jitter_buffer.set_frames_per_packet(decoded_frame_count);
+		}
+	}
+
+	return true;
+}
+
+void VoiceMixer::_mix_peer(PeerVoice *p_peer_voice, Vector2 *p_output, int p_frame_count) {
+	int frames_mixed = 0;
+	while (frames_mixed < p_frame_count) {
+		if (p_peer_voice->pcm_frame_offset >= p_peer_voice->pcm_frame_count) {
+			// Underrun, the rest of this block stays silent for this peer
+			if (!_decode_next_packet(p_peer_voice)) {
+				return;
+			}
+			continue;
+		}
+
+		const float *pcm_ptr = p_peer_voice->pcm_buffer.data() + p_peer_voice->pcm_frame_offset * p_peer_voice->channel_count;
+		const int frame_count = std::min<int>(p_frame_count - frames_mixed, p_peer_voice->pcm_frame_count - p_peer_voice->pcm_frame_offset);
+		const float volume = p_peer_voice->volume;
+
+		Vector2 *output_ptr = p_output + frames_mixed;
+		if (p_peer_voice->channel_count == 2) {
+			for (int i = 0; i < frame_count; i++) {
+				output_ptr[i].x += pcm_ptr[i * 2] * volume;
+				output_ptr[i].y += pcm_ptr[i * 2 + 1] * volume;
+			}
+		} else {
+			for (int i = 0; i < frame_count; i++) {
+				const float value = pcm_ptr[i] * volume;
+				output_ptr[i].x += value;
+				output_ptr[i].y += value;
+			}
+		}
+
+		frames_mixed += frame_count;
+		p_peer_voice->pcm_frame_offset += frame_count;
+	}
+}
+
+PoolVector2Array VoiceMixer::mix(int p_frame_count) {
+	if (p_frame_count <= 0) {
+		return PoolVector2Array();
+	}
+
+	// Only reallocates when the block size changes.
+	// The returned array shares this buffer, so callers should release it
+	// before the next mix to avoid a copy-on-write.
+	if (mix_output_array.size() != p_frame_count) {
+		mix_output_array.resize(p_frame_count);
+	}
+
+	Vector2 *output_ptr = mix_output_array.write().ptr();
+	for (int i = 0; i < p_frame_count; i++) {
+		output_ptr[i] = Vector2();
+	}
+
+	speaker_selector.update(p_frame_count);
+	const bool select_speakers = speaker_selector.get_max_active_count() > 0;
+
+	for (size_t i = 0; i < peer_voices.size(); i++) {
+		PeerVoice &peer_voice = peer_voices[i];
+		const bool active = !select_speakers || speaker_selector.is_active(peer_voice.peer_id);
+		if (active != peer_voice.active) {
+			peer_voice.active = active;
+			peer_voice.pcm_frame_offset = 0;
+			peer_voice.pcm_frame_count = 0;
+		}
+		if (!active) {
+			// Not decoded. Flushed on every mix, so once selected it starts from
+			// the packets that arrived since the last mix
+			peer_voice.jitter_buffer.flush();
+			continue;
+		}
+		_mix_peer(&peer_voice, output_ptr, p_frame_count);
+	}
+
+	return mix_output_array;
+}
+
+void VoiceMixer::set_max_active_speakers(int p_count) {
+	if (p_count < 0) {
+		Godot::print_error("VoiceMixer: max active speakers must not be negative!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	speaker_selector.set_max_active_count(p_count);
+}
+
+int VoiceMixer::get_max_active_speakers() const {
+	return speaker_selector.get_max_active_count();
+}
+
+void VoiceMixer::set_speaker_switch_margin(float p_margin) {
+	speaker_selector.set_switch_margin(p_margin);
+}
+
+float VoiceMixer::get_speaker_switch_margin() const {
+	return speaker_selector.get_switch_margin();
+}
+
+void VoiceMixer::set_speaker_hold_msec(float p_msec) {
+	speaker_selector.set_hold_msec(p_msec);
+}
+
+float VoiceMixer::get_speaker_hold_msec() const {
+	return speaker_selector.get_hold_msec();
+}
+
+bool VoiceMixer::is_speaker_active(int p_peer_id) {
+	PeerVoice *peer_voice = _find_peer(p_peer_id);
+	return peer_voice && peer_voice->active;
+}
+
+PoolIntArray VoiceMixer::get_active_speakers() {
+	PoolIntArray active_speakers;
+	for (size_t i = 0; i < peer_voices.size(); i++) {
+		if (peer_voices[i].active) {
+			active_speakers.append(peer_voices[i].peer_id);
+		}
+	}
+	return active_speakers;
+}
+
+void VoiceMixer::clear_all_player_audio() {
+	for (size_t i = 0; i < peer_voices.size(); i++) {
+		PeerVoice &peer_voice = peer_voices[i];
+		peer_voice.jitter_buffer.flush();
+		peer_voice.pcm_frame_offset = 0;
+		peer_voice.pcm_frame_count = 0;
+	}
+}
+
+void VoiceMixer::_init() {
+}
+
+VoiceMixer::VoiceMixer() {
+	speaker_selector.set_sample_rate(SpeechProcessor::VOICE_SAMPLE_RATE);
+}
+
+VoiceMixer::~VoiceMixer() {
+}
@@ -0,0 +1,117 @@
+#ifndef VOICE_MIXER_HPP
+#define VOICE_MIXER_HPP
+
+#include <Godot.hpp>
+#include <Dictionary.hpp>
+#include <Reference.hpp>
+
+#include <functional>
+#include <vector>
+
+#include "core/jitter_buffer.hpp"
+#include "core/speaker_selector.hpp"
+#include "core/voice_packet.hpp"
+#include "speech_decoder.hpp"
+#include "speech_processor.hpp"
+
+namespace godot {
+
+// Decodes and mixes the voice packets of every remote peer into a single
+// stereo block. Owns one SpeechDecoder and one preallocated JitterBuffer
+// per peer, so adding packets and mixing never allocates.
+// With set_max_active_speakers, only the loudest peers by packet loudness
+// are decoded and played, bounding decode work however many peers talk.
+// Not thread-safe, push_packet and mix must be called from the same thread.
+class VoiceMixer : public Reference {
+	GODOT_CLASS(VoiceMixer, Reference)
+public:
+	static const int PEER_JITTER_BUFFER_SIZE = 32;
+
+private:
+	struct PeerVoice {
+		int peer_id = -1;
+		float volume = 1.0;
+		Ref<SpeechDecoder> speech_decoder;
+
+		// Compressed packets waiting to be decoded, in sequence order
+		JitterBuffer jitter_buffer;
+
+		// The most recently decoded frame, as mono or interleaved stereo
+		// floats as the decoder gives them, and how much of it has been mixed
+		std::vector<float> pcm_buffer;
+		int channel_count = 1;
+		uint32_t pcm_frame_offset = 0;
+		uint32_t pcm_frame_count = 0;
+
+		// Duration of the last received packet, used to size concealment
+		uint32_t last_packet_frame_count = SpeechProcessor::DEFAULT_BUFFER_FRAME_COUNT;
+
+		// Whether the speaker selector let this peer through on the last mix
+		bool active = true;
+	};
+
+	std::vector<PeerVoice> peer_voices;
+	SpeakerSelector speaker_selector;
+	std::function<Ref<SpeechDecoder>()> speech_decoder_factory;
+
+	PoolVector2Array mix_output_array;
+
+	PeerVoice *_find_peer(int p_peer_id);
+	bool _decode_next_packet(PeerVoice *p_peer_voice);
+	void _mix_peer(PeerVoice *p_peer_voice, Vector2 *p_output, int p_frame_count);
+
+public:
+	static void _register_methods();
+
+	// Called whenever a peer needs a new decoder
+	void register_speech_decoder_factory(const std::function<Ref<SpeechDecoder>()> &p_factory) {
+		speech_decoder_factory = p_factory;
+	}
+
+	bool add_peer(int p_peer_id);
+	void remove_peer(int p_peer_id);
+	bool has_peer(int p_peer_id);
+	int get_peer_count() const;
+
+	void set_peer_volume(int p_peer_id, float p_volume);
+
+	// Returns the peer's jitter buffer counters and current playout delay
+	Dictionary get_peer_jitter_stats(int p_peer_id);
+
+	// Queues a compressed packet for the given peer, adding the peer if needed.
+	// p_sequence and p_timestamp are the values GodotSpeech attached on the sender.
+	// Without a loudness the packet counts as loud for speaker selection.
+	bool push_packet(int p_peer_id, const PoolByteArray &p_byte_array, int p_buffer_size, int64_t p_sequence, int64_t p_timestamp);
+	bool push_packet_with_loudness(int p_peer_id, const PoolByteArray &p_byte_array, int p_buffer_size, int64_t p_sequence, int64_t p_timestamp, float p_loudness);
+	// Queues every frame of a buffer from GodotSpeech::copy_and_clear_buffers_wire,
+	// read in place. Returns the number of frames queued, or -1 if the
+	// buffer is malformed, in which case the frames before the error are kept.
+	int push_wire_packets(int p_peer_id, PoolByteArray p_wire_byte_array);
+
+	// Peers decoded and played at most, the loudest win. 0 plays everyone.
+	void set_max_active_speakers(int p_count);
+	int get_max_active_speakers() const;
+	// How much louder, as a fraction, a peer must be to replace an active one
+	void set_speaker_switch_margin(float p_margin);
+	float get_speaker_switch_margin() const;
+	// Shortest time a peer stays active once selected
+	void set_speaker_hold_msec(float p_msec);
+	float get_speaker_hold_msec() const;
+	bool is_speaker_active(int p_peer_id);
+	PoolIntArray get_active_speakers();
+
+	// Decodes as many packets as needed and mixes every peer into one block
+	// of p_frame_count stereo frames. Peers without pending audio are silent.
+	PoolVector2Array mix(int p_frame_count);
+
+	void clear_all_player_audio();
+
+	void _init();
+
+	VoiceMixer();
+	~VoiceMixer();
+};
+
+}; // namespace godot
+
+#endif // VOICE_MIXER_HPP
@@ -0,0 +1,402 @@
+#include "voice_relay.hpp"
+#include "core/audio_kernels.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+using namespace godot;
+
+void VoiceRelay::_register_methods() {
+	register_method("_init", &VoiceRelay::_init);
+
+	register_method("add_peer", &VoiceRelay::add_peer);
+	register_method("remove_peer", &VoiceRelay::remove_peer);
+	register_method("has_peer", &VoiceRelay::has_peer);
+	register_method("get_peer_count", &VoiceRelay::get_peer_count);
+
+	register_method("set_peer_position", &VoiceRelay::set_peer_position);
+	register_method("get_peer_position", &VoiceRelay::get_peer_position);
+
+	register_method("set_max_forwarded_speakers", &VoiceRelay::set_max_forwarded_speakers);
+	register_method("get_max_forwarded_speakers", &VoiceRelay::get_max_forwarded_speakers);
+	register_method("set_max_distance", &VoiceRelay::set_max_distance);
+	register_method("get_max_distance", &VoiceRelay::get_max_distance);
+
+	register_method("set_mix_enabled", &VoiceRelay::set_mix_enabled);
+	register_method("is_mix_enabled", &VoiceRelay::is_mix_enabled);
+	register_method("set_max_mix_peers", &VoiceRelay::set_max_mix_peers);
+	register_method("get_max_mix_peers", &VoiceRelay::get_max_mix_peers);
+	register_method("set_mix_bitrate", &VoiceRelay::set_mix_bitrate);
+	register_method("get_mix_bitrate", &VoiceRelay::get_mix_bitrate);
+	register_method("is_mixing", &VoiceRelay::is_mixing);
+
+	register_method("push_packet", &VoiceRelay::push_packet);
+	register_method("process", &VoiceRelay::process);
+}
+
+static void print_relay_encoder_error(const std::string &p_message) {
+	Godot::print_error(String("VoiceRelay: ") + String(p_message.c_str()), __FUNCTION__, __FILE__, __LINE__);
+}
+
+VoiceRelay::RelayPeer *VoiceRelay::_find_peer(int p_peer_id) {
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		if (relay_peers[i].peer_id == p_peer_id) {
+			return &relay_peers[i];
+		}
+	}
+	return NULL;
+}
+
+bool VoiceRelay::add_peer(int p_peer_id) {
+	if (p_peer_id == MIXED_SPEAKER_ID) {
+		Godot::print_error("VoiceRelay: peer id is reserved for mixed packets!", __FUNCTION__, __FILE__, __LINE__);
+		return false;
+	}
+	if (_find_peer(p_peer_id)) {
+		return true;
+	}
+
+	relay_peers.push_back(RelayPeer());
+	RelayPeer &relay_peer = relay_peers.back();
+	relay_peer.peer_id = p_peer_id;
+	relay_peer.packets.resize(MAX_QUEUED_PACKETS);
+
+	candidates.reserve(relay_peers.size());
+
+	return true;
+}
+
+void VoiceRelay::remove_peer(int p_peer_id) {
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		if (relay_peers[i].peer_id == p_peer_id) {
+			relay_peers.erase(relay_peers.begin() + i);
+			return;
+		}
+	}
+}
+
+bool VoiceRelay::has_peer(int p_peer_id) {
+	return _find_peer(p_peer_id) != NULL;
+}
+
+int VoiceRelay::get_peer_count() const {
+	return relay_peers.size();
+}
+
+void VoiceRelay::set_peer_position(int p_peer_id, Vector3 p_position) {
+	RelayPeer *relay_peer = _find_peer(p_peer_id);
+	if (relay_peer) {
+		relay_peer->position = p_position;
+	}
+}
+
+Vector3 VoiceRelay::get_peer_position(int p_peer_id) {
+	RelayPeer *relay_peer = _find_peer(p_peer_id);
+	if (relay_peer) {
+		return relay_peer->position;
+	}
+	return Vector3();
+}
+
+void VoiceRelay::set_max_forwarded_speakers(int p_count) {
+	if (p_count < 1) {
+		Godot::print_error("VoiceRelay: max forwarded speakers must be at least 1!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	max_forwarded_speakers = p_count;
+}
+
+void VoiceRelay::set_max_distance(float p_distance) {
+	max_distance = std::max(0.0f, p_distance);
+}
+
+void VoiceRelay::set_mix_enabled(bool p_enabled) {
+	mix_enabled = p_enabled;
+}
+
+void VoiceRelay::set_max_mix_peers(int p_count) {
+	if (p_count < 2) {
+		Godot::print_error("VoiceRelay: max mix peers must be at least 2!", __FUNCTION__, __FILE__, __LINE__);
+		return;
+	}
+	max_mix_peers = p_count;
+}
+
+void VoiceRelay::set_mix_bitrate(int p_bitrate) {
+	mix_bitrate = p_bitrate > 0 ? p_bitrate : OPUS_AUTO;
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		OpusSpeechEncoder *mix_encoder = relay_peers[i].mix_encoder.get();
+		if (mix_encoder) {
+			OpusSpeechEncoder::Settings settings = mix_encoder->get_settings();
+			settings.bitrate = mix_bitrate;
+			mix_encoder->set_settings(settings);
+		}
+	}
+}
+
+bool VoiceRelay::is_mixing() {
+	return mix_enabled && int(relay_peers.size()) <= max_mix_peers;
+}
+
+bool VoiceRelay::push_packet(int p_peer_id, const PoolByteArray &p_byte_array, int p_buffer_size, float p_loudness, int64_t p_sequence, int64_t p_timestamp) {
+	if (p_buffer_size <= 0 || p_buffer_size > int(SpeechProcessor::MAX_PACKET_SIZE) || p_byte_array.size() < p_buffer_size) {
+		Godot::print_error("VoiceRelay: invalid packet size!", __FUNCTION__, __FILE__, __LINE__);
+		return false;
+	}
+
+	if (!add_peer(p_peer_id)) {
+		return false;
+	}
+	RelayPeer *relay_peer = _find_peer(p_peer_id);
+
+	// Drop the oldest packet if process has not been called for a while
+	if (relay_peer->packet_count == MAX_QUEUED_PACKETS) {
+		std::rotate(relay_peer->packets.begin(), relay_peer->packets.begin() + 1, relay_peer->packets.end());
+		relay_peer->packet_count--;
+	}
+
+	QueuedPacket &packet = relay_peer->packets[relay_peer->packet_count];
+	packet.byte_array = p_byte_array;
+	packet.buffer_size = p_buffer_size;
+	packet.loudness = p_loudness;
+	packet.sequence = p_sequence;
+	packet.timestamp = p_timestamp;
+
+	relay_peer->loudness = relay_peer->packet_count == 0 ? p_loudness : std::max(relay_peer->loudness, p_loudness);
+	relay_peer->packet_count++;
+
+	return true;
+}
+
+int VoiceRelay::_select_speakers(int p_listener_index) {
+	const bool mixing = is_mixing();
+	const RelayPeer &listener = relay_peers[p_listener_index];
+
+	candidates.clear();
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		const RelayPeer &speaker = relay_peers[i];
+		if (int(i) == p_listener_index) {
+			continue;
+		}
+		const bool has_audio = mixing ? speaker.pcm_frame_count > 0 : speaker.packet_count > 0;
+		if (!has_audio) {
+			continue;
+		}
+
+		// Linear falloff to silence at max_distance
+		float gain = 1.0;
+		if (max_distance > 0.0) {
+			const float distance = listener.position.distance_to(speaker.position);
+			if (distance >= max_distance) {
+				continue;
+			}
+			gain = 1.0 - distance / max_distance;
+		}
+
+		Candidate candidate;
+		candidate.peer_index = i;
+		candidate.gain = gain;
+		candidate.score = speaker.loudness * gain;
+		candidates.push_back(candidate);
+	}
+
+	const int selected_count = std::min(int(candidates.size()), max_forwarded_speakers);
+	std::partial_sort(candidates.begin(), candidates.begin() + selected_count, candidates.end(),
+			[](const Candidate &p_a, const Candidate &p_b) { return p_a.score > p_b.score; });
+	return selected_count;
+}
+
+bool VoiceRelay::_prepare_mixing(RelayPeer *p_relay_peer) {
+	if (p_relay_peer->speech_decoder.is_null()) {
+		if (!speech_decoder_factory) {
+			Godot::print_error("VoiceRelay: no speech decoder factory registered!", __FUNCTION__, __FILE__, __LINE__);
+			return false;
+		}
+		p_relay_peer->speech_decoder = speech_decoder_factory();
+		if (p_relay_peer->speech_decoder.is_null()) {
+			return false;
+		}
+		p_relay_peer->pcm_buffer.resize(MIX_BUFFER_FRAME_COUNT);
+		p_relay_peer->pcm_frame_count = 0;
+	}
+
+	if (!p_relay_peer->mix_encoder) {
+		p_relay_peer->mix_encoder.reset(new OpusSpeechEncoder());
+		p_relay_peer->mix_encoder->set_error_handler(&print_relay_encoder_error);
+		OpusSpeechEncoder::Settings settings;
+		settings.bitrate = mix_bitrate;
+		settings.signal = OPUS_SIGNAL_VOICE;
+		// Mixed streams carry silence while nobody nearby talks
+		settings.dtx = true;
+		p_relay_peer->mix_encoder->set_settings(settings);
+		if (p_relay_peer->mix_encoder->init(SpeechProcessor::VOICE_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP) != OPUS_OK) {
+			Godot::print_error("VoiceRelay: could not create mix encoder!", __FUNCTION__, __FILE__, __LINE__);
+			p_relay_peer->mix_encoder.reset();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void VoiceRelay::_decode_packets(RelayPeer *p_relay_peer) {
+	for (int i = 0; i < p_relay_peer->packet_count; i++) {
+		const QueuedPacket &packet = p_relay_peer->packets[i];
+
+		// Keep room for the longest packet, dropping the oldest audio if mixing has fallen behind
+		const uint32_t free_frame_count = MIX_BUFFER_FRAME_COUNT - p_relay_peer->pcm_frame_count;
+		if (free_frame_count < SpeechProcessor::MAX_BUFFER_FRAME_COUNT) {
+			const uint32_t dropped_frame_count = SpeechProcessor::MAX_BUFFER_FRAME_COUNT - free_frame_count;
+			p_relay_peer->pcm_frame_count -= dropped_frame_count;
+			memmove(p_relay_peer->pcm_buffer.data(), p_relay_peer->pcm_buffer.data() + dropped_frame_count, p_relay_peer->pcm_frame_count * sizeof(float));
+		}
+
+		const int frame_count = p_relay_peer->speech_decoder->decode_float(
+				packet.byte_array.read().ptr(),
+				packet.buffer_size,
+				p_relay_peer->pcm_buffer.data() + p_relay_peer->pcm_frame_count,
+				SpeechProcessor::MAX_BUFFER_FRAME_COUNT);
+		if (frame_count > 0) {
+			p_relay_peer->pcm_frame_count += frame_count;
+		}
+	}
+}
+
+uint32_t VoiceRelay::_get_mix_frame_count() {
+	// Mix as much as the speaker furthest ahead has, the others are padded with silence
+	uint32_t frame_count = 0;
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		frame_count = std::max(frame_count, relay_peers[i].pcm_frame_count);
+	}
+	return frame_count - frame_count % MIX_FRAME_COUNT;
+}
+
+void VoiceRelay::_forward_packets(int p_candidate_count, Array &r_packets) {
+	for (int i = 0; i < p_candidate_count; i++) {
+		const RelayPeer &speaker = relay_peers[candidates[i].peer_index];
+		for (int j = 0; j < speaker.packet_count; j++) {
+			const QueuedPacket &packet = speaker.packets[j];
+
+			Dictionary dict;
+			dict["speaker_id"] = speaker.peer_id;
+			dict["byte_array"] = packet.byte_array;
+			dict["buffer_size"] = packet.buffer_size;
+			dict["loudness"] = packet.loudness;
+			dict["sequence"] = packet.sequence;
+			dict["timestamp"] = packet.timestamp;
+
+			r_packets.append(dict);
+		}
+	}
+}
+
+void VoiceRelay::_mix_packets(int p_listener_index, int p_candidate_count, uint32_t p_frame_count, Array &r_packets) {
+	RelayPeer &listener = relay_peers[p_listener_index];
+	if (!listener.mix_encoder) {
+		return;
+	}
+
+	const AudioKernels &audio_kernels = get_audio_kernels();
+	for (uint32_t offset = 0; offset < p_frame_count; offset += MIX_FRAME_COUNT) {
+		std::fill(mix_buffer.begin(), mix_buffer.end(), 0.0f);
+		for (int i = 0; i < p_candidate_count; i++) {
+			const RelayPeer &speaker = relay_peers[candidates[i].peer_index];
+			if (offset >= speaker.pcm_frame_count) {
+				continue;
+			}
+			const float *pcm_ptr = speaker.pcm_buffer.data() + offset;
+			const uint32_t frame_count = std::min(MIX_FRAME_COUNT, speaker.pcm_frame_count - offset);
+			const float gain = candidates[i].gain;
+			for (uint32_t k = 0; k < frame_count; k++) {
+				mix_buffer[k] += pcm_ptr[k] * gain;
+			}
+		}
+
+		const float sum = audio_kernels.float_to_int16(mix_buffer.data(), mix_pcm.data(), MIX_FRAME_COUNT);
+		const int packet_size = listener.mix_encoder->encode(mix_pcm.data(), MIX_FRAME_COUNT, mix_packet.data(), mix_packet.size());
+
+		const uint32_t timestamp = listener.mix_timestamp;
+		listener.mix_timestamp += MIX_FRAME_COUNT;
+		if (packet_size <= 0) {
+			continue;
+		}
+
+		PoolByteArray byte_array;
+		byte_array.resize(packet_size);
+		memcpy(byte_array.write().ptr(), mix_packet.data(), packet_size);
+
+		Dictionary dict;
+		dict["speaker_id"] = MIXED_SPEAKER_ID;
+		dict["byte_array"] = byte_array;
+		dict["buffer_size"] = packet_size;
+		dict["loudness"] = sum / float(MIX_FRAME_COUNT);
+		dict["sequence"] = int64_t(listener.mix_sequence++);
+		dict["timestamp"] = int64_t(timestamp);
+
+		r_packets.append(dict);
+	}
+}
+
+Dictionary VoiceRelay::process() {
+	Dictionary output;
+
+	const bool mixing = is_mixing();
+	uint32_t mix_frame_count = 0;
+	if (mixing) {
+		for (size_t i = 0; i < relay_peers.size(); i++) {
+			RelayPeer &relay_peer = relay_peers[i];
+			if (_prepare_mixing(&relay_peer)) {
+				_decode_packets(&relay_peer);
+			}
+		}
+		mix_frame_count = _get_mix_frame_count();
+	}
+
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		const int candidate_count = _select_speakers(i);
+		if (candidate_count == 0 && !(mixing && mix_frame_count > 0)) {
+			continue;
+		}
+
+		Array packets;
+		if (mixing) {
+			_mix_packets(i, candidate_count, mix_frame_count, packets);
+		} else {
+			_forward_packets(candidate_count, packets);
+		}
+		if (packets.size() > 0) {
+			output[relay_peers[i].peer_id] = packets;
+		}
+	}
+
+	for (size_t i = 0; i < relay_peers.size(); i++) {
+		RelayPeer &relay_peer = relay_peers[i];
+		for (int j = 0; j < relay_peer.packet_count; j++) {
+			// Release the shared byte arrays so senders can reuse theirs without a copy
+			relay_peer.packets[j].byte_array = PoolByteArray();
+		}
+		relay_peer.packet_count = 0;
+
+		if (mixing) {
+			const uint32_t consumed_frame_count = std::min(mix_frame_count, relay_peer.pcm_frame_count);
+			relay_peer.pcm_frame_count -= consumed_frame_count;
+			if (relay_peer.pcm_frame_count > 0) {
+				memmove(relay_peer.pcm_buffer.data(), relay_peer.pcm_buffer.data() + consumed_frame_count, relay_peer.pcm_frame_count * sizeof(float));
+			}
+		}
+	}
+
+	return output;
+}
+
+void VoiceRelay::_init() {
+}
+
+VoiceRelay::VoiceRelay() {
+	mix_buffer.resize(MIX_FRAME_COUNT);
+	mix_pcm.resize(MIX_FRAME_COUNT);
+	mix_packet.resize(SpeechProcessor::MAX_PACKET_SIZE);
+}
+
+VoiceRelay::~VoiceRelay() {
+}
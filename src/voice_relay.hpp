@@ -0,0 +1,163 @@
+#ifndef VOICE_RELAY_HPP
+#define VOICE_RELAY_HPP
+
+#include <Godot.hpp>
+#include <Array.hpp>
+#include <Dictionary.hpp>
+#include <Reference.hpp>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "core/opus_speech_encoder.hpp"
+#include "speech_decoder.hpp"
+#include "speech_processor.hpp"
+
+namespace godot {
+
+// Server-side relay for SFU-style voice chat. Every peer is both a
+// speaker and a listener. Each process call ranks the speakers heard
+// this tick for every listener, by the loudness carried with each packet
+// scaled by distance, and keeps the top max_forwarded_speakers. A
+// listener never receives more streams than that, however many talk.
+// Small groups may instead get the selected speakers decoded, mixed and
+// re-encoded into a single stream per listener.
+// Not thread-safe, every method must be called from the same thread.
+class VoiceRelay : public Reference {
+	GODOT_CLASS(VoiceRelay, Reference)
+public:
+	// Speaker id of packets holding a mix of several speakers
+	static const int MIXED_SPEAKER_ID = -1;
+	// Packets kept per speaker between process calls, older ones are dropped
+	static const int MAX_QUEUED_PACKETS = 16;
+	// 20 ms frames for mixed streams
+	static const uint32_t MIX_FRAME_COUNT = SpeechProcessor::VOICE_SAMPLE_RATE / 50;
+	// Decoded audio kept per speaker while mixing
+	static const uint32_t MIX_BUFFER_FRAME_COUNT = SpeechProcessor::MAX_BUFFER_FRAME_COUNT * 2;
+	static const int DEFAULT_MIX_BITRATE = 32000;
+
+private:
+	struct QueuedPacket {
+		PoolByteArray byte_array;
+		int buffer_size = 0;
+		float loudness = 0.0;
+		int64_t sequence = 0;
+		int64_t timestamp = 0;
+	};
+
+	struct RelayPeer {
+		int peer_id = -1;
+		Vector3 position;
+
+		// Packets received since the last process call
+		std::vector<QueuedPacket> packets;
+		int packet_count = 0;
+		float loudness = 0.0;
+
+		// Only created once the peer is part of a mixed group
+		Ref<SpeechDecoder> speech_decoder;
+		std::vector<float> pcm_buffer;
+		uint32_t pcm_frame_count = 0;
+
+		std::unique_ptr<OpusSpeechEncoder> mix_encoder;
+		uint32_t mix_sequence = 0;
+		uint32_t mix_timestamp = 0;
+	};
+
+	struct Candidate {
+		int peer_index = 0;
+		float gain = 0.0;
+		float score = 0.0;
+	};
+
+	std::vector<RelayPeer> relay_peers;
+	std::function<Ref<SpeechDecoder>()> speech_decoder_factory;
+
+	int max_forwarded_speakers = 4;
+	float max_distance = 0.0;
+	bool mix_enabled = false;
+	int max_mix_peers = 8;
+	int mix_bitrate = DEFAULT_MIX_BITRATE;
+
+	// Reused on every process call
+	std::vector<Candidate> candidates;
+	std::vector<float> mix_buffer;
+	std::vector<int16_t> mix_pcm;
+	std::vector<uint8_t> mix_packet;
+
+	RelayPeer *_find_peer(int p_peer_id);
+
+	// Fills candidates with the speakers p_listener_index should hear, loudest first
+	int _select_speakers(int p_listener_index);
+
+	bool _prepare_mixing(RelayPeer *p_relay_peer);
+	void _decode_packets(RelayPeer *p_relay_peer);
+	uint32_t _get_mix_frame_count();
+	void _forward_packets(int p_candidate_count, Array &r_packets);
+	void _mix_packets(int p_listener_index, int p_candidate_count, uint32_t p_frame_count, Array &r_packets);
+
+public:
+	static void _register_methods();
+
+	// Called whenever a peer needs a decoder for mixing
+	void register_speech_decoder_factory(const std::function<Ref<SpeechDecoder>()> &p_factory) {
+		speech_decoder_factory = p_factory;
+	}
+
+	bool add_peer(int p_peer_id);
+	void remove_peer(int p_peer_id);
+	bool has_peer(int p_peer_id);
+	int get_peer_count() const;
+
+	void set_peer_position(int p_peer_id, Vector3 p_position);
+	Vector3 get_peer_position(int p_peer_id);
+
+	// Streams each listener receives at most
+	void set_max_forwarded_speakers(int p_count);
+	int get_max_forwarded_speakers() const {
+		return max_forwarded_speakers;
+	}
+
+	// Speakers further away are not heard, 0 disables distance culling
+	void set_max_distance(float p_distance);
+	float get_max_distance() const {
+		return max_distance;
+	}
+
+	// Mixes the selected speakers into one re-encoded stream per listener
+	// while there are at most max_mix_peers peers, forwards otherwise
+	void set_mix_enabled(bool p_enabled);
+	bool is_mix_enabled() const {
+		return mix_enabled;
+	}
+	void set_max_mix_peers(int p_count);
+	int get_max_mix_peers() const {
+		return max_mix_peers;
+	}
+	void set_mix_bitrate(int p_bitrate);
+	int get_mix_bitrate() const {
+		return mix_bitrate;
+	}
+	bool is_mixing();
+
+	// Queues a packet from p_peer_id, adding the peer if needed. The byte
+	// array is shared with the forwarded packets rather than copied.
+	bool push_packet(int p_peer_id, const PoolByteArray &p_byte_array, int p_buffer_size, float p_loudness, int64_t p_sequence, int64_t p_timestamp);
+
+	// Routes everything queued since the last call. Returns a Dictionary
+	// from listener peer id to an Array of packets, each a Dictionary with
+	// speaker_id, byte_array, buffer_size, loudness, sequence and timestamp.
+	// Mixed packets have a speaker_id of MIXED_SPEAKER_ID and their own
+	// sequence and timestamp per listener.
+	Dictionary process();
+
+	void _init();
+
+	VoiceRelay();
+	~VoiceRelay();
+};
+
+}; // namespace godot
+
+#endif // VOICE_RELAY_HPP